@@ -0,0 +1,22 @@
+#include "Animation.h"
+
+Track & Track::key(double time, Vec3 value)
+{
+	// Keep keys sorted by time
+	size_t i = keys.size();
+	while (i > 0 && keys[i - 1].time > time) --i;
+	keys.insert(keys.begin() + i, { time, value });
+	return *this;
+}
+
+Vec3 Track::at(double time) const
+{
+	if (keys.empty()) return Vec3(0.0, 0.0, 0.0);
+	if (time <= keys.front().time) return keys.front().value;
+	if (time >= keys.back().time) return keys.back().value;
+
+	size_t i = 1;
+	while (keys[i].time < time) ++i;
+	double f = (time - keys[i - 1].time) / (keys[i].time - keys[i - 1].time);
+	return keys[i - 1].value * (1.0 - f) + keys[i].value * f;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include <stddef.h>
+#include <vector>
+#include "Vec3.h"
+
+// Keyframed value, linearly interpolated and held constant outside of the keys
+class Track {
+
+public:
+
+	Track() {}
+
+	Track & key(double time, Vec3 value);
+	Vec3 at(double time) const;
+	bool empty() const { return keys.empty(); }
+
+private:
+
+	struct Key {
+		double time;
+		Vec3 value;
+	};
+
+	std::vector<Key> keys;
+
+};
+
+#endif // _ANIMATION_H_
\ No newline at end of file
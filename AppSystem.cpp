@@ -1,8 +1,13 @@
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
 #include "AppSystem.h"
 #include "Vec3.h"
 #include "Body.h"
+#include "Statistics.h"
+#include "Topology.h"
 
 std::chrono::high_resolution_clock::time_point start_time_point;
 
@@ -11,18 +16,445 @@ Uint32 calculated_event;
 Uint32 thread_done_event;
 
 SDL_atomic_t process_threads;
+// Workers number themselves in start order to pick their CPU
+SDL_atomic_t next_thread_index;
+
+// Generation is bumped every time the frame has to be rendered again (e.g. camera moved),
+// workers drop results of older generations. Event code keeps generation and preview level.
+const int GENERATION_MASK = 0x7FFFFFF;
+const int LEVEL_BITS = 4;
+SDL_atomic_t render_generation;
 
 //TODO: generalize synchronization stuff
 SDL_mutex * pixel_queue_mutex;
-volatile int pixel_queue_current = 0;
-int AppSystem::pixel_queue_next() {
-	int pqc = -1;
+SDL_cond * pixel_queue_cond;
+int pixel_queue_current = 0;
+int pixel_queue_generation = 0;
+int pixel_queue_waiting = 0;
+Camera pixel_queue_camera;
+std::vector<AppSystem::PixelTask> * pixel_queue_tasks = nullptr;
+
+bool AppSystem::pixel_queue_next(int generation, PixelTask & task) {
+	bool result = false;
+	SDL_LockMutex(pixel_queue_mutex);
+	if (generation == pixel_queue_generation && pixel_queue_current < (int)pixel_queue_tasks->size()) {
+		task = (*pixel_queue_tasks)[pixel_queue_current++];
+		result = true;
+	}
+	SDL_UnlockMutex(pixel_queue_mutex);
+	return result;
+}
+
+// Blocks until a generation other than the given one is started, returns it with its camera
+int AppSystem::pixel_queue_wait(int generation, Camera & camera) {
+	SDL_LockMutex(pixel_queue_mutex);
+	pixel_queue_waiting++;
+	// pixel_queue_pause() waits on the same condition for all workers to get here
+	SDL_CondBroadcast(pixel_queue_cond);
+	while (SDL_AtomicGet(&process_threads) && pixel_queue_generation == generation) {
+		SDL_CondWait(pixel_queue_cond, pixel_queue_mutex);
+	}
+	pixel_queue_waiting--;
+	generation = pixel_queue_generation;
+	camera = pixel_queue_camera;
+	SDL_UnlockMutex(pixel_queue_mutex);
+	return generation;
+}
+
+// Cancels the work in flight and starts a new generation rendering given tasks with the current camera
+void AppSystem::pixel_queue_start(std::vector<PixelTask> * tasks) {
 	SDL_LockMutex(pixel_queue_mutex);
-	if (pixel_queue_current < WINDOW_HEIGHT * WINDOW_WIDTH) {
-		pqc = pixel_queue_current++;
+	pixel_queue_generation = (pixel_queue_generation + 1) & GENERATION_MASK;
+	pixel_queue_camera = camera;
+	pixel_queue_tasks = tasks;
+	pixel_queue_current = 0;
+	SDL_AtomicSet(&render_generation, pixel_queue_generation);
+	SDL_CondBroadcast(pixel_queue_cond);
+	SDL_UnlockMutex(pixel_queue_mutex);
+
+	threads_done = 0;
+	frame_done = false;
+	start_time_point = std::chrono::high_resolution_clock::now();
+}
+
+// Renders the whole frame from scratch
+void AppSystem::pixel_queue_restart() {
+	if (render.gbuffer()) {
+		// Cached hits are only valid for the old camera
+		pixel_queue_pause();
+		render.gbuffer()->invalidate();
 	}
+	std::fill(pixel_level.begin(), pixel_level.end(), 0xFF);
+	// Workers may still be taking tasks of the old generation from the same list
+	SDL_LockMutex(pixel_queue_mutex);
+	std::vector<PixelTask> * tasks = frame_tasks();
 	SDL_UnlockMutex(pixel_queue_mutex);
-	return pqc;
+	pixel_queue_start(tasks);
+}
+
+// Full restart, or with temporal reuse a reprojected frame on the next refresh
+void AppSystem::camera_moved() {
+	if (TEMPORAL_REUSE) camera_changed = true;
+	else pixel_queue_restart();
+}
+
+// Starts a frame for the moved camera from the last one. Pixels that get their radiance from it
+// are rendered again last, the others go first in the usual coarse to fine order.
+void AppSystem::pixel_queue_reproject() {
+	pixel_queue_pause();
+	if (render.gbuffer()) render.gbuffer()->invalidate();
+
+	std::vector<unsigned char> reused;
+	int count = reproject(reused);
+	for (size_t px = 0; px < reused.size(); ++px) {
+		pixel_level[px] = reused[px] ? 0 : 0xFF;
+	}
+	mark_dirty(0, 0, WINDOW_WIDTH - 1, WINDOW_HEIGHT - 1);
+
+	SDL_LockMutex(pixel_queue_mutex);
+	std::vector<PixelTask> * tasks = frame_tasks();
+	std::vector<PixelTask> refresh;
+	pixel_temporal.clear();
+	for (size_t i = 0; i < tasks->size(); ++i) {
+		const PixelTask & task = (*tasks)[i];
+		if (!reused[task.px]) pixel_temporal.push_back(task);
+		else if (task.level == 0) {
+			refresh.push_back(task);
+			refresh.back().refresh = true;
+		}
+	}
+	pixel_temporal.insert(pixel_temporal.end(), refresh.begin(), refresh.end());
+	SDL_UnlockMutex(pixel_queue_mutex);
+	pixel_queue_start(&pixel_temporal);
+	std::cout << "Reprojected " << count << " of " << reused.size() << " pixels" << std::endl;
+}
+
+// Traces the surface behind every pixel center for the current camera and copies the radiance
+// of full quality pixels the history camera saw the same surface through. Workers must be paused.
+int AppSystem::reproject(std::vector<unsigned char> & reused) {
+	// Surfaces farther apart than this part of their distance, or turned more, aren't the same
+	const double POSITION_TOLERANCE = 0.02;
+	const double NORMAL_TOLERANCE = 0.9;
+
+	const int pixels = WINDOW_WIDTH * WINDOW_HEIGHT;
+	std::vector<float> radiance(hdr_framebuffer);
+	std::vector<BodyMask> bodies(pixel_bodies);
+	std::vector<float> position(pixels * 3, 0.0f), normal(pixels * 3, 0.0f);
+	std::vector<int> row_count(WINDOW_HEIGHT, 0);
+	reused.assign(pixels, 0);
+	if (!temporal_pool) temporal_pool.reset(new ThreadPool(THREADS_COUNT));
+
+	temporal_pool->run(WINDOW_HEIGHT, [&](int y, int) {
+		for (int x = 0; x < WINDOW_WIDTH; ++x) {
+			int px = y * WINDOW_WIDTH + x;
+			Vec3 p, n;
+			int body = render.pixel_surface(x, y, camera, p, n);
+			if (body == -1) continue;
+			position[px * 3 + 0] = (float)p.x;
+			position[px * 3 + 1] = (float)p.y;
+			position[px * 3 + 2] = (float)p.z;
+			normal[px * 3 + 0] = (float)n.x;
+			normal[px * 3 + 1] = (float)n.y;
+			normal[px * 3 + 2] = (float)n.z;
+
+			// Mirrors and glass show something else from another place
+			const Material & material = render.get_body(body).material;
+			if (material.pure_reflective_color || material.refractive_color) continue;
+
+			double sx, sy;
+			if (!history_camera.project(p, sx, sy)) continue;
+			int ox = (int)floor(sx * WINDOW_WIDTH), oy = (int)floor(sy * WINDOW_HEIGHT);
+			if (ox < 0 || oy < 0 || ox >= WINDOW_WIDTH || oy >= WINDOW_HEIGHT) continue;
+			int old = oy * WINDOW_WIDTH + ox;
+			if (pixel_level[old] != 0) continue;
+
+			// Disocclusion: the history pixel saw something in front of this surface, or another one
+			Vec3 old_p(history_position[old * 3 + 0], history_position[old * 3 + 1], history_position[old * 3 + 2]);
+			Vec3 old_n(history_normal[old * 3 + 0], history_normal[old * 3 + 1], history_normal[old * 3 + 2]);
+			if ((old_p - p).length() > POSITION_TOLERANCE * (p - history_camera.position).length()) continue;
+			if (old_n.dot(n) < NORMAL_TOLERANCE) continue;
+
+			std::copy(&radiance[old * 3], &radiance[old * 3] + 3, &hdr_framebuffer[px * 3]);
+			// The pixel is final, update_body() has to know what its reused paths touched
+			pixel_bodies[px] = bodies[old];
+			reused[px] = 1;
+			row_count[y]++;
+		}
+	});
+
+	history_position.swap(position);
+	history_normal.swap(normal);
+	history_camera = camera;
+	int count = 0;
+	for (int y = 0; y < WINDOW_HEIGHT; ++y) count += row_count[y];
+	return count;
+}
+
+// Tasks of a whole frame in priority order, only the region of interest when cropping
+std::vector<AppSystem::PixelTask> * AppSystem::frame_tasks() {
+	if (roi_crop && has_roi()) {
+		pixel_crop.clear();
+		for (size_t i = 0; i < pixel_order.size(); ++i) {
+			if (in_roi(pixel_order[i].px)) pixel_crop.push_back(pixel_order[i]);
+		}
+		order_tasks(pixel_crop, 0);
+		return &pixel_crop;
+	}
+	order_tasks(pixel_order, 0);
+	return &pixel_order;
+}
+
+// Moves tasks from first on so coarse levels still come first, and within a level tiles
+// nearer to the region of interest come first. Without a region the order is top to bottom.
+// Refresh tasks of reprojected pixels stay behind all the others.
+void AppSystem::order_tasks(std::vector<PixelTask> & tasks, size_t first) {
+	int tiles = tiles_x * tiles_y;
+	std::vector<std::pair<double, int>> by_distance(tiles);
+	for (int tile = 0; tile < tiles; ++tile) {
+		double distance = tile;
+		if (has_roi()) {
+			// Squared distance of the tile center to the rectangle, 0 inside
+			double cx = ((tile % tiles_x) + 0.5) * POST_TILE_SIZE;
+			double cy = ((tile / tiles_x) + 0.5) * POST_TILE_SIZE;
+			double dx = std::max(std::max(roi_x0 - cx, cx - roi_x1), 0.0);
+			double dy = std::max(std::max(roi_y0 - cy, cy - roi_y1), 0.0);
+			distance = dx * dx + dy * dy;
+		}
+		by_distance[tile] = std::make_pair(distance, tile);
+	}
+	std::sort(by_distance.begin(), by_distance.end());
+	std::vector<int> tile_rank(tiles);
+	for (int i = 0; i < tiles; ++i) tile_rank[by_distance[i].second] = i;
+
+	// Counting sort, stable so pixels of a tile keep their row order
+	auto key = [&](const PixelTask & task) {
+		int x = task.px % WINDOW_WIDTH, y = task.px / WINDOW_WIDTH;
+		return ((task.refresh ? PREVIEW_LEVELS + 1 : 0) + PREVIEW_LEVELS - task.level) * tiles
+			+ tile_rank[(y / POST_TILE_SIZE) * tiles_x + x / POST_TILE_SIZE];
+	};
+	std::vector<int> offsets(2 * (PREVIEW_LEVELS + 1) * tiles + 1, 0);
+	for (size_t i = first; i < tasks.size(); ++i) offsets[key(tasks[i]) + 1]++;
+	for (size_t k = 1; k < offsets.size(); ++k) offsets[k] += offsets[k - 1];
+	std::vector<PixelTask> sorted(tasks.size() - first);
+	for (size_t i = first; i < tasks.size(); ++i) sorted[offsets[key(tasks[i])]++] = tasks[i];
+	std::copy(sorted.begin(), sorted.end(), tasks.begin() + first);
+}
+
+// Orders the tasks nobody took yet for the moved region, the frame goes on without a restart
+void AppSystem::pixel_queue_reprioritize() {
+	SDL_LockMutex(pixel_queue_mutex);
+	order_tasks(*pixel_queue_tasks, pixel_queue_current);
+	SDL_UnlockMutex(pixel_queue_mutex);
+}
+
+void AppSystem::set_roi(int x0, int y0, int x1, int y1) {
+	roi_x0 = std::max(std::min(x0, x1), 0);
+	roi_y0 = std::max(std::min(y0, y1), 0);
+	roi_x1 = std::min(std::max(x0, x1), WINDOW_WIDTH - 1);
+	roi_y1 = std::min(std::max(y0, y1), WINDOW_HEIGHT - 1);
+}
+
+bool AppSystem::in_roi(int px) const {
+	int x = px % WINDOW_WIDTH, y = px / WINDOW_WIDTH;
+	return x >= roi_x0 && x <= roi_x1 && y >= roi_y0 && y <= roi_y1;
+}
+
+// Cancels the work in flight and returns once no worker is rendering, so the scene can be edited
+void AppSystem::pixel_queue_pause() {
+	static std::vector<PixelTask> no_tasks;
+	pixel_queue_start(&no_tasks);
+	SDL_LockMutex(pixel_queue_mutex);
+	while (pixel_queue_waiting < threads_running) {
+		SDL_CondWait(pixel_queue_cond, pixel_queue_mutex);
+	}
+	SDL_UnlockMutex(pixel_queue_mutex);
+}
+
+// Replaces a body and re-renders only pixels whose paths touched it
+void AppSystem::update_body(int body_number, const Body & body) {
+	pixel_queue_pause();
+
+	BodyMask bit = body_bit(body_number);
+	std::vector<unsigned char> dirty(WINDOW_WIDTH * WINDOW_HEIGHT, 0);
+	for (size_t i = 0; i < dirty.size(); ++i) {
+		// Pixels without a final render yet are dirty anyway
+		dirty[i] = pixel_level[i] != 0 || (pixel_bodies[i] & bit) != 0;
+	}
+
+	// A new shape may show up in pixels that never touched the old one. Its direct
+	// projection is covered here, new reflections and shadows elsewhere are not.
+	bool shape_changed = render.get_body(body_number).shape != body.shape;
+	if (render.gbuffer()) {
+		if (shape_changed) render.gbuffer()->invalidate();
+		else render.gbuffer()->invalidate_body(body_number);
+	}
+	for (int pass = 0; pass < 2 && shape_changed; ++pass) {
+		if (pass == 1) render.set_body(body_number, body);
+		int x0 = 0, y0 = 0, x1 = WINDOW_WIDTH - 1, y1 = WINDOW_HEIGHT - 1;
+		render.body_screen_bounds(body_number, camera, x0, y0, x1, y1);
+		for (int y = std::max(y0, 0); y <= y1 && y < WINDOW_HEIGHT; ++y) {
+			for (int x = std::max(x0, 0); x <= x1 && x < WINDOW_WIDTH; ++x) {
+				dirty[y * WINDOW_WIDTH + x] = 1;
+			}
+		}
+	}
+	render.set_body(body_number, body);
+
+	pixel_dirty.clear();
+	for (int px = 0; px < WINDOW_WIDTH * WINDOW_HEIGHT; ++px) {
+		if (dirty[px] && (!roi_crop || !has_roi() || in_roi(px))) {
+			// Keep it dirty if this pass gets cancelled too
+			if (pixel_level[px] == 0) pixel_level[px] = 1;
+			pixel_dirty.push_back({ px, 0 });
+		}
+	}
+	std::cout << "Body " << body_number << " changed, re-rendering " << pixel_dirty.size() << " of " << dirty.size() << " pixels" << std::endl;
+	order_tasks(pixel_dirty, 0);
+	pixel_queue_start(&pixel_dirty);
+}
+
+// Look-dev helper, multiplies colours of the picked body by the next tint
+void AppSystem::tint_selected_body() {
+	static const Vec3 tints[] = { Vec3(1.0, 0.6, 0.6), Vec3(0.6, 1.0, 0.6), Vec3(0.6, 0.6, 1.0) };
+	if (selected_body < 0 || selected_body >= render.bodies_count()) return;
+
+	Vec3 tint = tints[tint_index++ % 3];
+	Body body = render.get_body(selected_body);
+	std::function<Vec3(Vec3, Vec3)> * channels[] = {
+		&body.material.simple_diffuse_color,
+		&body.material.diffuse_color,
+		&body.material.pure_reflective_color,
+		&body.material.refractive_color,
+	};
+	for (auto channel : channels) {
+		if (*channel) {
+			std::function<Vec3(Vec3, Vec3)> fn = *channel;
+			*channel = [fn, tint](Vec3 p, Vec3 n) { return fn(p, n) * tint; };
+		}
+	}
+	update_body(selected_body, body);
+}
+
+// Reads the scene file again and applies its textures, bodies it no longer mentions get their built in material back
+void AppSystem::reload_textures() {
+	Configurer fresh;
+	fresh.texture_programs = texture_programs;
+	fresh.load(SCENE_PATH);
+	std::vector<int> changed(textured_bodies);
+	changed.insert(changed.end(), fresh.textured_bodies.begin(), fresh.textured_bodies.end());
+	std::sort(changed.begin(), changed.end());
+	changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+	for (size_t i = 0; i < changed.size(); ++i) {
+		int body_number = changed[i];
+		if (body_number >= render.bodies_count() || body_number >= (int)fresh.bodies.size()) continue;
+		Body body = render.get_body(body_number);
+		body.material = fresh.bodies[body_number].material;
+		update_body(body_number, body);
+	}
+	textured_bodies = fresh.textured_bodies;
+	texture_programs = fresh.texture_programs;
+	std::cout << "Reloaded " << SCENE_PATH << std::endl;
+}
+
+// Replaces the finished frame on screen with its filtered version, workers are idle meanwhile
+void AppSystem::denoise_frame() {
+	auto denoise_start = std::chrono::high_resolution_clock::now();
+	// Filter weights are tuned for display colors
+	Image image(WINDOW_WIDTH, WINDOW_HEIGHT);
+	for (int i = 0; i < WINDOW_WIDTH * WINDOW_HEIGHT; ++i) {
+		image.pixels[i] = tonemap.map(Vec3(hdr_framebuffer[i * 3 + 0], hdr_framebuffer[i * 3 + 1], hdr_framebuffer[i * 3 + 2]));
+	}
+	denoiser->gather(render, camera);
+	denoiser->apply(image);
+	// Whole surface is replaced, tiles must not bring the noisy colors back
+	std::fill(tile_dirty.begin(), tile_dirty.end(), 0);
+
+	SDL_LockSurface(surface);
+	for (int i = 0; i < WINDOW_WIDTH * WINDOW_HEIGHT; ++i) {
+		const Vec3 & col = image.pixels[i];
+		Uint32 * row = (Uint32 *)((Uint8 *)surface->pixels + (i / WINDOW_WIDTH) * surface->pitch);
+		row[i % WINDOW_WIDTH] = SDL_MapRGB(surface->format,
+			static_cast<Uint8>(std::min(std::max(col.r, 0.0), 1.0) * 0xFF),
+			static_cast<Uint8>(std::min(std::max(col.g, 0.0), 1.0) * 0xFF),
+			static_cast<Uint8>(std::min(std::max(col.b, 0.0), 1.0) * 0xFF));
+	}
+	SDL_UnlockSurface(surface);
+
+	long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - denoise_start).count();
+	std::cout << "Denoise time : " << ms << " ms." << std::endl;
+}
+
+// Rectangle is inclusive and in pixels
+void AppSystem::mark_dirty(int x0, int y0, int x1, int y1) {
+	for (int ty = y0 / POST_TILE_SIZE; ty <= y1 / POST_TILE_SIZE && ty < tiles_y; ++ty) {
+		for (int tx = x0 / POST_TILE_SIZE; tx <= x1 / POST_TILE_SIZE && tx < tiles_x; ++tx) {
+			tile_dirty[ty * tiles_x + tx] = 1;
+		}
+	}
+}
+
+// Tone maps changed tiles to the surface, workers keep writing the float framebuffer meanwhile
+void AppSystem::present_tiles() {
+	std::vector<float> rgb(POST_TILE_SIZE * 3);
+	std::vector<Uint32> packed(POST_TILE_SIZE);
+	SDL_LockSurface(surface);
+	for (int tile = 0; tile < tiles_x * tiles_y; ++tile) {
+		if (!tile_dirty[tile]) continue;
+		tile_dirty[tile] = 0;
+		int x0 = (tile % tiles_x) * POST_TILE_SIZE;
+		int y0 = (tile / tiles_x) * POST_TILE_SIZE;
+		int width = std::min(POST_TILE_SIZE, WINDOW_WIDTH - x0);
+		for (int y = y0; y < y0 + POST_TILE_SIZE && y < WINDOW_HEIGHT; ++y) {
+			for (int x = x0; x < x0 + width; ++x) {
+				int j = y * WINDOW_WIDTH + x;
+				// Preview squares show the color of their top left pixel
+				int level = pixel_level[j];
+				if (level != 0 && level != 0xFF) {
+					int mask = ~((1 << level) - 1);
+					j = (y & mask) * WINDOW_WIDTH + (x & mask);
+				}
+				rgb[(x - x0) * 3 + 0] = hdr_framebuffer[j * 3 + 0];
+				rgb[(x - x0) * 3 + 1] = hdr_framebuffer[j * 3 + 1];
+				rgb[(x - x0) * 3 + 2] = hdr_framebuffer[j * 3 + 2];
+			}
+			Uint32 * row = (Uint32 *)((Uint8 *)surface->pixels + y * surface->pitch) + x0;
+			if (direct_pixels) {
+				tonemap.apply(rgb.data(), row, width);
+				if (alpha_mask) {
+					for (int x = 0; x < width; ++x) row[x] |= alpha_mask;
+				}
+			}
+			else {
+				tonemap.apply(rgb.data(), packed.data(), width);
+				for (int x = 0; x < width; ++x) {
+					Uint8 * bytes = (Uint8 *)surface->pixels + y * surface->pitch + (x0 + x) * surface->format->BytesPerPixel;
+					Uint32 clr = SDL_MapRGB(surface->format, (packed[x] >> 16) & 0xFF, (packed[x] >> 8) & 0xFF, packed[x] & 0xFF);
+					memcpy(bytes, &clr, surface->format->BytesPerPixel);
+				}
+			}
+		}
+	}
+	SDL_UnlockSurface(surface);
+}
+
+void AppSystem::build_pixel_order() {
+	pixel_order.clear();
+	// Every level renders pixels on its grid that coarser levels didn't
+	for (int level = PREVIEW_LEVELS; level > 0; --level) {
+		int step = 1 << level;
+		for (int y = 0; y < WINDOW_HEIGHT; y += step) {
+			for (int x = 0; x < WINDOW_WIDTH; x += step) {
+				if (level == PREVIEW_LEVELS || (x % (step * 2)) != 0 || (y % (step * 2)) != 0) {
+					pixel_order.push_back({ y * WINDOW_WIDTH + x, level });
+				}
+			}
+		}
+	}
+	// Final pass renders everything with full quality
+	for (int px = 0; px < WINDOW_WIDTH * WINDOW_HEIGHT; ++px) {
+		pixel_order.push_back({ px, 0 });
+	}
 }
 
 Uint32 framerate_timer_callback(Uint32 interval, void * param)
@@ -38,13 +470,57 @@ Uint32 framerate_timer_callback(Uint32 interval, void * param)
 }
 
 AppSystem::AppSystem(const Configurer & config)
-	: render(config)
+	: render(config), camera(config), tonemap(config)
 {
 	this->WINDOW_TITLE = config.window_title;
 	this->WINDOW_WIDTH = config.window_width;
 	this->WINDOW_HEIGHT = config.window_height;
 	this->FRAMERATE = config.framerate;
-	this->THREADS_COUNT = config.threads_count;
+	this->THREADS_COUNT = Topology::get().threads_for(config.threads_count);
+	this->PREVIEW_LEVELS = config.preview_levels;
+	this->AA_FACTOR = config.aa_factor;
+	this->CAM_MOVE_STEP = config.cam_move_step;
+	this->CAM_ROTATE_STEP = config.cam_rotate_step;
+	this->MOUSE_SENSITIVITY = config.mouse_sensitivity;
+	this->TEMPORAL_REUSE = config.temporal_reuse;
+	this->HEATMAP_PATH = config.heatmap_path;
+	this->SCENE_PATH = config.scene_path;
+	this->textured_bodies = config.textured_bodies;
+	this->texture_programs = config.texture_programs;
+	if (!HEATMAP_PATH.empty()) {
+		heatmap.reset(new Heatmap(WINDOW_WIDTH, WINDOW_HEIGHT));
+	}
+	if (config.denoise_iterations > 0) {
+		denoiser.reset(new Denoiser(config));
+	}
+	hdr_framebuffer.assign(WINDOW_WIDTH * WINDOW_HEIGHT * 3, 0.0f);
+	tiles_x = (WINDOW_WIDTH + POST_TILE_SIZE - 1) / POST_TILE_SIZE;
+	tiles_y = (WINDOW_HEIGHT + POST_TILE_SIZE - 1) / POST_TILE_SIZE;
+	tile_dirty.assign(tiles_x * tiles_y, 0);
+	direct_pixels = false;
+	alpha_mask = 0;
+	frame_done = false;
+	build_pixel_order();
+	roi_x0 = roi_y0 = 0;
+	roi_x1 = roi_y1 = -1;
+	roi_width = std::max(config.roi_width, 1);
+	roi_height = std::max(config.roi_height, 1);
+	if (config.roi_width > 0 && config.roi_height > 0) {
+		set_roi(config.roi_x, config.roi_y, config.roi_x + config.roi_width - 1, config.roi_y + config.roi_height - 1);
+	}
+	roi_follow_mouse = config.roi_follow_mouse;
+	roi_crop = config.roi_crop;
+	roi_changed = false;
+	roi_drag_x = roi_drag_y = -1;
+	pixel_level.assign(WINDOW_WIDTH * WINDOW_HEIGHT, 0xFF);
+	pixel_bodies.assign(WINDOW_WIDTH * WINDOW_HEIGHT, 0);
+	threads_done = 0;
+	threads_running = 0;
+	selected_body = -1;
+	tint_index = 0;
+	history_position.assign(WINDOW_WIDTH * WINDOW_HEIGHT * 3, 0.0f);
+	history_normal.assign(WINDOW_WIDTH * WINDOW_HEIGHT * 3, 0.0f);
+	camera_changed = false;
 }
 
 AppSystem::InitPhase AppSystem::init()
@@ -66,6 +542,12 @@ AppSystem::InitPhase AppSystem::init()
 		return InitPhase::FAIL_GET_SURFACE;
 	}
 	SDL_FillRect(surface, nullptr, SDL_MapRGB(surface->format, 0x80, 0x80, 0x80));
+	SDL_PixelFormat * format = surface->format;
+	if (format->BytesPerPixel == 4 && format->Rloss == 0 && format->Gloss == 0 && format->Bloss == 0) {
+		tonemap.set_pixel_format(format->Rshift, format->Gshift, format->Bshift);
+		direct_pixels = true;
+		alpha_mask = format->Amask;
+	}
 
 	framerate_event = SDL_RegisterEvents(3);
 	if (framerate_event == (Uint32)-1) {
@@ -87,16 +569,37 @@ AppSystem::InitPhase AppSystem::init()
 		return InitPhase::FAIL_CREATE_MUTEX;
 	}
 
+	pixel_queue_cond = SDL_CreateCond();
+	if (pixel_queue_cond == nullptr) {
+		std::cerr << "SDL_CreateCond() error : " << SDL_GetError() << std::endl;
+		return InitPhase::FAIL_CREATE_COND;
+	}
+
+	if (TEMPORAL_REUSE) {
+		// Nothing to reuse yet, the first camera move needs the surfaces of the first frame
+		std::vector<unsigned char> reused;
+		reproject(reused);
+	}
+
 	start_time_point = std::chrono::high_resolution_clock::now();
+	pixel_queue_camera = camera;
+	pixel_queue_tasks = frame_tasks();
+	SDL_AtomicSet(&render_generation, pixel_queue_generation);
 
+	Topology::get().print(std::cout);
+	thread_cpus = Topology::get().worker_cpus(THREADS_COUNT);
 	threads = new SDL_Thread *[THREADS_COUNT];
 	SDL_AtomicSet(&process_threads, 1);
+	SDL_AtomicSet(&next_thread_index, 0);
 	for (int i = 0; i < THREADS_COUNT; ++i) {
 		std::cout << "Creating thread " << i << "... " << std::flush;
 		threads[i] = SDL_CreateThread(calculation_thread_function_wrapper, nullptr, this);
 		if (threads[i] == nullptr) {
 			std::cerr << "SDL_CreateThread() [" << i << "] error : " << SDL_GetError() << std::endl;
 		}
+		else {
+			threads_running++;
+		}
 		std::cout << "Done!" << std::endl;
 	}
 
@@ -109,6 +612,9 @@ void AppSystem::cleanup(InitPhase init_result)
 	default:
 	case InitPhase::SUCCESS:
 		delete[] threads;
+		std::cout << "Destroying condition..." << std::endl;
+		SDL_DestroyCond(pixel_queue_cond);
+	case InitPhase::FAIL_CREATE_COND:
 		std::cout << "Destroying mutex..." << std::endl;
 		SDL_DestroyMutex(pixel_queue_mutex);
 	case InitPhase::FAIL_CREATE_MUTEX:
@@ -135,47 +641,108 @@ int AppSystem::calculation_thread_function_wrapper(void * data)
 
 int AppSystem::calculation_thread_function(void * data)
 {
-	int px;
-	while ((px = pixel_queue_next()) != -1 && SDL_AtomicGet(&process_threads)) {
+	int index = SDL_AtomicAdd(&next_thread_index, 1);
+	Topology::pin_worker(Topology::get().cpus()[thread_cpus[index]]);
+
+	int generation = -1;
+	Camera task_camera;
+	PixelTask task;
+
+	while (SDL_AtomicGet(&process_threads)) {
+		// Workers stay alive between frames and wait here for the next generation
+		generation = pixel_queue_wait(generation, task_camera);
+
+		while (SDL_AtomicGet(&process_threads) && pixel_queue_next(generation, task)) {
+
+			int x = task.px % WINDOW_WIDTH;
+			int y = task.px / WINDOW_WIDTH;
 
-		int x = px % WINDOW_WIDTH;
-		int y = px / WINDOW_WIDTH;
+			std::chrono::high_resolution_clock::time_point pixel_start;
+			if (heatmap) pixel_start = std::chrono::high_resolution_clock::now();
+
+			BodyMask touched = 0;
+			Vec3 col = render.pixel_color(x, y, task_camera, task.level == 0 ? AA_FACTOR : 1, task.level == 0 ? &touched : nullptr);
+
+			if (heatmap && task.level == 0) {
+				heatmap->record(task.px, (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - pixel_start).count());
+			}
+
+			// Frame was restarted while we were busy, result is stale. Checked under the queue mutex
+			// pixel_queue_start() holds for a new generation, so no stale pixel lands after it.
+			SDL_LockMutex(pixel_queue_mutex);
+			bool current = pixel_queue_generation == generation;
+			if (current) {
+				if (task.level == 0) pixel_bodies[task.px] = touched;
+				// Tone mapping is left to the main thread, it converts whole tiles at once
+				hdr_framebuffer[task.px * 3 + 0] = (float)col.r;
+				hdr_framebuffer[task.px * 3 + 1] = (float)col.g;
+				hdr_framebuffer[task.px * 3 + 2] = (float)col.b;
+			}
+			SDL_UnlockMutex(pixel_queue_mutex);
+			if (!current) break;
 
-		Vec3 col = render.pixel_color(x, y);
+			SDL_UserEvent ue = {};
+			ue.type = calculated_event;
+			ue.code = (generation << LEVEL_BITS) | task.level;
+			ue.data1 = (void*)((long long)task.px);
+			SDL_Event e = {};
+			e.type = calculated_event;
+			e.user = ue;
 		
-		Uint32 clr = SDL_MapRGB(surface->format, 
-			static_cast<Uint8>(col.r * 0xFF), 
-			static_cast<Uint8>(col.g * 0xFF), 
-			static_cast<Uint8>(col.b * 0xFF));
+			while (SDL_AtomicGet(&process_threads) && SDL_AtomicGet(&render_generation) == generation && SDL_PushEvent(&e) < 0) {
+				SDL_Delay(10);
+			};
+		}
 
 		SDL_UserEvent ue = {};
-		ue.type = calculated_event;
-		ue.data1 = (void*)((long long)px);
-		ue.data2 = (void*)((long long)clr);
+		ue.type = thread_done_event;
+		ue.code = generation;
 		SDL_Event e = {};
-		e.type = calculated_event;
 		e.user = ue;
-		
-		while (SDL_AtomicGet(&process_threads) && SDL_PushEvent(&e) < 0) {
+
+		while (SDL_AtomicGet(&process_threads) && SDL_AtomicGet(&render_generation) == generation && SDL_PushEvent(&e) < 0) {
 			SDL_Delay(10);
 		};
 	}
 
-	SDL_UserEvent ue = {};
-	ue.type = thread_done_event;
-	SDL_Event e = {};
-	e.user = ue;
+	return 0;
+}
 
-	while (SDL_AtomicGet(&process_threads) && SDL_PushEvent(&e) < 0) {
-		SDL_Delay(10);
-	};
+// Returns true if the camera was moved
+bool AppSystem::camera_key(SDL_Scancode key)
+{
+	switch (key) {
+	case SDL_SCANCODE_W: camera.move(Vec3(0.0, 0.0, CAM_MOVE_STEP)); break;
+	case SDL_SCANCODE_S: camera.move(Vec3(0.0, 0.0, -CAM_MOVE_STEP)); break;
+	case SDL_SCANCODE_D: camera.move(Vec3(CAM_MOVE_STEP, 0.0, 0.0)); break;
+	case SDL_SCANCODE_A: camera.move(Vec3(-CAM_MOVE_STEP, 0.0, 0.0)); break;
+	case SDL_SCANCODE_R: camera.move(Vec3(0.0, CAM_MOVE_STEP, 0.0)); break;
+	case SDL_SCANCODE_F: camera.move(Vec3(0.0, -CAM_MOVE_STEP, 0.0)); break;
+	case SDL_SCANCODE_RIGHT: camera.rotate(CAM_ROTATE_STEP, 0.0); break;
+	case SDL_SCANCODE_LEFT: camera.rotate(-CAM_ROTATE_STEP, 0.0); break;
+	case SDL_SCANCODE_UP: camera.rotate(0.0, CAM_ROTATE_STEP); break;
+	case SDL_SCANCODE_DOWN: camera.rotate(0.0, -CAM_ROTATE_STEP); break;
+	default: return false;
+	}
+	return true;
+}
 
-	return 0;
+// Returns true if exposure or gamma changed, the frame only needs to be tone mapped again
+bool AppSystem::tonemap_key(SDL_Scancode key)
+{
+	switch (key) {
+	case SDL_SCANCODE_EQUALS: tonemap.set_exposure(tonemap.get_exposure() * pow(2.0, 0.25)); break;
+	case SDL_SCANCODE_MINUS: tonemap.set_exposure(tonemap.get_exposure() / pow(2.0, 0.25)); break;
+	case SDL_SCANCODE_RIGHTBRACKET: tonemap.set_gamma(tonemap.get_gamma() + 0.1); break;
+	case SDL_SCANCODE_LEFTBRACKET: tonemap.set_gamma(std::max(tonemap.get_gamma() - 0.1, 0.1)); break;
+	default: return false;
+	}
+	std::cout << "Exposure : " << tonemap.get_exposure() << ", gamma : " << tonemap.get_gamma() << std::endl;
+	return true;
 }
 
 void AppSystem::loop()
 {
-	int threads_done = 0;
 	bool processing = true;
 	SDL_Event e;
 
@@ -189,6 +756,10 @@ void AppSystem::loop()
 			// Quit program
 			processing = false;
 			SDL_AtomicSet(&process_threads, 0);
+			// Wake up workers waiting for the next generation
+			SDL_LockMutex(pixel_queue_mutex);
+			SDL_CondBroadcast(pixel_queue_cond);
+			SDL_UnlockMutex(pixel_queue_mutex);
 			for (int i = 0; i < THREADS_COUNT; ++i) {
 				std::cout << "Waiting " << i << "... " << std::flush;
 				int ecode = 0;
@@ -198,26 +769,111 @@ void AppSystem::loop()
 				std::cout << "Done! Code : " << ecode << std::endl;
 			}
 		}
+		else if (e.type == SDL_KEYDOWN) {
+			if (camera_key(e.key.keysym.scancode)) {
+				camera_moved();
+			}
+			else if (e.key.keysym.scancode == SDL_SCANCODE_T) {
+				tint_selected_body();
+			}
+			else if (e.key.keysym.scancode == SDL_SCANCODE_L) {
+				reload_textures();
+			}
+			else if (e.key.keysym.scancode == SDL_SCANCODE_C) {
+				roi_crop = !roi_crop;
+				std::cout << "Crop to region of interest : " << (roi_crop ? "on" : "off") << std::endl;
+				pixel_queue_restart();
+			}
+			else if (e.key.keysym.scancode == SDL_SCANCODE_M) {
+				roi_follow_mouse = !roi_follow_mouse;
+				std::cout << "Region of interest follows mouse : " << (roi_follow_mouse ? "on" : "off") << std::endl;
+			}
+			else if (tonemap_key(e.key.keysym.scancode)) {
+				mark_dirty(0, 0, WINDOW_WIDTH - 1, WINDOW_HEIGHT - 1);
+				if (frame_done && denoiser) denoise_frame();
+			}
+		}
+		else if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_RIGHT) {
+			selected_body = render.pick_body(e.button.x, e.button.y, camera);
+			std::cout << "Selected body : " << selected_body << std::endl;
+		}
+		else if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_MIDDLE) {
+			roi_drag_x = e.button.x;
+			roi_drag_y = e.button.y;
+		}
+		else if (e.type == SDL_MOUSEBUTTONUP && e.button.button == SDL_BUTTON_MIDDLE && roi_drag_x >= 0) {
+			// Region of interest is the dragged rectangle
+			set_roi(roi_drag_x, roi_drag_y, e.button.x, e.button.y);
+			roi_width = roi_x1 - roi_x0 + 1;
+			roi_height = roi_y1 - roi_y0 + 1;
+			roi_drag_x = roi_drag_y = -1;
+			if (roi_crop) pixel_queue_restart();
+			else roi_changed = true;
+		}
+		else if (e.type == SDL_MOUSEMOTION) {
+			// Look around while left button is held
+			if (e.motion.state & SDL_BUTTON_LMASK) {
+				camera.rotate(e.motion.xrel * MOUSE_SENSITIVITY, -e.motion.yrel * MOUSE_SENSITIVITY);
+				camera_moved();
+			}
+			else if (roi_follow_mouse && roi_drag_x < 0) {
+				int x0 = e.motion.x - roi_width / 2, y0 = e.motion.y - roi_height / 2;
+				set_roi(x0, y0, x0 + roi_width - 1, y0 + roi_height - 1);
+				roi_changed = true;
+			}
+		}
 		else if (e.type == framerate_event) {
+			if (camera_changed) {
+				camera_changed = false;
+				pixel_queue_reproject();
+			}
+			// Tasks are reordered at most once per refresh, however often the mouse moves
+			if (roi_changed) {
+				roi_changed = false;
+				pixel_queue_reprioritize();
+			}
 			// Refresh frame
+			present_tiles();
 			if (SDL_UpdateWindowSurface(window) != 0) {
 				std::cerr << "SDL_UpdateWindowSurface() error : " << SDL_GetError() << std::endl;
 			}
 		}
 		else if (e.type == calculated_event) {
-			// Add calculated pixel to a framebuffer
+			// Pixel is in the float framebuffer already, note which squares show it. Skip pixels of cancelled frames
+			if ((e.user.code >> LEVEL_BITS) != pixel_queue_generation) continue;
+			int level = e.user.code & ((1 << LEVEL_BITS) - 1);
 			int i = static_cast<int>((long long)e.user.data1);
-			Uint32 clr = static_cast<Uint32>((long long)e.user.data2);
-			SDL_LockSurface(surface);
-			((Uint32 *)surface->pixels)[i] = clr;
-			SDL_UnlockSurface(surface);
+			int x0 = i % WINDOW_WIDTH;
+			int y0 = i / WINDOW_WIDTH;
+			int step = 1 << level;
+			for (int y = y0; y < y0 + step && y < WINDOW_HEIGHT; ++y) {
+				for (int x = x0; x < x0 + step && x < WINDOW_WIDTH; ++x) {
+					int j = y * WINDOW_WIDTH + x;
+					if (pixel_level[j] >= level) {
+						pixel_level[j] = level;
+					}
+				}
+			}
+			mark_dirty(x0, y0, std::min(x0 + step, WINDOW_WIDTH) - 1, std::min(y0 + step, WINDOW_HEIGHT) - 1);
 		}
 		else if (e.type == thread_done_event) {
+			if (e.user.code != pixel_queue_generation) continue;
 			threads_done++;
 			if (threads_done == THREADS_COUNT) {
 				std::cout << "Threads are done!" << std::endl;
 				long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time_point).count();
 				std::cout << "Render time : " << ms << " ms." << std::endl;
+#ifdef RAYTRACER_STATISTICS
+				Statistics::collect().print(std::cout);
+#endif
+				if (heatmap) {
+					heatmap->print_summary(std::cout);
+					if (heatmap->save(HEATMAP_PATH)) {
+						std::cout << "Heatmap saved to " << HEATMAP_PATH << ".ppm/.pfm" << std::endl;
+					}
+				}
+				frame_done = true;
+				if (denoiser) denoise_frame();
 			}
 		}
 
@@ -6,6 +6,14 @@
 #include <SDL2/SDL.h>
 #include "Configurer.h"
 #include "Render.h"
+#include "Camera.h"
+#include "Heatmap.h"
+#include "Denoiser.h"
+#include "Tonemap.h"
+#include "Image.h"
+#include "ThreadPool.h"
+#include <memory>
+#include <vector>
 
 class AppSystem {
 
@@ -19,6 +27,7 @@ public:
 		FAIL_REGISTER_EVENTS,
 		FAIL_ADD_TIMER,
 		FAIL_CREATE_MUTEX,
+		FAIL_CREATE_COND,
 	};
 
 	AppSystem(const Configurer & config);
@@ -27,11 +36,95 @@ public:
 	void loop();
 	void cleanup(InitPhase init_result);
 
+	static const int POST_TILE_SIZE = 32;
+
+	// Pixel to render, preview pixels cover (1 << level) square and use one sample
+	struct PixelTask {
+		int px;
+		int level;
+		bool refresh; // final pass of a pixel already showing reprojected radiance, goes after all others
+	};
+
 private:
 
 	Render render;
+	Camera camera;
+	std::unique_ptr<Heatmap> heatmap;
+	std::unique_ptr<Denoiser> denoiser;
+	Tonemap tonemap;
+	// Linear colors workers write, preview pixels only at the top left of their square
+	std::vector<float> hdr_framebuffer;
+	// Screen tiles whose pixels changed since they were last tone mapped to the surface
+	std::vector<unsigned char> tile_dirty;
+	int tiles_x;
+	int tiles_y;
+	// Surface takes packed 8-bit channels, no SDL_MapRGB() per pixel needed
+	bool direct_pixels;
+	Uint32 alpha_mask;
+	bool frame_done;
+
+	// Coarse to fine order of the whole frame
+	std::vector<PixelTask> pixel_order;
+	// Pixels invalidated by the last scene edit
+	std::vector<PixelTask> pixel_dirty;
+	// Level of the task that last wrote a screen pixel, so late preview pixels don't cover finer ones
+	std::vector<unsigned char> pixel_level;
+	// Bodies the paths of a pixel touched in its last full quality render
+	std::vector<BodyMask> pixel_bodies;
+	// Pixels of the region of interest when cropping to it
+	std::vector<PixelTask> pixel_crop;
+	// Region of interest (inclusive) rendered first, x1 < 0 if none
+	int roi_x0, roi_y0, roi_x1, roi_y1;
+	// Size the region keeps when it follows the mouse
+	int roi_width;
+	int roi_height;
+	bool roi_follow_mouse;
+	bool roi_crop;
+	bool roi_changed;
+	// Press position of a middle button drag, -1 if none
+	int roi_drag_x;
+	int roi_drag_y;
+	int threads_done;
+	int threads_running;
+	// CPU every worker is pinned to, see Topology::worker_cpus()
+	std::vector<int> thread_cpus;
+	int selected_body;
+	int tint_index;
+
+	// Temporal reuse: camera the history was traced for, with position and normal of the surface
+	// seen through every pixel center (zero normal if none). Full quality pixels of the last
+	// frame are reprojected through it when the camera moves.
+	Camera history_camera;
+	std::vector<float> history_position;
+	std::vector<float> history_normal;
+	std::vector<PixelTask> pixel_temporal;
+	std::unique_ptr<ThreadPool> temporal_pool;
+	// Camera moved since the last refresh, moves are reprojected once per refresh
+	bool camera_changed;
 
-	int pixel_queue_next();
+	void build_pixel_order();
+	bool pixel_queue_next(int generation, PixelTask & task);
+	int pixel_queue_wait(int generation, Camera & camera);
+	void pixel_queue_start(std::vector<PixelTask> * tasks);
+	void pixel_queue_restart();
+	void pixel_queue_pause();
+	void pixel_queue_reprioritize();
+	void pixel_queue_reproject();
+	int reproject(std::vector<unsigned char> & reused);
+	void camera_moved();
+	std::vector<PixelTask> * frame_tasks();
+	void order_tasks(std::vector<PixelTask> & tasks, size_t first);
+	void set_roi(int x0, int y0, int x1, int y1);
+	bool has_roi() const { return roi_x1 >= 0; }
+	bool in_roi(int px) const;
+	void update_body(int body_number, const Body & body);
+	void tint_selected_body();
+	void reload_textures();
+	void denoise_frame();
+	void mark_dirty(int x0, int y0, int x1, int y1);
+	void present_tiles();
+	bool camera_key(SDL_Scancode key);
+	bool tonemap_key(SDL_Scancode key);
 	static int calculation_thread_function_wrapper(void * data);
 	int calculation_thread_function(void * data);
 
@@ -39,7 +132,17 @@ private:
 	int WINDOW_HEIGHT;
 	int THREADS_COUNT;
 	int FRAMERATE;
+	int PREVIEW_LEVELS;
+	int AA_FACTOR;
+	double CAM_MOVE_STEP;
+	double CAM_ROTATE_STEP;
+	double MOUSE_SENSITIVITY;
+	bool TEMPORAL_REUSE;
 	std::string WINDOW_TITLE;
+	std::string HEATMAP_PATH;
+	std::string SCENE_PATH;
+	std::vector<int> textured_bodies;
+	std::map<std::string, std::shared_ptr<TextureProgram>> texture_programs;
 
 	SDL_Window * window;
 	SDL_Surface * surface;
@@ -6,10 +6,15 @@
 #include "Vec3.h"
 #include "Ray.h"
 #include "Material.h"
+#include "Statistics.h"
 #include <math.h>
 #include <vector>
 #include <memory>
 
+// Set of bodies a path touched, body i sets bit i % 64 (more bodies alias, like a bloom filter)
+typedef unsigned long long BodyMask;
+inline BodyMask body_bit(int body_number) { return 1ull << (body_number & 63); }
+
 class Shape {
 
 public:
@@ -26,7 +31,23 @@ public:
 		HIT_OUT
 	};
 
-	virtual HitResult first_hit(Ray ray, Vec3 * hit = nullptr, Vec3 * normal = nullptr, double * distance = nullptr) const = 0;
+	// Just enough of an intersection to pick the nearest one, attributes() does the rest
+	struct Hit {
+		double t; // along ray.direction, rays are unit length so it's the distance
+		int primitive; // part of the shape, for attributes()
+		bool exiting; // ray leaves the shape there, HIT_OUT counts as leaving
+	};
+
+	// Nearest intersection with tmin <= t < tmax. Hits farther than tmax are rejected before
+	// anything else is computed. HIT_OUT means the ray is inside past tmin and never leaves.
+	virtual HitResult intersect(const Ray & ray, double tmin, double tmax, Hit & hit) const = 0;
+
+	// Position and outward normal of a hit intersect() returned for this ray, either may be nullptr.
+	// They depend on the hit position and primitive only.
+	virtual void attributes(const Ray & ray, const Hit & hit, Vec3 * position, Vec3 * normal) const = 0;
+
+	// False if center and radius don't bound the shape
+	virtual bool bounded() const { return true; }
 
 private:
 
@@ -54,35 +75,42 @@ public:
 		this->radius = radius;
 	}
 
-	HitResult first_hit(Ray ray, Vec3 * hit = nullptr, Vec3 * normal = nullptr, double * distance = nullptr) const {
+	HitResult intersect(const Ray & ray, double tmin, double tmax, Hit & hit) const {
+		STAT_INTERSECTION();
 		Vec3 RC = center - ray.origin;
 		double d = RC.dot(ray.direction);
-		
+
+		// Whole sphere behind the interval or past its end
+		if (d - radius >= tmax || d + radius < tmin)
+			return HitResult::HIT_MISS;
+
 		Vec3 RP = ray.direction * d;
 		Vec3 CP = RP - RC;
 
 		if (CP.dot(CP) > radius2)
 			return HitResult::HIT_MISS;
 
-		double q2 = radius2 - CP.dot(CP);
-		double q = sqrt(q2);
-
-		Vec3 HP = ray.direction * q;
-
-		Vec3 RH = RP - HP;
-
-		if (RH.dot(ray.direction) < 0.0)
-			RH = RP + HP;
+		double q = sqrt(radius2 - CP.dot(CP));
 
-		if (RH.dot(ray.direction) < 0.0)
+		hit.t = d - q;
+		hit.exiting = false;
+		if (hit.t < tmin) {
+			hit.t = d + q;
+			hit.exiting = true;
+		}
+		if (hit.t < tmin || hit.t >= tmax)
 			return HitResult::HIT_MISS;
-		
-		if (hit) *hit = ray.origin + RH;
-		if (normal) *normal = (RH - RC).normalized();
-		if (distance) *distance = RH.length();
+
+		hit.primitive = 0;
 		return HitResult::HIT_HIT;
 	}
 
+	void attributes(const Ray & ray, const Hit & hit, Vec3 * position, Vec3 * normal) const {
+		Vec3 p = ray.origin + ray.direction * hit.t;
+		if (position) *position = p;
+		if (normal) *normal = (p - center).normalized();
+	}
+
 private:
 
 	double radius2;
@@ -98,14 +126,16 @@ public:
 		this->normal = normal.normalized();
 	}
 
-	HitResult first_hit(Ray ray, Vec3 * hit = nullptr, Vec3 * normal = nullptr, double * distance = nullptr) const {
+	HitResult intersect(const Ray & ray, double tmin, double tmax, Hit & hit) const {
+		STAT_INTERSECTION();
 		Vec3 RC = center - ray.origin;
 		double rcn = this->normal.dot(RC);
 		double rdn = this->normal.dot(ray.direction);
 
+		hit.primitive = 0;
+		hit.exiting = true;
 		if (rcn > 0.0) { // inside
 			if (rdn <= 0.0) {
-				if (normal) *normal = ray.direction;
 				return HitResult::HIT_OUT;
 			}
 		}
@@ -115,15 +145,25 @@ public:
 			}
 		}
 
-		Vec3 RH = ray.direction * (rcn / rdn);
-
-		if (hit) *hit = ray.origin + RH;
-		if (normal) *normal = this->normal;
-		if (distance) *distance = RH.length();
+		hit.t = rcn / rdn;
+		if (hit.t < tmin) { // crossed before the interval
+			return (rcn > 0.0) ? HitResult::HIT_MISS : HitResult::HIT_OUT;
+		}
+		if (hit.t >= tmax) {
+			return HitResult::HIT_MISS;
+		}
 
+		hit.exiting = rdn > 0.0;
 		return HitResult::HIT_HIT;
 	}
 
+	void attributes(const Ray & ray, const Hit & hit, Vec3 * position, Vec3 * normal) const {
+		if (position) *position = ray.origin + ray.direction * hit.t;
+		if (normal) *normal = this->normal;
+	}
+
+	bool bounded() const { return false; }
+
 private:
 
 	Vec3 normal;
@@ -160,22 +200,26 @@ public:
 		this->radius = octet.length();
 	}
 
-	HitResult first_hit(Ray ray, Vec3 * hit = nullptr, Vec3 * normal = nullptr, double * distance = nullptr) const {
+	// Marches from surface to surface of the metashapes until it crosses the boundary of the composition.
+	// Primitive of the hit packs the metashape, its own primitive and whether its normal is flipped.
+	HitResult intersect(const Ray & ray, double tmin, double tmax, Hit & hit) const {
 
 		const double bias = 0.0001;
-		Vec3 chit, cnormal;
-		Vec3 mhit, mnormal;
-		double cdist = 0.0;
+		Ray march = ray;
+		march.origin = ray.origin + ray.direction * tmin;
+		double offset = tmin; // t of march origin along the ray
+		Hit candidate, nearest = {};
+		int nearest_shape = -1;
 		int initial_tl = -1;
 		int last_tl = -1;
 		bool first_time = true;
-		Vec3 init_origin = ray.origin;
 
 		for (;;) {
+			STAT_CSG_ITERATION();
 			// search for shape we are in, -1 if in no one
 			for (initial_tl = (int)metashapes.size() - 1; initial_tl >= 0; --initial_tl) {
-				HitResult result = metashapes[initial_tl].shape->first_hit(ray, nullptr, &cnormal, nullptr);
-				if ( (result == HitResult::HIT_HIT || result == HitResult::HIT_OUT) && ray.direction.dot(cnormal) > 0.0)
+				HitResult result = metashapes[initial_tl].shape->intersect(march, 0.0, INFINITY, candidate);
+				if ((result == HitResult::HIT_HIT || result == HitResult::HIT_OUT) && candidate.exiting)
 						break;
 			}
 
@@ -186,22 +230,24 @@ public:
 					(initial_tl != -1 && last_tl != -1 && metashapes[last_tl].type != metashapes[initial_tl].type);
 
 				if (found_edge) {
-					if (hit) *hit = mhit;
 					int tl = last_tl;
 					if (initial_tl > tl) tl = initial_tl;
-					if (normal) *normal = mnormal * (tl != -1 && metashapes[tl].type == MetaShape::MetaShapeType::NEGATIVE ? -1.0 : 1.0);
-					if (distance) *distance = (init_origin - mhit).length();
+					bool flip = tl != -1 && metashapes[tl].type == MetaShape::MetaShapeType::NEGATIVE;
+					hit.t = nearest.t;
+					hit.exiting = nearest.exiting != flip;
+					hit.primitive = (nearest.primitive * (int)metashapes.size() + nearest_shape) * 2 + (flip ? 1 : 0);
 					return HitResult::HIT_HIT;
 				}
 			}
 
+			// Surfaces past tmax can't make a boundary before it
 			double min_dist = -1.0;
 			for (int i = (int)metashapes.size() - 1; i >= initial_tl && i >= 0; --i) {
-				HitResult result = metashapes[i].shape->first_hit(ray, &chit, &cnormal, &cdist);
-				if (result == HitResult::HIT_HIT && (cdist < min_dist || min_dist < 0.0)) {
-					mhit = chit;
-					mnormal = cnormal;
-					min_dist = cdist;
+				HitResult result = metashapes[i].shape->intersect(march, 0.0, tmax - offset, candidate);
+				if (result == HitResult::HIT_HIT && (candidate.t < min_dist || min_dist < 0.0)) {
+					nearest = candidate;
+					nearest_shape = i;
+					min_dist = candidate.t;
 				}
 			}
 
@@ -211,16 +257,64 @@ public:
 
 			first_time = false;
 			last_tl = initial_tl;
-			ray.origin = mhit + ray.direction * bias;
+			nearest.t += offset;
+			offset = nearest.t + bias;
+			march.origin = march.origin + ray.direction * (min_dist + bias);
 
 		}
 
 	}
 
+	void attributes(const Ray & ray, const Hit & hit, Vec3 * position, Vec3 * normal) const {
+		int count = (int)metashapes.size();
+		bool flip = (hit.primitive & 1) != 0;
+		Hit sub = { 0.0, (hit.primitive >> 1) / count, hit.exiting != flip };
+		// Metashape attributes only depend on the position, ask them for a hit at the origin
+		Ray at_hit = ray;
+		at_hit.origin = ray.origin + ray.direction * hit.t;
+		if (position) *position = at_hit.origin;
+		if (normal) {
+			metashapes[(hit.primitive >> 1) % count].shape->attributes(at_hit, sub, nullptr, normal);
+			if (flip) *normal = -*normal;
+		}
+	}
+
 private:
 
 	std::vector<MetaShape> metashapes;
 };
 
+// Shape moved by an offset, animation wraps shared shapes into it instead of rebuilding them
+class TranslatedShape : public Shape {
+
+public:
+
+	TranslatedShape(std::shared_ptr<Shape> shape, Vec3 offset) : shape(shape), offset(offset) {
+		this->center = shape->center + offset;
+		this->radius = shape->radius;
+	}
+
+	HitResult intersect(const Ray & ray, double tmin, double tmax, Hit & hit) const {
+		Ray moved = ray;
+		moved.origin = ray.origin - offset;
+		return shape->intersect(moved, tmin, tmax, hit);
+	}
+
+	void attributes(const Ray & ray, const Hit & hit, Vec3 * position, Vec3 * normal) const {
+		Ray moved = ray;
+		moved.origin = ray.origin - offset;
+		shape->attributes(moved, hit, position, normal);
+		if (position) *position = *position + offset;
+	}
+
+	bool bounded() const { return shape->bounded(); }
+
+private:
+
+	std::shared_ptr<Shape> shape;
+	Vec3 offset;
+
+};
+
 
 #endif // _BODY_H_
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include "Budget.h"
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+// Calibration pixels, one per cell of this size
+static const int CALIBRATION_CELL = 16;
+// Calibration stops early once it took this part of the budget
+static const double CALIBRATION_SHARE = 0.1;
+
+static int gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+BudgetRenderer::BudgetRenderer(const Configurer & config, double seconds)
+	: config(config), pool(config.threads_count)
+{
+	this->WIDTH = config.window_width;
+	this->HEIGHT = config.window_height;
+	this->TILE_SIZE = config.tile_size;
+	this->NUMA_REPLICAS = config.numa_replicas && pool.nodes_count() > 1;
+	this->TARGET_PASSES = std::max(config.aa_factor * config.aa_factor, 1);
+	this->BUDGET = seconds;
+
+	// Cheapest level traces one diffuse bounce with one ray, then rays double and the bounce
+	// limit grows by the cheapest bounce value in turns, up to the configured settings
+	int max_rays = std::max(config.diffuse_ray_count, 1);
+	int max_bounce = std::max(config.max_bounce, 0);
+	int bounce_step = std::max(std::min(config.reflective_bounce_value, config.refractive_bounce_value), 1);
+	Level level;
+	level.rays = 1;
+	level.bounce = std::min(config.diffuse_bounce_value, max_bounce);
+	for (;;) {
+		levels.push_back(Level());
+		levels.back().rays = level.rays;
+		levels.back().bounce = level.bounce;
+		if (level.rays >= max_rays && level.bounce >= max_bounce) break;
+		if (level.rays < max_rays && (level.bounce >= max_bounce || levels.size() % 2 == 1)) {
+			level.rays = std::min(level.rays * 2, max_rays);
+		}
+		else {
+			level.bounce = std::min(level.bounce + bounce_step, max_bounce);
+		}
+	}
+}
+
+void BudgetRenderer::prepare_level(int level)
+{
+	if (!levels[level].renders.empty()) return;
+	Configurer level_config(config);
+	level_config.diffuse_ray_count = levels[level].rays;
+	level_config.max_bounce = levels[level].bounce;
+	level_config.aa_factor = 1;
+	level_config.gbuffer_cache = false; // passes look through different subpixel offsets
+	std::vector<std::unique_ptr<Render>> & renders = levels[level].renders;
+	renders.resize(NUMA_REPLICAS ? pool.nodes_count() : 1);
+	if (!NUMA_REPLICAS) {
+		renders[0].reset(new Render(level_config));
+		return;
+	}
+	// Built by a worker of the node, so the scene's memory is first touched there. Caustics of
+	// every replica are shot with the node's share of threads only.
+	pool.run_per_node([&](int node) {
+		Configurer node_config(level_config);
+		node_config.threads_count = pool.node_size(node);
+		renders[node].reset(new Render(node_config));
+	});
+}
+
+const Render & BudgetRenderer::level_render(int level, int node) const
+{
+	return *levels[level].renders[NUMA_REPLICAS ? node : 0];
+}
+
+void BudgetRenderer::parallel(int count, const std::function<void(int, int)> & task, Clock::time_point deadline)
+{
+	pool.run(count, [&](int i, int node) {
+		if (Clock::now() <= deadline) task(i, node);
+	});
+}
+
+bool BudgetRenderer::render_pass(int level, const Camera & camera, Clock::time_point deadline)
+{
+	int tiles_x = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+	int tiles = tiles_x * ((HEIGHT + TILE_SIZE - 1) / TILE_SIZE);
+	// Tiles are taken with a stride coprime to their count, so a pass cut short by the
+	// deadline leaves its missing samples spread over the frame rather than at the bottom.
+	// With several NUMA nodes every node keeps its own contiguous band instead.
+	int stride = pool.nodes_count() > 1 ? 1 : std::max((int)(tiles * 0.618), 1);
+	while (gcd(stride, tiles) != 1) ++stride;
+	std::atomic<int> done(0);
+	parallel(tiles, [&](int i, int node) {
+		const Render & render = level_render(level, node);
+		int tile = (int)(((long long)i * stride) % tiles);
+		int x0 = (tile % tiles_x) * TILE_SIZE;
+		int y0 = (tile / tiles_x) * TILE_SIZE;
+		for (int y = y0; y < std::min(y0 + TILE_SIZE, HEIGHT); ++y) {
+			for (int x = x0; x < std::min(x0 + TILE_SIZE, WIDTH); ++x) {
+				sum[y * WIDTH + x] = sum[y * WIDTH + x] + render.pixel_color(x, y, camera, 1);
+				counts[y * WIDTH + x]++;
+			}
+		}
+		done++;
+	}, deadline);
+	return done == tiles;
+}
+
+void BudgetRenderer::render(Image & image)
+{
+	Clock::time_point start = Clock::now();
+	Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(BUDGET));
+	auto seconds_since = [](Clock::time_point from) { return std::chrono::duration<double>(Clock::now() - from).count(); };
+
+	sum.assign(WIDTH * HEIGHT, Vec3(0.0, 0.0, 0.0));
+	counts.assign(WIDTH * HEIGHT, 0);
+
+	// CALIBRATION
+	// A random pixel of every cell, so expensive regions are sampled as often as they cover the frame
+	std::vector<int> pixels;
+	for (int cy = 0; cy < HEIGHT; cy += CALIBRATION_CELL) {
+		for (int cx = 0; cx < WIDTH; cx += CALIBRATION_CELL) {
+			int x = cx + rand() % std::min(CALIBRATION_CELL, WIDTH - cx);
+			int y = cy + rand() % std::min(CALIBRATION_CELL, HEIGHT - cy);
+			pixels.push_back(y * WIDTH + x);
+		}
+	}
+	prepare_level(0);
+	const Camera & camera = level_render(0, 0).default_camera();
+	// Predicted wall seconds of a full pass per calibrated level
+	std::vector<double> pass_time;
+	while (pass_time.size() < levels.size()) {
+		int level = (int)pass_time.size();
+		prepare_level(level);
+		Clock::time_point level_start = Clock::now();
+		parallel((int)pixels.size(), [&](int i, int node) {
+			level_render(level, node).pixel_color(pixels[i] % WIDTH, pixels[i] / WIDTH, camera, 1);
+		}, Clock::time_point::max());
+		pass_time.push_back(seconds_since(level_start) * WIDTH * HEIGHT / pixels.size());
+		double remaining = BUDGET - seconds_since(start);
+		if (pass_time.back() * TARGET_PASSES > remaining || seconds_since(start) > BUDGET * CALIBRATION_SHARE) break;
+	}
+	double calibration_time = seconds_since(start);
+
+	int level = 0;
+	for (int l = (int)pass_time.size() - 1; l > 0; --l) {
+		if (pass_time[l] * TARGET_PASSES <= BUDGET - calibration_time) {
+			level = l;
+			break;
+		}
+	}
+
+	// PASSES
+	// Measured over predicted pass time, corrects all levels once passes are timed
+	double slowdown = 1.0;
+	std::vector<int> level_passes(levels.size(), 0);
+	int passes = 0;
+	for (;;) {
+		double remaining = BUDGET - seconds_since(start);
+		if (passes > 0) {
+			// Step down a level if the target passes no longer fit, one level per pass
+			if (level > 0 && passes + remaining / (pass_time[level] * slowdown) < TARGET_PASSES) {
+				--level;
+			}
+			if (pass_time[level] * slowdown > remaining) break;
+		}
+
+		// R2 low discrepancy offsets, the first pass samples the pixel corner like aa_factor 1
+		double ox = fmod(passes * 0.7548776662466927, 1.0);
+		double oy = fmod(passes * 0.5698402909980532, 1.0);
+		Camera jittered = camera.shifted(ox / WIDTH, oy / HEIGHT);
+
+		Clock::time_point pass_start = Clock::now();
+		// The first pass always completes, a frame with holes is of no use
+		prepare_level(level);
+		bool complete = render_pass(level, jittered, passes > 0 ? deadline : Clock::time_point::max());
+		if (!complete) break;
+		slowdown = seconds_since(pass_start) / pass_time[level];
+		level_passes[level]++;
+		passes++;
+	}
+
+	image = Image(WIDTH, HEIGHT);
+	int min_count = passes + 1, max_count = 0;
+	for (int i = 0; i < WIDTH * HEIGHT; ++i) {
+		image.pixels[i] = counts[i] ? sum[i] / counts[i] : Vec3(0.0, 0.0, 0.0);
+		min_count = std::min(min_count, counts[i]);
+		max_count = std::max(max_count, counts[i]);
+	}
+
+	std::cout << "Budget " << BUDGET << " s, used " << seconds_since(start) << " s, calibration " << calibration_time << " s" << std::endl;
+	for (size_t l = levels.size(); l-- > 0; ) {
+		if (!level_passes[l]) continue;
+		std::cout << "  " << level_passes[l] << " passes with diffuse_ray_count " << levels[l].rays << ", max_bounce " << levels[l].bounce << std::endl;
+	}
+	std::cout << "Samples per pixel : " << min_count;
+	if (max_count != min_count) std::cout << " to " << max_count << ", last pass cut short by the deadline";
+	std::cout << ", aa_factor " << config.aa_factor << " asks for " << TARGET_PASSES << std::endl;
+}
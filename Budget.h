@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef _BUDGET_H_
+#define _BUDGET_H_
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include "Configurer.h"
+#include "Render.h"
+#include "Camera.h"
+#include "Image.h"
+#include "ThreadPool.h"
+
+// Renders one frame headless within a wall-clock budget. Calibration times a sparse set of pixels
+// with a ladder of diffuse_ray_count and max_bounce settings, cheapest first and at most the
+// configured ones, and keeps the best that leaves time for aa_factor^2 samples per pixel. The frame
+// is then rendered in whole-frame passes of one sample per pixel at jittered subpixel offsets, as
+// many as fit. Every pass is timed; the settings step down if passes run slower than calibrated,
+// and no pass is started that wouldn't end before the deadline.
+
+class BudgetRenderer {
+
+public:
+
+	BudgetRenderer(const Configurer & config, double seconds);
+
+	// Linear radiance averaged over the passes, prints the samples it could afford
+	void render(Image & image);
+
+private:
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Level {
+		int rays;
+		int bounce;
+		std::vector<std::unique_ptr<Render>> renders; // one per NUMA node with replicas, built on first use
+	};
+
+	// Builds the level's renders, must not be called from pool tasks
+	void prepare_level(int level);
+	const Render & level_render(int level, int node) const;
+	// Runs task(i, node) for i in [0, count) on the pool, skips tasks once past the deadline
+	void parallel(int count, const std::function<void(int, int)> & task, Clock::time_point deadline);
+	// Adds one sample per pixel to sum and counts, false if the deadline cut it short
+	bool render_pass(int level, const Camera & camera, Clock::time_point deadline);
+
+	const Configurer & config;
+	ThreadPool pool;
+	std::vector<Level> levels;
+	std::vector<Vec3> sum;
+	std::vector<int> counts;
+
+	int WIDTH;
+	int HEIGHT;
+	int TILE_SIZE;
+	bool NUMA_REPLICAS;
+	int TARGET_PASSES;
+	double BUDGET;
+
+};
+
+#endif // _BUDGET_H_
@@ -0,0 +1,70 @@
+#include "Camera.h"
+#include "Configurer.h"
+#include <math.h>
+
+Camera::Camera()
+	: width(1.0), height(1.0), depth(1.0)
+{
+}
+
+Camera::Camera(const Configurer & config)
+{
+	this->position = config.cam_position;
+	this->forward = config.cam_forward;
+	this->uppy = config.cam_uppy;
+	this->up = config.cam_up;
+	this->right = config.cam_right;
+	this->width = config.cam_width;
+	this->height = config.cam_height;
+	this->depth = config.cam_depth;
+}
+
+Vec3 Camera::direction(double sx, double sy) const
+{
+	return forward * depth + right * width * (sx - 0.5) + up * height * (0.5 - sy);
+}
+
+Camera Camera::shifted(double sx, double sy) const
+{
+	Camera camera(*this);
+	camera.forward = forward + (right * width * sx - up * height * sy) / depth;
+	return camera;
+}
+
+bool Camera::project(Vec3 point, double & sx, double & sy) const
+{
+	Vec3 v = point - position;
+	double z = v.dot(forward);
+	if (z <= 0.0) {
+		return false;
+	}
+	// direction() stretched to the point's distance along forward
+	double k = z / depth;
+	sx = 0.5 + v.dot(right) / (k * width);
+	sy = 0.5 - v.dot(up) / (k * height);
+	return true;
+}
+
+void Camera::move(Vec3 offset)
+{
+	position = position + right * offset.x + up * offset.y + forward * offset.z;
+}
+
+void Camera::rotate(double yaw, double pitch)
+{
+	forward = (forward * cos(yaw) + right * sin(yaw)).normalized();
+	orthonormalize();
+
+	Vec3 pitched = (forward * cos(pitch) + up * sin(pitch)).normalized();
+	// Don't let forward get parallel to uppy, the basis would degenerate
+	if (fabs(pitched.dot(uppy)) < 0.99) {
+		forward = pitched;
+	}
+	orthonormalize();
+}
+
+void Camera::orthonormalize()
+{
+	right = uppy.cross(forward).normalized();
+	up = forward.cross(right);
+}
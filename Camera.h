@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef _CAMERA_H_
+#define _CAMERA_H_
+
+#include "Vec3.h"
+
+class Configurer;
+
+class Camera {
+
+public:
+
+	Camera();
+	Camera(const Configurer & config);
+
+	Vec3 position;
+	Vec3 forward;
+	Vec3 uppy;
+	Vec3 up;
+	Vec3 right;
+	double width;
+	double height;
+	double depth;
+
+	// Not normalized direction through screen point, (0, 0) is top left corner, (1, 1) is bottom right
+	Vec3 direction(double sx, double sy) const;
+
+	// Copy looking through the screen moved by (sx, sy) of its size, for subpixel jitter.
+	// Forward of the copy isn't normalized, it should only be used to shoot rays.
+	Camera shifted(double sx, double sy) const;
+
+	// Screen point the camera sees a world point at, inverse of direction(). False if it's behind the camera.
+	bool project(Vec3 point, double & sx, double & sy) const;
+
+	// Offset is given in camera basis (right, up, forward)
+	void move(Vec3 offset);
+	// Yaw turns around uppy, pitch around right, in radians
+	void rotate(double yaw, double pitch);
+
+private:
+
+	void orthonormalize();
+
+};
+
+#endif // _CAMERA_H_
\ No newline at end of file
@@ -0,0 +1,624 @@
+#include "Cluster.h"
+#include <iostream>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#endif
+
+// Every message has the same size, fields not used by a type are zero
+struct ClusterMessage {
+	int32_t type;
+	int32_t tile;
+	int32_t x, y, width, height;
+	int32_t pass;
+};
+
+enum ClusterMessageType {
+	MESSAGE_HELLO, // worker -> coordinator, tile field holds worker pid
+	MESSAGE_TILE, // coordinator -> worker, render a pass of the tile
+	MESSAGE_DONE, // worker -> coordinator, the pass is added to the framebuffer
+	MESSAGE_QUIT, // coordinator -> worker
+};
+
+// Framebuffer starts with this header followed by passes done per tile, width * height RGB float
+// sums and width * height pass counts. Resuming from a checkpoint file maps the same layout.
+struct FramebufferHeader {
+	uint32_t magic;
+	int32_t width;
+	int32_t height;
+	int32_t tile_size;
+	int32_t tiles_count;
+	int32_t reserved;
+	uint64_t settings_hash;
+};
+
+struct FramebufferLayout {
+	size_t tiles_offset;
+	size_t pixels_offset;
+	size_t counts_offset;
+	size_t size;
+};
+
+static const uint32_t FRAMEBUFFER_MAGIC = 0x32465452; // "RTF2"
+static const char * FRAMEBUFFER_FILE_PREFIX = "file:";
+
+static int tiles_count(int width, int height, int tile_size)
+{
+	return ((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+}
+
+static FramebufferLayout framebuffer_layout(int width, int height, int tiles)
+{
+	FramebufferLayout layout;
+	layout.tiles_offset = sizeof(FramebufferHeader);
+	layout.pixels_offset = layout.tiles_offset + sizeof(int32_t) * tiles;
+	layout.counts_offset = layout.pixels_offset + sizeof(float) * 3 * width * height;
+	layout.size = layout.counts_offset + sizeof(uint32_t) * width * height;
+	return layout;
+}
+
+// FNV-1a over everything that changes the pixels, so a checkpoint of another scene isn't mixed in
+static void hash_bytes(uint64_t & hash, const void * data, size_t size)
+{
+	const unsigned char * bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+// Size and modification time stand for the contents, false if the file isn't there
+static bool hash_file(uint64_t & hash, const std::string & path)
+{
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0) {
+		return false;
+	}
+	int64_t stamp[] = { (int64_t)info.st_size, (int64_t)info.st_mtime };
+	hash_bytes(hash, path.data(), path.size());
+	hash_bytes(hash, stamp, sizeof(stamp));
+	return true;
+}
+
+// Material colors, lights and textures are functions, which can't be hashed. The built in ones are
+// code of the executable and the rest comes from the scene file and its images, so those files are
+// hashed instead. False if one of them can't be read, such settings are never resumed.
+static bool settings_hash(const Configurer & config, const std::string & executable, uint64_t & hash)
+{
+	hash = 14695981039346656037ULL;
+	int ints[] = { config.window_width, config.window_height, config.tile_size, config.aa_factor,
+		config.max_bounce, config.diffuse_ray_count, (int)config.bodies.size(), config.diffuse_mis, config.fresnel,
+		config.diffuse_bounce_value, config.refractive_bounce_value, config.reflective_bounce_value, config.texture_lod,
+		config.irradiance_cache, config.irradiance_ray_count, config.caustic_photons };
+	hash_bytes(hash, ints, sizeof(ints));
+	double doubles[] = { config.cam_width, config.cam_height, config.cam_depth, config.tracer_bias,
+		config.irradiance_accuracy, config.irradiance_min_spacing, config.irradiance_max_spacing,
+		config.caustic_radius, config.environment_scale };
+	hash_bytes(hash, doubles, sizeof(doubles));
+	const Vec3 * vectors[] = { &config.cam_position, &config.cam_forward, &config.cam_up, &config.cam_right };
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+		double xyz[] = { vectors[i]->x, vectors[i]->y, vectors[i]->z };
+		hash_bytes(hash, xyz, sizeof(xyz));
+	}
+	for (size_t i = 0; i < config.bodies.size(); ++i) {
+		const Shape & shape = *config.bodies[i].shape;
+		double sphere[] = { shape.center.x, shape.center.y, shape.center.z, shape.radius };
+		hash_bytes(hash, sphere, sizeof(sphere));
+
+		const Material & material = config.bodies[i].material;
+		double refraction[] = { material.refraction_index,
+			material.refraction_density.x, material.refraction_density.y, material.refraction_density.z };
+		hash_bytes(hash, refraction, sizeof(refraction));
+		// Which channels are set, a light is a body with a light source color
+		bool channels[] = { (bool)material.simple_diffuse_color, (bool)material.diffuse_color, (bool)material.pure_reflective_color,
+			(bool)material.refractive_color, (bool)material.light_source_color, (bool)material.bump_mapping };
+		hash_bytes(hash, channels, sizeof(channels));
+	}
+
+	if (!hash_file(hash, executable)) {
+		return false;
+	}
+	if (!config.scene_path.empty() && !hash_file(hash, config.scene_path)) {
+		// No file keeps the built in scene, see Configurer::load_scene_file()
+		hash_bytes(hash, "built in", 8);
+	}
+	for (size_t i = 0; i < config.image_paths.size(); ++i) {
+		if (!hash_file(hash, config.image_paths[i])) return false;
+	}
+	if (!config.environment_path.empty() && !hash_file(hash, config.environment_path)) {
+		return false;
+	}
+	return true;
+}
+
+// argv[0] has no directory when the program was started through PATH, workers and the
+// settings hash need the file itself
+static std::string executable_path(const std::string & argv0)
+{
+#ifdef __linux__
+	char path[4096];
+	ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (length > 0) return std::string(path, length);
+#endif
+	return argv0;
+}
+
+Coordinator::Coordinator(const Configurer & config, const std::string & executable)
+	: executable(executable_path(executable))
+{
+	this->WIDTH = config.window_width;
+	this->HEIGHT = config.window_height;
+	this->WORKERS_COUNT = config.cluster_workers;
+	this->TILES_PER_WORKER = 2;
+	this->TILE_SIZE = config.tile_size;
+	this->PASSES = std::max(config.render_passes, 1);
+	this->CHECKPOINT_PATH = config.checkpoint_path;
+	this->CHECKPOINT_INTERVAL = std::max(config.checkpoint_interval, 1);
+	this->settings_hashed = ::settings_hash(config, this->executable, this->settings_hash);
+
+	for (int y = 0; y < HEIGHT; y += TILE_SIZE) {
+		for (int x = 0; x < WIDTH; x += TILE_SIZE) {
+			Tile tile;
+			tile.x = x;
+			tile.y = y;
+			tile.width = std::min(TILE_SIZE, WIDTH - x);
+			tile.height = std::min(TILE_SIZE, HEIGHT - y);
+			tile.passes_done = 0;
+			tile.worker = -1;
+			tiles.push_back(tile);
+		}
+	}
+}
+
+ClusterWorker::ClusterWorker(const Configurer & config)
+	: render(config)
+{
+	this->WIDTH = config.window_width;
+	this->HEIGHT = config.window_height;
+	this->TILE_SIZE = config.tile_size;
+	this->PASSES = std::max(config.render_passes, 1);
+}
+
+#ifdef _WIN32
+
+Coordinator::Result Coordinator::render(Image & image)
+{
+	std::cerr << "Coordinator::render() error : multi-process rendering needs POSIX" << std::endl;
+	return Result::FAIL_UNSUPPORTED;
+}
+
+int ClusterWorker::run(const std::string & socket_path, const std::string & shm_name)
+{
+	std::cerr << "ClusterWorker::run() error : multi-process rendering needs POSIX" << std::endl;
+	return 1;
+}
+
+#else
+
+static bool send_message(int fd, const ClusterMessage & message)
+{
+	const char * data = (const char *)&message;
+	size_t sent = 0;
+	while (sent < sizeof(message)) {
+		ssize_t n = send(fd, data + sent, sizeof(message) - sent, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		sent += n;
+	}
+	return true;
+}
+
+static bool receive_message(int fd, ClusterMessage & message)
+{
+	char * data = (char *)&message;
+	size_t received = 0;
+	while (received < sizeof(message)) {
+		ssize_t n = recv(fd, data + received, sizeof(message) - received, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		received += n;
+	}
+	return true;
+}
+
+static ClusterMessage make_message(int type, int tile = 0, int x = 0, int y = 0, int width = 0, int height = 0, int pass = 0)
+{
+	ClusterMessage message = { type, tile, x, y, width, height, pass };
+	return message;
+}
+
+// Shared memory object, or a regular file for names starting with file:
+static int open_framebuffer(const std::string & name, int flags)
+{
+	size_t prefix = strlen(FRAMEBUFFER_FILE_PREFIX);
+	if (name.compare(0, prefix, FRAMEBUFFER_FILE_PREFIX) == 0) {
+		return open(name.c_str() + prefix, flags, 0600);
+	}
+	return shm_open(name.c_str(), flags, 0600);
+}
+
+Coordinator::Result Coordinator::render(Image & image)
+{
+	// Writing to a worker that just died must not kill us
+	signal(SIGPIPE, SIG_IGN);
+
+	bool checkpoint = !CHECKPOINT_PATH.empty();
+	std::string shm_name = checkpoint ? FRAMEBUFFER_FILE_PREFIX + CHECKPOINT_PATH : "/raytracer-" + std::to_string(getpid());
+	std::string socket_path = "/tmp/raytracer-" + std::to_string(getpid()) + ".sock";
+
+	FramebufferLayout layout = framebuffer_layout(WIDTH, HEIGHT, (int)tiles.size());
+	int shm_fd = open_framebuffer(shm_name, checkpoint ? O_CREAT | O_RDWR : O_CREAT | O_EXCL | O_RDWR);
+	struct stat info;
+	if (shm_fd < 0 || fstat(shm_fd, &info) != 0 || ((size_t)info.st_size != layout.size && ftruncate(shm_fd, layout.size) != 0)) {
+		std::cerr << "Coordinator framebuffer error : " << strerror(errno) << std::endl;
+		if (shm_fd >= 0) { close(shm_fd); if (!checkpoint) shm_unlink(shm_name.c_str()); }
+		return Result::FAIL_SHARED_MEMORY;
+	}
+	void * framebuffer = mmap(nullptr, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if (framebuffer == MAP_FAILED) {
+		std::cerr << "mmap() error : " << strerror(errno) << std::endl;
+		close(shm_fd);
+		if (!checkpoint) shm_unlink(shm_name.c_str());
+		return Result::FAIL_SHARED_MEMORY;
+	}
+	FramebufferHeader * header = (FramebufferHeader *)framebuffer;
+	int32_t * tile_passes = (int32_t *)((char *)framebuffer + layout.tiles_offset);
+	const float * pixels = (const float *)((char *)framebuffer + layout.pixels_offset);
+	const uint32_t * counts = (const uint32_t *)((char *)framebuffer + layout.counts_offset);
+
+	bool resumed = (size_t)info.st_size == layout.size && header->magic == FRAMEBUFFER_MAGIC
+		&& header->width == WIDTH && header->height == HEIGHT && header->tiles_count == (int)tiles.size()
+		&& settings_hashed && header->settings_hash == settings_hash;
+	if (resumed) {
+		for (size_t t = 0; t < tiles.size(); ++t) tiles[t].passes_done = std::min(std::max(tile_passes[t], 0), PASSES);
+	}
+	else {
+		if (checkpoint && info.st_size > 0 && !settings_hashed) {
+			std::cerr << "Coordinator warning : scene files of checkpoint " << CHECKPOINT_PATH << " can't be checked, starting over" << std::endl;
+		}
+		else if (checkpoint && info.st_size > 0) {
+			std::cerr << "Coordinator warning : checkpoint " << CHECKPOINT_PATH << " is of other settings, starting over" << std::endl;
+		}
+		// Zero the old contents by shrinking the file
+		if (checkpoint && (ftruncate(shm_fd, 0) != 0 || ftruncate(shm_fd, layout.size) != 0)) {
+			std::cerr << "Coordinator framebuffer error : " << strerror(errno) << std::endl;
+			munmap(framebuffer, layout.size);
+			close(shm_fd);
+			return Result::FAIL_SHARED_MEMORY;
+		}
+		header->magic = FRAMEBUFFER_MAGIC;
+		header->width = WIDTH;
+		header->height = HEIGHT;
+		header->tile_size = TILE_SIZE;
+		header->tiles_count = (int)tiles.size();
+		header->settings_hash = settings_hash;
+	}
+	close(shm_fd);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+	unlink(socket_path.c_str());
+	if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0) {
+		std::cerr << "Coordinator socket error : " << strerror(errno) << std::endl;
+		if (listen_fd >= 0) close(listen_fd);
+		munmap(framebuffer, layout.size);
+		if (!checkpoint) shm_unlink(shm_name.c_str());
+		return Result::FAIL_SOCKET;
+	}
+
+	std::vector<pid_t> children;
+	for (int i = 0; i < WORKERS_COUNT; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			// Searches PATH where the path couldn't be resolved
+			execlp(executable.c_str(), executable.c_str(), "--worker", socket_path.c_str(), shm_name.c_str(), (char *)nullptr);
+			std::cerr << "execlp() error : " << strerror(errno) << std::endl;
+			_exit(127);
+		}
+		else if (pid > 0) {
+			children.push_back(pid);
+		}
+		else {
+			std::cerr << "fork() error : " << strerror(errno) << std::endl;
+		}
+	}
+	std::cout << "Coordinator : " << tiles.size() << " tiles, " << PASSES << " passes, " << children.size() << " local workers, socket " << socket_path << ", framebuffer " << shm_name << std::endl;
+
+	// Pass after pass, so an interrupted render has the whole frame at some quality
+	struct TilePass {
+		int tile;
+		int pass;
+	};
+	std::deque<TilePass> pending;
+	size_t passes_left = 0;
+	for (int pass = 0; pass < PASSES; ++pass) {
+		for (size_t t = 0; t < tiles.size(); ++t) {
+			if (tiles[t].passes_done > pass) continue;
+			TilePass entry = { (int)t, pass };
+			pending.push_back(entry);
+			passes_left++;
+		}
+	}
+	if (resumed) {
+		std::cout << "Resuming " << CHECKPOINT_PATH << " : " << tiles.size() * PASSES - passes_left << " of " << tiles.size() * PASSES << " tile passes done" << std::endl;
+	}
+
+	// Connected worker sockets, -1 once disconnected
+	std::vector<int> workers;
+	std::vector<int> in_flight;
+	Result result = Result::SUCCESS;
+
+	// Checkpoint thread syncs the file and only then records the passes the file holds, the
+	// coordinator just copies passes_done under the lock so workers never wait on the disk
+	std::mutex checkpoint_mutex;
+	std::condition_variable checkpoint_wake;
+	bool checkpoint_stop = false;
+	auto write_checkpoint = [&]() {
+		std::vector<int32_t> done(tiles.size());
+		{
+			std::lock_guard<std::mutex> lock(checkpoint_mutex);
+			for (size_t t = 0; t < tiles.size(); ++t) done[t] = tiles[t].passes_done;
+		}
+		// Only dirty pages are written, that is the tiles finished since the last sync
+		if (msync(framebuffer, layout.size, MS_SYNC) != 0) {
+			std::cerr << "msync() error : " << strerror(errno) << std::endl;
+			return;
+		}
+		memcpy(tile_passes, done.data(), sizeof(int32_t) * done.size());
+		msync(framebuffer, layout.pixels_offset, MS_SYNC);
+	};
+	std::thread checkpoint_thread;
+	if (checkpoint) {
+		checkpoint_thread = std::thread([&]() {
+			std::unique_lock<std::mutex> lock(checkpoint_mutex);
+			while (!checkpoint_stop) {
+				if (checkpoint_wake.wait_for(lock, std::chrono::seconds(CHECKPOINT_INTERVAL)) != std::cv_status::timeout) continue;
+				lock.unlock();
+				write_checkpoint();
+				lock.lock();
+			}
+		});
+	}
+
+	auto assign = [&](int worker) {
+		// Passes of one tile go one after another, skip tiles whose previous pass is in flight
+		for (size_t i = 0; i < pending.size() && in_flight[worker] < TILES_PER_WORKER; ) {
+			TilePass entry = pending[i];
+			Tile & tile = tiles[entry.tile];
+			if (tile.worker != -1 || tile.passes_done != entry.pass) {
+				++i;
+				continue;
+			}
+			if (!send_message(workers[worker], make_message(MESSAGE_TILE, entry.tile, tile.x, tile.y, tile.width, tile.height, entry.pass))) return;
+			pending.erase(pending.begin() + i);
+			tile.worker = worker;
+			in_flight[worker]++;
+		}
+	};
+
+	auto disconnect = [&](int worker) {
+		int requeued = 0;
+		for (size_t t = 0; t < tiles.size(); ++t) {
+			if (tiles[t].worker == worker) {
+				tiles[t].worker = -1;
+				TilePass entry = { (int)t, tiles[t].passes_done };
+				pending.push_front(entry);
+				requeued++;
+			}
+		}
+		close(workers[worker]);
+		workers[worker] = -1;
+		in_flight[worker] = 0;
+		if (requeued) std::cout << "Worker " << worker << " lost, reassigning " << requeued << " tiles" << std::endl;
+		for (size_t w = 0; w < workers.size(); ++w) {
+			if (workers[w] != -1) assign((int)w);
+		}
+	};
+
+	while (passes_left > 0) {
+		std::vector<pollfd> fds;
+		std::vector<int> fd_worker;
+		fds.push_back({ listen_fd, POLLIN, 0 });
+		fd_worker.push_back(-1);
+		for (size_t w = 0; w < workers.size(); ++w) {
+			if (workers[w] != -1) {
+				fds.push_back({ workers[w], POLLIN, 0 });
+				fd_worker.push_back((int)w);
+			}
+		}
+
+		int ready = poll(fds.data(), fds.size(), 1000);
+		if (ready < 0 && errno != EINTR) {
+			std::cerr << "poll() error : " << strerror(errno) << std::endl;
+			result = Result::FAIL_SOCKET;
+			break;
+		}
+
+		// Reap local workers that exited, their sockets report the disconnect
+		int status;
+		for (size_t i = 0; i < children.size(); ++i) {
+			if (children[i] > 0 && waitpid(children[i], &status, WNOHANG) == children[i]) children[i] = -1;
+		}
+
+		if (ready <= 0) {
+			bool alive = fds.size() > 1;
+			for (size_t i = 0; i < children.size(); ++i) alive = alive || children[i] > 0;
+			if (!alive) {
+				std::cerr << "Coordinator error : no workers left, " << passes_left << " tile passes unfinished" << std::endl;
+				result = Result::FAIL_NO_WORKERS;
+				break;
+			}
+			continue;
+		}
+
+		for (size_t i = 0; i < fds.size(); ++i) {
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+			if (fd_worker[i] == -1) {
+				int fd = accept(listen_fd, nullptr, nullptr);
+				if (fd >= 0) {
+					workers.push_back(fd);
+					in_flight.push_back(0);
+				}
+				continue;
+			}
+
+			int worker = fd_worker[i];
+			ClusterMessage message;
+			if (!receive_message(workers[worker], message)) {
+				disconnect(worker);
+				continue;
+			}
+			if (message.type == MESSAGE_HELLO) {
+				std::cout << "Worker " << worker << " connected, pid " << message.tile << std::endl;
+			}
+			else if (message.type == MESSAGE_DONE && message.tile >= 0 && message.tile < (int)tiles.size()) {
+				Tile & tile = tiles[message.tile];
+				if (tile.worker == worker && message.pass == tile.passes_done) {
+					std::lock_guard<std::mutex> lock(checkpoint_mutex);
+					tile.passes_done++;
+					tile.worker = -1;
+					passes_left--;
+				}
+				in_flight[worker]--;
+				// The next pass of the tile may now go to anybody
+				for (size_t w = 0; w < workers.size(); ++w) {
+					if (workers[w] != -1) assign((int)w);
+				}
+			}
+			assign(worker);
+		}
+	}
+
+	for (size_t w = 0; w < workers.size(); ++w) {
+		if (workers[w] != -1) {
+			send_message(workers[w], make_message(MESSAGE_QUIT));
+			close(workers[w]);
+		}
+	}
+	// Workers still in the listen queue see the socket closed and exit
+	close(listen_fd);
+	unlink(socket_path.c_str());
+	for (size_t i = 0; i < children.size(); ++i) {
+		if (children[i] > 0) waitpid(children[i], nullptr, 0);
+	}
+
+	if (checkpoint) {
+		{
+			std::lock_guard<std::mutex> lock(checkpoint_mutex);
+			checkpoint_stop = true;
+		}
+		checkpoint_wake.notify_all();
+		checkpoint_thread.join();
+		if (result != Result::SUCCESS) {
+			write_checkpoint();
+			std::cout << "Checkpoint saved to " << CHECKPOINT_PATH << ", run again to resume" << std::endl;
+		}
+	}
+
+	if (result == Result::SUCCESS) {
+		image = Image(WIDTH, HEIGHT);
+		for (int i = 0; i < WIDTH * HEIGHT; ++i) {
+			float scale = counts[i] ? 1.0f / counts[i] : 0.0f;
+			image.pixels[i] = Vec3(pixels[i * 3 + 0] * scale, pixels[i * 3 + 1] * scale, pixels[i * 3 + 2] * scale);
+		}
+	}
+	munmap(framebuffer, layout.size);
+	if (!checkpoint) {
+		shm_unlink(shm_name.c_str());
+	}
+	else if (result == Result::SUCCESS) {
+		unlink(CHECKPOINT_PATH.c_str());
+	}
+	return result;
+}
+
+int ClusterWorker::run(const std::string & socket_path, const std::string & shm_name)
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	int tiles = tiles_count(WIDTH, HEIGHT, TILE_SIZE);
+	FramebufferLayout layout = framebuffer_layout(WIDTH, HEIGHT, tiles);
+	int shm_fd = open_framebuffer(shm_name, O_RDWR);
+	struct stat info;
+	if (shm_fd < 0 || fstat(shm_fd, &info) != 0 || (size_t)info.st_size != layout.size) {
+		std::cerr << "Worker error : can't open framebuffer " << shm_name << std::endl;
+		if (shm_fd >= 0) close(shm_fd);
+		return 1;
+	}
+	void * framebuffer = mmap(nullptr, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if (framebuffer == MAP_FAILED) {
+		std::cerr << "Worker mmap() error : " << strerror(errno) << std::endl;
+		return 1;
+	}
+	FramebufferHeader * header = (FramebufferHeader *)framebuffer;
+	if (header->magic != FRAMEBUFFER_MAGIC || header->width != WIDTH || header->height != HEIGHT || header->tiles_count != tiles) {
+		std::cerr << "Worker error : framebuffer doesn't match the scene resolution" << std::endl;
+		munmap(framebuffer, layout.size);
+		return 1;
+	}
+	float * pixels = (float *)((char *)framebuffer + layout.pixels_offset);
+	uint32_t * counts = (uint32_t *)((char *)framebuffer + layout.counts_offset);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+	if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+		std::cerr << "Worker error : can't connect to " << socket_path << std::endl;
+		if (fd >= 0) close(fd);
+		munmap(framebuffer, layout.size);
+		return 1;
+	}
+
+	send_message(fd, make_message(MESSAGE_HELLO, (int)getpid()));
+
+	ClusterMessage message;
+	Image image(WIDTH, HEIGHT);
+	while (receive_message(fd, message) && message.type == MESSAGE_TILE) {
+		// Every pass of a tile gets its own random sequence, whichever worker renders it
+		srand((unsigned)(message.pass * tiles + message.tile + 1));
+		render.render_tile(image, message.x, message.y, message.width, message.height);
+		for (int y = message.y; y < message.y + message.height; ++y) {
+			for (int x = message.x; x < message.x + message.width; ++x) {
+				// A pass redone after a crash or a lost worker doesn't add twice
+				uint32_t & count = counts[y * WIDTH + x];
+				if (count > (uint32_t)message.pass) continue;
+				const Vec3 & col = image.at(x, y);
+				float * pixel = pixels + (y * WIDTH + x) * 3;
+				pixel[0] += (float)col.r;
+				pixel[1] += (float)col.g;
+				pixel[2] += (float)col.b;
+				count = message.pass + 1;
+			}
+		}
+		if (!send_message(fd, make_message(MESSAGE_DONE, message.tile, 0, 0, 0, 0, message.pass))) break;
+	}
+
+	close(fd);
+	munmap(framebuffer, layout.size);
+	return 0;
+}
+
+#endif
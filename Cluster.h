@@ -0,0 +1,81 @@
+#pragma once
+
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "Configurer.h"
+#include "Render.h"
+#include "Image.h"
+
+// Renders one frame with several processes. The coordinator splits the frame in tiles and
+// hands them to worker processes over a Unix socket, workers add pixels straight into a
+// shared memory accumulation buffer and report finished tiles. Every tile is rendered
+// render_passes times. Tiles of a worker that disconnects are handed to the others.
+// With a checkpoint file the buffer lives in that file instead, a background thread syncs
+// it periodically and a later run with the same settings continues where it stopped. POSIX only.
+
+class Coordinator {
+
+public:
+
+	enum class Result {
+		SUCCESS,
+		FAIL_UNSUPPORTED,
+		FAIL_SHARED_MEMORY,
+		FAIL_SOCKET,
+		FAIL_NO_WORKERS,
+	};
+
+	// Executable is started with --worker <socket> <shared memory> for every local worker
+	Coordinator(const Configurer & config, const std::string & executable);
+
+	Result render(Image & image);
+
+private:
+
+	struct Tile {
+		int x, y, width, height;
+		int passes_done;
+		int worker; // -1 if no pass of the tile is in flight
+	};
+
+	std::vector<Tile> tiles;
+	std::string executable;
+	uint64_t settings_hash; // checkpoints of other settings are not resumed
+	bool settings_hashed; // false if the scene files couldn't be read, no checkpoint is resumed then
+
+	int WIDTH;
+	int HEIGHT;
+	int TILE_SIZE;
+	int WORKERS_COUNT;
+	int TILES_PER_WORKER;
+	int PASSES;
+	std::string CHECKPOINT_PATH;
+	int CHECKPOINT_INTERVAL;
+
+};
+
+class ClusterWorker {
+
+public:
+
+	ClusterWorker(const Configurer & config);
+
+	// Returns process exit code, framebuffer is a shared memory name or file:<path>
+	int run(const std::string & socket_path, const std::string & shm_name);
+
+private:
+
+	Render render;
+
+	int WIDTH;
+	int HEIGHT;
+	int TILE_SIZE;
+	int PASSES;
+
+};
+
+#endif // _CLUSTER_H_
\ No newline at end of file
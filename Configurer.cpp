@@ -1,5 +1,11 @@
 #include "Configurer.h"
 #include "Textures.h"
+#include "TextureProgram.h"
+#include "ImageTexture.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
 
 Configurer::Configurer()
 {
@@ -17,8 +23,37 @@ bool Configurer::load(std::string path)
 
 	// AppSystem
 	window_title = "Hello world!";
-	threads_count = 3;
+	threads_count = 0;
+	numa_replicas = false;
 	framerate = 60;
+	heatmap_path = "";
+	preview_levels = 3;
+	roi_x = 0;
+	roi_y = 0;
+	roi_width = 0;
+	roi_height = 0;
+	roi_follow_mouse = true;
+	roi_crop = false;
+	temporal_reuse = true;
+
+	// Headless rendering
+	output_path = "render.ppm";
+	tile_size = 32;
+	cluster_workers = 4;
+	render_passes = 1;
+	checkpoint_path = "";
+	checkpoint_interval = 60;
+	time_budget = 30.0;
+
+	// Camera control
+	cam_move_step = 5.0;
+	cam_rotate_step = 0.05;
+	mouse_sensitivity = 0.005;
+
+	// Animation
+	frame_count = 48;
+	frame_rate = 24.0;
+	sequence_path = "frame_%04d.ppm";
 
 	// Render camera settings
 	cam_forward = Vec3(0.0, 0.0, 1.0).normalized();
@@ -30,9 +65,27 @@ bool Configurer::load(std::string path)
 	cam_height = 9.0;
 	cam_depth = 16.0;
 
+	// Camera keys, forward is kept pointing at the target
+	cam_position_track
+		.key(0.0, cam_position)
+		.key(2.0, Vec3(40.0, 10.0, -170.0));
+	cam_target_track
+		.key(0.0, Vec3(0.0, 0.0, 0.0));
+
 	// Render settings
 	exposure = -0.75;
+	gamma = 1.0;
 	aa_factor = 2;
+	gbuffer_cache = false;
+	wavefront = false;
+	wavefront_batch = 65536;
+
+	// Denoiser
+	denoise_iterations = 0;
+	denoise_color_sigma = 1.0;
+	denoise_normal_sigma = 0.3;
+	denoise_albedo_sigma = 0.2;
+	denoise_depth_sigma = 0.02;
 
 	// Tracer settings
 	max_bounce = 10;
@@ -40,9 +93,26 @@ bool Configurer::load(std::string path)
 	refractive_bounce_value = 2;
 	reflective_bounce_value = 2;
 	diffuse_ray_count = 20;
+	diffuse_mis = false;
 	tracer_bias = 0.01;
+	texture_lod = true;
+	fresnel = false;
+
+	// Irradiance cache
+	irradiance_cache = false;
+	irradiance_accuracy = 0.3;
+	irradiance_min_spacing = 0.5;
+	irradiance_max_spacing = 20.0;
+	irradiance_ray_count = 100;
+
+	// Caustics
+	caustic_photons = 0;
+	caustic_radius = 1.0;
 
 	// Scene
+	environment_path = "";
+	environment_scale = 1.0;
+	texture_cache_mb = 64;
 	std::shared_ptr<Shape> left_wall = std::make_shared<ComposedShape>(std::vector<ComposedShape::MetaShape>{
 		{ std::make_shared<Sphere>(Vec3(-25.0, 0.0, 0.0), 50.0), ComposedShape::MetaShape::MetaShapeType::POSITIVE },
 		{ std::make_shared<Plane>(Vec3(-25.0, 0.0, 0.0), Vec3(-1.0, 0.0, 0.0)), ComposedShape::MetaShape::MetaShapeType::NEGATIVE },
@@ -160,6 +230,10 @@ bool Configurer::load(std::string path)
 		.set_refraction_index(1.3)
 		.set_refraction_density(Vec3(0.0, 0.0, 1.0) * (-0.5))
 		));
+	body_tracks.push_back({ (int)bodies.size() - 1, Track()
+		.key(0.0, Vec3(0.0, 0.0, 0.0))
+		.key(1.0, Vec3(0.0, 8.0, 0.0))
+		.key(2.0, Vec3(0.0, 0.0, 0.0)) });
 
 	bodies.push_back(Body(
 		std::make_shared<Sphere>(Vec3(15.0, 0.0, -30.0), 10.0),
@@ -180,5 +254,125 @@ bool Configurer::load(std::string path)
 			(Vec3(1.0, 1.0, 0.8) * 20.0))
 		));
 
+	scene_path = path;
+	textured_bodies.clear();
+	image_paths.clear();
+	return load_scene_file(path);
+}
+
+// Texture programs and image textures both work as colors and as bump maps
+template <class Channel>
+static bool set_channel(Material & material, const std::string & channel, const Channel & fn)
+{
+	if (channel == "simple_diffuse") material.set_simple_diffuse_color(fn);
+	else if (channel == "diffuse") material.set_diffuse_color(fn);
+	else if (channel == "pure_reflective") material.set_pure_reflective_color(fn);
+	else if (channel == "refractive") material.set_refractive_color(fn);
+	else if (channel == "light_source") material.set_light_source_color(fn);
+	else if (channel == "bump") material.set_bump_mapping(fn);
+	else return false;
 	return true;
 }
+
+// Lines "texture NAME = EXPRESSION" (see TextureProgram), "image NAME = PATH ORIGIN U_AXIS V_AXIS"
+// (see ImageChannel, vectors are three numbers) and "material BODY CHANNEL NAME", # starts a comment. Without the file the built in scene stays as it is.
+bool Configurer::load_scene_file(const std::string & path)
+{
+	std::ifstream file(path);
+	if (!file) {
+		return true;
+	}
+
+	std::map<std::string, std::shared_ptr<TextureProgram>> textures;
+	std::map<std::string, std::shared_ptr<ImageChannel>> images;
+	std::string line;
+	bool loaded = true;
+	for (int number = 1; std::getline(file, line); ++number) {
+		std::istringstream words(line);
+		std::string directive;
+		words >> directive;
+		if (directive.empty() || directive[0] == '#') continue;
+
+		if (directive == "texture") {
+			std::string name, equals, source;
+			words >> name >> equals;
+			std::getline(words, source);
+			std::shared_ptr<TextureProgram> program = std::make_shared<TextureProgram>();
+			if (name.empty() || equals != "=" || !program->compile(source)) {
+				std::cerr << "Configurer::load() error : bad texture at " << path << ":" << number << std::endl;
+				loaded = false;
+				// Like TextureProgram::compile(), a reload with a broken source goes on with the previous program
+				auto previous = texture_programs.find(name);
+				if (previous != texture_programs.end()) {
+					textures[name] = previous->second;
+				}
+				continue;
+			}
+			textures[name] = program;
+		}
+		else if (directive == "image") {
+			std::string name, equals, image_path;
+			Vec3 origin, u_axis, v_axis;
+			words >> name >> equals >> image_path
+				>> origin.x >> origin.y >> origin.z >> u_axis.x >> u_axis.y >> u_axis.z >> v_axis.x >> v_axis.y >> v_axis.z;
+			std::shared_ptr<ImageTexture> texture = std::make_shared<ImageTexture>();
+			if (!words || name.empty() || equals != "=" || u_axis.length() <= 0.0 || v_axis.length() <= 0.0 || !texture->open(image_path)) {
+				std::cerr << "Configurer::load() error : bad image at " << path << ":" << number << std::endl;
+				loaded = false;
+				continue;
+			}
+			images[name] = std::make_shared<ImageChannel>(texture, origin, u_axis, v_axis);
+			image_paths.push_back(image_path);
+		}
+		else if (directive == "material") {
+			int body_number = -1;
+			std::string channel, name;
+			words >> body_number >> channel >> name;
+			auto texture = textures.find(name);
+			auto image = images.find(name);
+			if (body_number < 0 || body_number >= (int)bodies.size() || (texture == textures.end() && image == images.end())) {
+				std::cerr << "Configurer::load() error : bad body or texture name at " << path << ":" << number << std::endl;
+				loaded = false;
+				continue;
+			}
+
+			Material & material = bodies[body_number].material;
+			bool known = (texture != textures.end())
+				? set_channel(material, channel, TextureChannel(texture->second))
+				: set_channel(material, channel, *image->second);
+			if (!known) {
+				std::cerr << "Configurer::load() error : unknown channel " << channel << " at " << path << ":" << number << std::endl;
+				loaded = false;
+				continue;
+			}
+			textured_bodies.push_back(body_number);
+		}
+		else {
+			std::cerr << "Configurer::load() error : unknown directive " << directive << " at " << path << ":" << number << std::endl;
+			loaded = false;
+		}
+	}
+	texture_programs = textures;
+	return loaded;
+}
+
+Configurer Configurer::at_time(double time) const
+{
+	Configurer config(*this);
+
+	if (!cam_position_track.empty()) {
+		config.cam_position = cam_position_track.at(time);
+	}
+	if (!cam_target_track.empty()) {
+		config.cam_forward = (cam_target_track.at(time) - config.cam_position).normalized();
+		config.cam_right = config.cam_uppy.cross(config.cam_forward).normalized();
+		config.cam_up = config.cam_forward.cross(config.cam_right);
+	}
+
+	for (size_t i = 0; i < body_tracks.size(); ++i) {
+		Body & body = config.bodies[body_tracks[i].body_number];
+		body.shape = std::make_shared<TranslatedShape>(body.shape, body_tracks[i].translation.at(time));
+	}
+
+	return config;
+}
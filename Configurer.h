@@ -4,7 +4,12 @@
 #define _CONFIGURER_H_
 
 #include <string>
+#include <map>
+#include <memory>
 #include "Body.h"
+#include "Animation.h"
+
+class TextureProgram;
 
 class Configurer {
 
@@ -15,14 +20,41 @@ public:
 
 	bool load(std::string path);
 
+	// Copy with camera and bodies moved to their keyframed state at given time
+	Configurer at_time(double time) const;
+
 	// Resolution
 	int window_width;
 	int window_height;
 
 	// AppSystem
 	std::string window_title;
-	int threads_count;
+	int threads_count; // render threads, 0 for one per hardware thread
+	bool numa_replicas; // every NUMA node renders from its own copy of the scene
 	int framerate;
+	std::string heatmap_path; // per-pixel cost output, empty to disable
+	int preview_levels; // coarse single sample passes before the full one, 0 to disable
+	int roi_x; // region of interest rendered first, none if width or height is 0
+	int roi_y;
+	int roi_width;
+	int roi_height;
+	bool roi_follow_mouse; // region of that size moves with the cursor
+	bool roi_crop; // render only the region
+	bool temporal_reuse; // camera moves keep the radiance of surfaces still in view and render the rest first
+
+	// Headless rendering
+	std::string output_path;
+	int tile_size;
+	int cluster_workers; // local worker processes of --cluster
+	int render_passes; // --cluster renders every tile this many times and averages
+	std::string checkpoint_path; // --cluster accumulation file to resume from, empty to disable
+	int checkpoint_interval; // seconds between checkpoint syncs
+	double time_budget; // wall-clock seconds of a --budget render
+
+	// Camera control
+	double cam_move_step;
+	double cam_rotate_step;
+	double mouse_sensitivity;
 
 	// Render camera settings
 	Vec3 cam_position;
@@ -35,8 +67,19 @@ public:
 	double cam_depth;
 
 	// Render settings
-	double exposure;
+	double exposure; // tone curve is 1 - exp(radiance * exposure), so it is negative
+	double gamma;
 	int aa_factor;
+	bool gbuffer_cache; // cache camera ray hits, ~200 bytes per subpixel sample
+	bool wavefront; // headless tiles are traced breadth first in sorted ray batches
+	int wavefront_batch; // rays intersected and shaded per stage
+
+	// Denoiser
+	int denoise_iterations; // a-trous passes over the finished frame, 0 to disable
+	double denoise_color_sigma;
+	double denoise_normal_sigma;
+	double denoise_albedo_sigma;
+	double denoise_depth_sigma; // relative to the pixel depth
 
 	// Tracer settings
 	int max_bounce;
@@ -44,13 +87,49 @@ public:
 	int refractive_bounce_value;
 	int reflective_bounce_value;
 	int diffuse_ray_count;
+	bool diffuse_mis; // diffuse_ray_count cosine weighted rays and light samples per hit instead of rays per body
 	double tracer_bias;
+	bool texture_lod; // procedural textures drop detail smaller than the ray cone of a sample
+	bool fresnel; // bodies both reflective and refractive follow one branch per ray, picked by Fresnel reflectance
+
+	// Irradiance cache
+	bool irradiance_cache; // interpolate diffuse interreflection between sparse records
+	double irradiance_accuracy; // Ward's a, smaller gives more records
+	double irradiance_min_spacing;
+	double irradiance_max_spacing;
+	int irradiance_ray_count; // diffuse rays per body for a new record
+
+	// Caustics
+	int caustic_photons; // photons from every light to every mirror or glass body, 0 to disable
+	double caustic_radius; // density estimate radius
 
 	// Scene
 	std::vector<Body> bodies;
+	std::string scene_path; // file given to load(), its texture and material lines apply over the built in scene
+	std::vector<int> textured_bodies; // bodies the scene file set a channel of
+	std::vector<std::string> image_paths; // files of the scene file's image textures
+	// "texture" lines of the scene file by name, when a source doesn't compile load() keeps the program set here
+	std::map<std::string, std::shared_ptr<TextureProgram>> texture_programs;
+	std::string environment_path; // equirectangular PFM or Radiance HDR sky, empty for a black background
+	double environment_scale;
+	int texture_cache_mb; // decoded tiles of all image textures together
+
+	// Animation, empty tracks keep the static setup
+	Track cam_position_track;
+	Track cam_target_track;
+	struct BodyTrack {
+		int body_number;
+		Track translation;
+	};
+	std::vector<BodyTrack> body_tracks;
+	int frame_count;
+	double frame_rate;
+	std::string sequence_path; // printf pattern of --sequence frames
 
 private:
 
+	bool load_scene_file(const std::string & path);
+
 };
 
 #endif // _CONFIGURER_H_
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include "Denoiser.h"
+#include "Topology.h"
+#include <math.h>
+#include <functional>
+#include <thread>
+
+// Splits rows [0, height) in equal bands, one thread per band
+static void parallel_rows(int height, int threads_count, const std::function<void(int, int)> & body)
+{
+	std::vector<std::thread> threads;
+	for (int i = 1; i < threads_count; ++i) {
+		threads.push_back(std::thread(body, height * i / threads_count, height * (i + 1) / threads_count));
+	}
+	body(0, height / threads_count);
+	for (size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+}
+
+Denoiser::Denoiser(const Configurer & config)
+{
+	this->WIDTH = config.window_width;
+	this->HEIGHT = config.window_height;
+	this->THREADS_COUNT = Topology::get().threads_for(config.threads_count);
+	this->ITERATIONS = config.denoise_iterations;
+	this->COLOR_SIGMA = config.denoise_color_sigma;
+	this->NORMAL_SIGMA = config.denoise_normal_sigma;
+	this->ALBEDO_SIGMA = config.denoise_albedo_sigma;
+	this->DEPTH_SIGMA = config.denoise_depth_sigma;
+	features.resize(WIDTH * HEIGHT);
+}
+
+void Denoiser::gather(const Render & render, const Camera & camera)
+{
+	parallel_rows(HEIGHT, THREADS_COUNT, [&](int y0, int y1) {
+		for (int y = y0; y < y1; ++y) {
+			for (int x = 0; x < WIDTH; ++x) {
+				Feature & f = features[y * WIDTH + x];
+				render.pixel_features(x, y, camera, f.normal, f.albedo, f.depth);
+			}
+		}
+	});
+}
+
+void Denoiser::apply(Image & image) const
+{
+	Image buffer(WIDTH, HEIGHT);
+	Image * src = &image;
+	Image * dst = &buffer;
+	double color_sigma2 = COLOR_SIGMA * COLOR_SIGMA;
+
+	for (int i = 0; i < ITERATIONS; ++i) {
+		parallel_rows(HEIGHT, THREADS_COUNT, [&](int y0, int y1) {
+			filter_rows(*src, *dst, 1 << i, color_sigma2, y0, y1);
+		});
+		std::swap(src, dst);
+		// Coarser passes see already smoothed colors, so they are allowed less color difference
+		color_sigma2 *= 0.5;
+	}
+
+	if (src != &image) image.pixels.swap(src->pixels);
+}
+
+void Denoiser::filter_rows(const Image & src, Image & dst, int step, double color_sigma2, int y0, int y1) const
+{
+	static const double kernel[5] = { 1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };
+	double normal_sigma2 = NORMAL_SIGMA * NORMAL_SIGMA;
+	double albedo_sigma2 = ALBEDO_SIGMA * ALBEDO_SIGMA;
+
+	for (int y = y0; y < y1; ++y) {
+		for (int x = 0; x < WIDTH; ++x) {
+			const Feature & fp = features[y * WIDTH + x];
+			const Vec3 & cp = src.at(x, y);
+			// Depth tolerance grows with distance and with the tap spread
+			double depth_sigma = DEPTH_SIGMA * fp.depth * step;
+
+			Vec3 sum = Vec3(0.0, 0.0, 0.0);
+			double weight_sum = 0.0;
+			for (int ky = 0; ky < 5; ++ky) {
+				int qy = y + (ky - 2) * step;
+				if (qy < 0 || qy >= HEIGHT) continue;
+				for (int kx = 0; kx < 5; ++kx) {
+					int qx = x + (kx - 2) * step;
+					if (qx < 0 || qx >= WIDTH) continue;
+
+					const Feature & fq = features[qy * WIDTH + qx];
+					// Don't mix background into geometry and back
+					if ((fp.depth == 0.0) != (fq.depth == 0.0)) continue;
+
+					const Vec3 & cq = src.at(qx, qy);
+					Vec3 dc = cp - cq;
+					Vec3 dn = fp.normal - fq.normal;
+					Vec3 da = fp.albedo - fq.albedo;
+					double exponent = dc.dot(dc) / color_sigma2 + dn.dot(dn) / normal_sigma2 + da.dot(da) / albedo_sigma2;
+					if (depth_sigma > 0.0) {
+						double dd = (fp.depth - fq.depth) / depth_sigma;
+						exponent += dd * dd;
+					}
+
+					double weight = kernel[kx] * kernel[ky] * exp(-exponent);
+					sum = sum + cq * weight;
+					weight_sum += weight;
+				}
+			}
+			// Center tap always has weight, so the sum can't be 0
+			dst.at(x, y) = sum / weight_sum;
+		}
+	}
+}
\ No newline at end of file
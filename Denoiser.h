@@ -0,0 +1,52 @@
+#pragma once
+
+#ifndef _DENOISER_H_
+#define _DENOISER_H_
+
+#include <vector>
+#include "Configurer.h"
+#include "Render.h"
+#include "Camera.h"
+#include "Image.h"
+
+// Edge-aware a-trous wavelet filter. Each pass blurs with a 5x5 B3 spline kernel whose taps are
+// spread 2^pass pixels apart, and weights taps by how close their color, normal, albedo and
+// depth are to the center pixel, so noise is smoothed without blurring geometry or texture edges.
+
+class Denoiser {
+
+public:
+
+	Denoiser(const Configurer & config);
+
+	bool enabled() const { return ITERATIONS > 0; }
+
+	// Fills the guide buffers with primary hits through pixel centers
+	void gather(const Render & render, const Camera & camera);
+	// Filters the image in place, gather() has to be called first for the same view
+	void apply(Image & image) const;
+
+private:
+
+	struct Feature {
+		Vec3 normal;
+		Vec3 albedo;
+		double depth; // 0 if nothing was hit
+	};
+
+	std::vector<Feature> features;
+
+	void filter_rows(const Image & src, Image & dst, int step, double color_sigma2, int y0, int y1) const;
+
+	int WIDTH;
+	int HEIGHT;
+	int THREADS_COUNT;
+	int ITERATIONS;
+	double COLOR_SIGMA;
+	double NORMAL_SIGMA;
+	double ALBEDO_SIGMA;
+	double DEPTH_SIGMA;
+
+};
+
+#endif // _DENOISER_H_
\ No newline at end of file
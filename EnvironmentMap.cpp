@@ -0,0 +1,165 @@
+#include "EnvironmentMap.h"
+#include "Image.h"
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+EnvironmentMap::EnvironmentMap()
+	: width(0), height(0)
+{
+}
+
+bool EnvironmentMap::load(const std::string & path, double scale)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		std::cerr << "EnvironmentMap::load() error : can't open " << path << std::endl;
+		return false;
+	}
+	char magic[2] = {};
+	file.read(magic, 2);
+	file.seekg(0);
+	bool loaded = (magic[0] == 'P' && (magic[1] == 'F' || magic[1] == 'f'))
+		? Image::read_pfm(file, path, width, height, pixels)
+		: load_hdr(file, path);
+	if (!loaded) return false;
+
+	for (size_t i = 0; i < pixels.size(); ++i) pixels[i] *= (float)scale;
+	build_distribution();
+	return true;
+}
+
+bool EnvironmentMap::load_hdr(std::istream & file, const std::string & path)
+{
+	std::string line;
+	std::getline(file, line);
+	if (line.compare(0, 2, "#?") != 0) {
+		std::cerr << "EnvironmentMap::load() error : " << path << " is neither PFM nor Radiance HDR" << std::endl;
+		return false;
+	}
+	// Header ends with an empty line, then comes the resolution
+	while (std::getline(file, line) && !line.empty()) {
+		if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe") {
+			std::cerr << "EnvironmentMap::load_hdr() error : unsupported " << line << " in " << path << std::endl;
+			return false;
+		}
+	}
+	std::getline(file, line);
+	std::istringstream resolution(line);
+	std::string y_axis, x_axis;
+	resolution >> y_axis >> height >> x_axis >> width;
+	if (y_axis != "-Y" || x_axis != "+X" || width <= 0 || height <= 0) {
+		std::cerr << "EnvironmentMap::load_hdr() error : unsupported resolution line in " << path << std::endl;
+		return false;
+	}
+
+	pixels.resize(width * height * 3);
+	std::vector<unsigned char> rgbe(width * 4);
+	for (int y = 0; y < height; ++y) {
+		unsigned char head[4];
+		file.read((char *)head, 4);
+		if (width >= 8 && width < 0x8000 && head[0] == 2 && head[1] == 2 && ((head[2] << 8) | head[3]) == width) {
+			// Run length encoded scanline, each component stored separately
+			for (int c = 0; c < 4; ++c) {
+				int x = 0;
+				while (x < width && file) {
+					int count = file.get();
+					if (count > 128) {
+						count -= 128;
+						int value = file.get();
+						for (int i = 0; i < count && x < width; ++i) rgbe[(x++) * 4 + c] = (unsigned char)value;
+					}
+					else {
+						for (int i = 0; i < count && x < width; ++i) rgbe[(x++) * 4 + c] = (unsigned char)file.get();
+					}
+				}
+			}
+		}
+		else {
+			// Flat scanline
+			memcpy(rgbe.data(), head, 4);
+			file.read((char *)rgbe.data() + 4, (width - 1) * 4);
+		}
+		if (!file) {
+			std::cerr << "EnvironmentMap::load_hdr() error : truncated " << path << std::endl;
+			return false;
+		}
+		for (int x = 0; x < width; ++x) {
+			const unsigned char * p = &rgbe[x * 4];
+			float f = p[3] ? (float)ldexp(1.0, p[3] - (128 + 8)) : 0.0f;
+			for (int c = 0; c < 3; ++c) {
+				pixels[(y * width + x) * 3 + c] = p[c] * f;
+			}
+		}
+	}
+	return true;
+}
+
+void EnvironmentMap::build_distribution()
+{
+	marginal.assign(height + 1, 0.0);
+	conditional.assign(height * (width + 1), 0.0);
+	for (int y = 0; y < height; ++y) {
+		// Rows near the poles cover less solid angle
+		double sin_theta = sin(M_PI * (y + 0.5) / height);
+		double * row = &conditional[y * (width + 1)];
+		for (int x = 0; x < width; ++x) {
+			const float * p = &pixels[(y * width + x) * 3];
+			double luminance = 0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2];
+			row[x + 1] = row[x] + std::max(luminance, 0.0) * sin_theta;
+		}
+		marginal[y + 1] = marginal[y] + row[width];
+	}
+}
+
+void EnvironmentMap::pixel_of(Vec3 direction, int & x, int & y) const
+{
+	double u = 0.5 + atan2(direction.x, direction.z) / (2.0 * M_PI);
+	double v = acos(std::min(std::max(direction.y, -1.0), 1.0)) / M_PI;
+	x = std::min((int)(u * width), width - 1);
+	y = std::min((int)(v * height), height - 1);
+}
+
+Vec3 EnvironmentMap::radiance(Vec3 direction) const
+{
+	int x, y;
+	pixel_of(direction, x, y);
+	const float * p = &pixels[(y * width + x) * 3];
+	return Vec3(p[0], p[1], p[2]);
+}
+
+Vec3 EnvironmentMap::sample(double u1, double u2, double * pdf) const
+{
+	// Row from the marginal, then pixel from the row, both by binary search
+	int y = (int)(std::upper_bound(marginal.begin(), marginal.end(), u1 * marginal[height]) - marginal.begin()) - 1;
+	y = std::min(std::max(y, 0), height - 1);
+	const double * row = &conditional[y * (width + 1)];
+	int x = (int)(std::upper_bound(row, row + width + 1, u2 * row[width]) - row) - 1;
+	x = std::min(std::max(x, 0), width - 1);
+
+	// Uniform inside the pixel
+	double dx = (row[x + 1] > row[x]) ? (u2 * row[width] - row[x]) / (row[x + 1] - row[x]) : 0.5;
+	double dy = (marginal[y + 1] > marginal[y]) ? (u1 * marginal[height] - marginal[y]) / (marginal[y + 1] - marginal[y]) : 0.5;
+	double phi = 2.0 * M_PI * ((x + dx) / width - 0.5);
+	double theta = M_PI * (y + dy) / height;
+	Vec3 direction = Vec3(sin(theta) * sin(phi), cos(theta), sin(theta) * cos(phi));
+	if (pdf) *pdf = this->pdf(direction);
+	return direction;
+}
+
+double EnvironmentMap::pdf(Vec3 direction) const
+{
+	if (marginal.empty() || marginal[height] <= 0.0) return 0.0;
+	int x, y;
+	pixel_of(direction, x, y);
+	const double * row = &conditional[y * (width + 1)];
+	// Pixel probability is spread uniformly over the pixel's u, v square
+	double sin_theta = sqrt(std::max(1.0 - direction.y * direction.y, 0.0));
+	if (sin_theta <= 0.0) return 0.0;
+	double probability = (row[x + 1] - row[x]) / marginal[height];
+	return probability * width * height / (2.0 * M_PI * M_PI * sin_theta);
+}
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+
+#ifndef _ENVIRONMENTMAP_H_
+#define _ENVIRONMENTMAP_H_
+
+#include <string>
+#include <vector>
+#include "Vec3.h"
+
+// Equirectangular HDR sky around the scene, +y is up and the image center looks towards +z.
+// A 2D CDF over pixel luminance times the row's solid angle lets samplers pick directions
+// in proportion to the light coming from them.
+
+class EnvironmentMap {
+
+public:
+
+	EnvironmentMap();
+
+	// PFM or Radiance .hdr (RGBE), picked by the file contents
+	bool load(const std::string & path, double scale = 1.0);
+
+	int width;
+	int height;
+
+	Vec3 radiance(Vec3 direction) const;
+	// Direction from two uniform numbers in [0, 1), pdf is over solid angle
+	Vec3 sample(double u1, double u2, double * pdf) const;
+	double pdf(Vec3 direction) const;
+
+private:
+
+	bool load_hdr(std::istream & file, const std::string & path);
+	void build_distribution();
+	void pixel_of(Vec3 direction, int & x, int & y) const;
+
+	std::vector<float> pixels; // rgb, top row first
+	std::vector<double> marginal; // cumulative row weights, height + 1 entries
+	std::vector<double> conditional; // cumulative pixel weights of every row, width + 1 entries each
+
+};
+
+#endif // _ENVIRONMENTMAP_H_
\ No newline at end of file
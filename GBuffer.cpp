@@ -0,0 +1,46 @@
+#include "GBuffer.h"
+#include <algorithm>
+
+GBuffer::GBuffer(int width, int height, int samples)
+	: width(width), height(height), samples(samples), 
+	entries(width * height * samples), states(new std::atomic<unsigned char>[width * height * samples])
+{
+	invalidate();
+}
+
+bool GBuffer::lookup(int px, int sample, SurfaceHit & surface) const
+{
+	int i = px * samples + sample;
+	// Acquire pairs with the release in store(), the entry is complete once VALID is seen
+	if (states[i].load(std::memory_order_acquire) != VALID) return false;
+	surface = entries[i];
+	return true;
+}
+
+void GBuffer::store(int px, int sample, const SurfaceHit & surface)
+{
+	int i = px * samples + sample;
+	// Another thread is writing or has written the same hit
+	unsigned char expected = EMPTY;
+	if (!states[i].compare_exchange_strong(expected, WRITING, std::memory_order_relaxed)) return;
+	entries[i] = surface;
+	states[i].store(VALID, std::memory_order_release);
+}
+
+const SurfaceHit * GBuffer::sample(int px, int sample) const
+{
+	int i = px * samples + sample;
+	return states[i].load(std::memory_order_acquire) == VALID ? &entries[i] : nullptr;
+}
+
+void GBuffer::invalidate()
+{
+	for (size_t i = 0; i < entries.size(); ++i) states[i].store(EMPTY, std::memory_order_relaxed);
+}
+
+void GBuffer::invalidate_body(int body_number)
+{
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (entries[i].body == body_number || entries[i].medium == body_number) states[i].store(EMPTY, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef _GBUFFER_H_
+#define _GBUFFER_H_
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include "Tracer.h"
+
+// Primary hits of every subpixel sample for a static camera. Shading of later passes starts
+// from here instead of tracing camera rays again, denoising and reprojection read it as
+// auxiliary buffers. Previews and the full pass of a pixel may run at once, the first one to
+// store a sample writes it and readers only see it once complete. Invalidation must happen
+// while no thread renders.
+class GBuffer {
+
+public:
+
+	GBuffer(int width, int height, int samples);
+
+	bool lookup(int px, int sample, SurfaceHit & surface) const;
+	void store(int px, int sample, const SurfaceHit & surface);
+	// Cached hit of a valid sample, nullptr otherwise
+	const SurfaceHit * sample(int px, int sample) const;
+
+	void invalidate();
+	// Only entries which hit or look through the body
+	void invalidate_body(int body_number);
+
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+	int get_samples() const { return samples; }
+
+private:
+
+	int width;
+	int height;
+	int samples;
+	enum State : unsigned char { EMPTY, WRITING, VALID };
+
+	std::vector<SurfaceHit> entries;
+	std::unique_ptr<std::atomic<unsigned char>[]> states;
+
+};
+
+#endif // _GBUFFER_H_
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "Heatmap.h"
+#include <math.h>
+#include <algorithm>
+#include <iostream>
+
+Heatmap::Heatmap(int width, int height)
+	: width(width), height(height), cost(width * height, 0.0f)
+{
+}
+
+static Vec3 ramp(double t)
+{
+	static const Vec3 stops[] = {
+		Vec3(0.0, 0.0, 0.5),
+		Vec3(0.0, 0.0, 1.0),
+		Vec3(0.0, 1.0, 1.0),
+		Vec3(0.0, 1.0, 0.0),
+		Vec3(1.0, 1.0, 0.0),
+		Vec3(1.0, 0.0, 0.0),
+	};
+	const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+	t = std::min(std::max(t, 0.0), 1.0) * last;
+	int i = std::min((int)t, last - 1);
+	double f = t - i;
+	return stops[i] * (1.0 - f) + stops[i + 1] * f;
+}
+
+Image Heatmap::false_color() const
+{
+	Image image(width, height);
+	float lo = 0.0f, hi = 0.0f;
+	for (size_t i = 0; i < cost.size(); ++i) {
+		if (cost[i] > 0.0f && (lo == 0.0f || cost[i] < lo)) lo = cost[i];
+		if (cost[i] > hi) hi = cost[i];
+	}
+	double log_lo = log(std::max(lo, 1.0f));
+	double log_range = log(std::max(hi, 1.0f)) - log_lo;
+	for (size_t i = 0; i < cost.size(); ++i) {
+		if (cost[i] <= 0.0f) continue; // not rendered
+		double t = (log_range > 0.0) ? (log(cost[i]) - log_lo) / log_range : 0.0;
+		image.pixels[i] = ramp(t);
+	}
+	return image;
+}
+
+Image Heatmap::raw() const
+{
+	Image image(width, height);
+	for (size_t i = 0; i < cost.size(); ++i) {
+		image.pixels[i] = Vec3(cost[i], cost[i], cost[i]);
+	}
+	return image;
+}
+
+bool Heatmap::save(const std::string & path) const
+{
+	return false_color().save_ppm(path + ".ppm") && raw().save_pfm(path + ".pfm");
+}
+
+void Heatmap::print_summary(std::ostream & out) const
+{
+	std::vector<float> sorted(cost);
+	std::sort(sorted.begin(), sorted.end());
+	double total = 0.0;
+	for (size_t i = 0; i < sorted.size(); ++i) total += sorted[i];
+	if (sorted.empty() || total <= 0.0) return;
+
+	// How much of the total time the most expensive 1% and 10% of pixels take
+	double top1 = 0.0, top10 = 0.0;
+	for (size_t i = 0; i < sorted.size(); ++i) {
+		size_t rank = sorted.size() - 1 - i;
+		if (i < sorted.size() / 100) top1 += sorted[rank];
+		if (i < sorted.size() / 10) top10 += sorted[rank];
+	}
+
+	out << "Pixel cost : mean " << total / sorted.size() / 1000.0 << " us"
+		<< ", median " << sorted[sorted.size() / 2] / 1000.0 << " us"
+		<< ", max " << sorted.back() / 1000.0 << " us" << std::endl;
+	out << "Most expensive 1% of pixels take " << 100.0 * top1 / total << "% of the time, "
+		<< "10% take " << 100.0 * top10 / total << "%" << std::endl;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#ifndef _HEATMAP_H_
+#define _HEATMAP_H_
+
+#include <string>
+#include <ostream>
+#include <vector>
+#include "Image.h"
+
+// Per-pixel render cost. Every pixel is written by the one thread that rendered it,
+// so no synchronization is needed until the buffer is saved.
+class Heatmap {
+
+public:
+
+	Heatmap(int width, int height);
+
+	void record(int px, double ns) { cost[px] = (float)ns; }
+
+	// Log scaled blue -> red ramp, cheapest pixel is blue, most expensive is red
+	Image false_color() const;
+	// Nanoseconds per pixel
+	Image raw() const;
+
+	// Writes <path>.ppm (false colour) and <path>.pfm (raw ns)
+	bool save(const std::string & path) const;
+	void print_summary(std::ostream & out) const;
+
+private:
+
+	int width;
+	int height;
+	std::vector<float> cost;
+
+};
+
+#endif // _HEATMAP_H_
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "Image.h"
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+Image::Image(int width, int height)
+	: width(width), height(height), pixels(width * height)
+{
+}
+
+static unsigned char to_byte(double v)
+{
+	if (v <= 0.0) return 0;
+	if (v >= 1.0) return 0xFF;
+	return static_cast<unsigned char>(v * 0xFF);
+}
+
+bool Image::save_ppm(const std::string & path) const
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file) {
+		std::cerr << "Image::save_ppm() error : can't open " << path << std::endl;
+		return false;
+	}
+	file << "P6\n" << width << " " << height << "\n255\n";
+	std::vector<unsigned char> row(width * 3);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			row[x * 3 + 0] = to_byte(at(x, y).r);
+			row[x * 3 + 1] = to_byte(at(x, y).g);
+			row[x * 3 + 2] = to_byte(at(x, y).b);
+		}
+		file.write((const char *)row.data(), row.size());
+	}
+	return file.good();
+}
+
+bool Image::save_pfm(const std::string & path) const
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file) {
+		std::cerr << "Image::save_pfm() error : can't open " << path << std::endl;
+		return false;
+	}
+	// Negative scale means little endian
+	file << "PF\n" << width << " " << height << "\n-1.0\n";
+	std::vector<float> row(width * 3);
+	for (int y = height - 1; y >= 0; --y) {
+		for (int x = 0; x < width; ++x) {
+			row[x * 3 + 0] = (float)at(x, y).r;
+			row[x * 3 + 1] = (float)at(x, y).g;
+			row[x * 3 + 2] = (float)at(x, y).b;
+		}
+		file.write((const char *)row.data(), row.size() * sizeof(float));
+	}
+	return file.good();
+}
+
+bool Image::load(const std::string & path)
+{
+	std::ifstream file(path, std::ios::binary);
+	char magic[2] = {};
+	file.read(magic, 2);
+	file.seekg(0);
+	if (file && magic[0] == 'P' && (magic[1] == 'F' || magic[1] == 'f')) {
+		std::vector<float> rgb;
+		if (!read_pfm(file, path, width, height, rgb)) {
+			width = height = 0;
+			pixels.clear();
+			return false;
+		}
+		pixels.resize(width * height);
+		for (int i = 0; i < width * height; ++i) {
+			pixels[i] = Vec3(rgb[i * 3 + 0], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+		}
+		return true;
+	}
+
+	std::string format;
+	double scale;
+	file >> format >> width >> height >> scale;
+	file.get(); // single whitespace before the data
+	if (!file || width <= 0 || height <= 0 || format != "P6") {
+		std::cerr << "Image::load() error : " << path << " isn't a binary PPM or PFM" << std::endl;
+		width = height = 0;
+		return false;
+	}
+	pixels.assign(width * height, Vec3(0.0, 0.0, 0.0));
+
+	int bytes = (scale > 255.0) ? 2 : 1;
+	std::vector<unsigned char> row(width * 3 * bytes);
+	for (int y = 0; y < height && file; ++y) {
+		file.read((char *)row.data(), row.size());
+		for (int x = 0; x < width; ++x) {
+			double c[3];
+			for (int i = 0; i < 3; ++i) {
+				const unsigned char * v = &row[(x * 3 + i) * bytes];
+				c[i] = ((bytes == 2) ? (v[0] << 8 | v[1]) : v[0]) / scale;
+			}
+			at(x, y) = Vec3(c[0], c[1], c[2]);
+		}
+	}
+	if (!file) {
+		std::cerr << "Image::load() error : truncated " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool Image::read_pfm(std::istream & file, const std::string & path, int & width, int & height, std::vector<float> & rgb)
+{
+	std::string format;
+	double endianness;
+	file >> format >> width >> height >> endianness;
+	file.get(); // single whitespace before the data
+	if (!file || width <= 0 || height <= 0 || (format != "PF" && format != "Pf")) {
+		std::cerr << "Image::read_pfm() error : bad header in " << path << std::endl;
+		return false;
+	}
+
+	// Negative scale means little endian, rows go bottom to top, Pf has one gray channel
+	int channels = (format == "PF") ? 3 : 1;
+	unsigned int probe = 1;
+	bool swap = (endianness < 0.0) != (*(unsigned char *)&probe == 1);
+	std::vector<float> row(width * channels);
+	rgb.resize(width * height * 3);
+	for (int y = height - 1; y >= 0; --y) {
+		file.read((char *)row.data(), row.size() * sizeof(float));
+		if (!file) {
+			std::cerr << "Image::read_pfm() error : truncated " << path << std::endl;
+			return false;
+		}
+		for (int i = 0; swap && i < width * channels; ++i) {
+			unsigned char * b = (unsigned char *)&row[i];
+			std::swap(b[0], b[3]);
+			std::swap(b[1], b[2]);
+		}
+		for (int x = 0; x < width; ++x) {
+			for (int c = 0; c < 3; ++c) {
+				rgb[(y * width + x) * 3 + c] = row[x * channels + (channels == 3 ? c : 0)];
+			}
+		}
+	}
+	return true;
+}
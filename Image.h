@@ -0,0 +1,38 @@
+#pragma once
+
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <string>
+#include <vector>
+#include <istream>
+#include "Vec3.h"
+
+class Image {
+
+public:
+
+	Image(int width = 0, int height = 0);
+
+	int width;
+	int height;
+	std::vector<Vec3> pixels;
+
+	Vec3 & at(int x, int y) { return pixels[y * width + x]; }
+	const Vec3 & at(int x, int y) const { return pixels[y * width + x]; }
+
+	// 8-bit binary PPM, channels are clamped to [0, 1]
+	bool save_ppm(const std::string & path) const;
+	// Raw float PFM, rows stored bottom to top as the format requires
+	bool save_pfm(const std::string & path) const;
+	// Binary PPM (8 or 16 bit, values over the maximum) or PFM, picked by the file contents
+	bool load(const std::string & path);
+
+	// PFM from an open stream as float rgb, top row first. Path is only for the errors.
+	static bool read_pfm(std::istream & file, const std::string & path, int & width, int & height, std::vector<float> & rgb);
+
+private:
+
+};
+
+#endif // _IMAGE_H_
\ No newline at end of file
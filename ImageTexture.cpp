@@ -0,0 +1,378 @@
+#include "ImageTexture.h"
+#include "Image.h"
+#include "Textures.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// Little endian, followed by the level table and the tiles of every level in row order
+struct TextureFileHeader {
+	char magic[4];
+	int32_t version;
+	int32_t width;
+	int32_t height;
+	int32_t tile_size;
+	int32_t levels;
+};
+
+static const char TEXTURE_MAGIC[4] = { 'R', 'T', 'T', 'X' };
+static const int32_t TEXTURE_VERSION = 1;
+
+static void encode_rgbe(Vec3 color, unsigned char * rgbe)
+{
+	double r = std::max(color.r, 0.0), g = std::max(color.g, 0.0), b = std::max(color.b, 0.0);
+	double m = std::max(std::max(r, g), b);
+	if (m < 1e-32) {
+		rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+		return;
+	}
+	int e;
+	double f = frexp(m, &e) * 256.0 / m;
+	rgbe[0] = (unsigned char)std::min(r * f, 255.0);
+	rgbe[1] = (unsigned char)std::min(g * f, 255.0);
+	rgbe[2] = (unsigned char)std::min(b * f, 255.0);
+	rgbe[3] = (unsigned char)(e + 128);
+}
+
+// Scale of an RGBE exponent byte, decoding a tile would spend most of its time in ldexp() otherwise
+static const float * rgbe_scales()
+{
+	static float scales[256];
+	static bool ready = [] {
+		scales[0] = 0.0f;
+		for (int e = 1; e < 256; ++e) scales[e] = (float)ldexp(1.0, e - (128 + 8));
+		return true;
+	}();
+	(void)ready;
+	return scales;
+}
+
+ImageTexture::ImageTexture()
+	: width(0), height(0), levels(0), data(nullptr), size(0), tile_size(0), level_table(nullptr), id(0)
+{
+#ifdef _WIN32
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+#endif
+}
+
+ImageTexture::~ImageTexture()
+{
+	if (!data) return;
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle((HANDLE)mapping_handle);
+	CloseHandle((HANDLE)file_handle);
+#else
+	munmap((void *)data, size);
+#endif
+}
+
+bool ImageTexture::open(const std::string & path)
+{
+	if (data) {
+		std::cerr << "ImageTexture::open() error : already open" << std::endl;
+		return false;
+	}
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		std::cerr << "ImageTexture::open() error : can't open " << path << std::endl;
+		return false;
+	}
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	void * view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!view) {
+		std::cerr << "ImageTexture::open() error : can't map " << path << std::endl;
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	mapping_handle = mapping;
+	size = (size_t)file_size.QuadPart;
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "ImageTexture::open() error : can't open " << path << " : " << strerror(errno) << std::endl;
+		return false;
+	}
+	struct stat st;
+	void * view = (fstat(fd, &st) == 0 && st.st_size > 0)
+		? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0)
+		: MAP_FAILED;
+	// The mapping keeps the file alive
+	close(fd);
+	if (view == MAP_FAILED) {
+		std::cerr << "ImageTexture::open() error : can't map " << path << " : " << strerror(errno) << std::endl;
+		return false;
+	}
+	// Lookups jump between tiles, reading ahead would only waste page cache
+	madvise(view, st.st_size, MADV_RANDOM);
+	size = st.st_size;
+#endif
+	data = (const unsigned char *)view;
+
+	const TextureFileHeader * header = (const TextureFileHeader *)data;
+	bool valid = size >= sizeof(TextureFileHeader)
+		&& memcmp(header->magic, TEXTURE_MAGIC, 4) == 0
+		&& header->version == TEXTURE_VERSION
+		&& header->tile_size > 0 && header->levels > 0 && header->levels < 32
+		&& size >= sizeof(TextureFileHeader) + header->levels * sizeof(Level);
+	if (valid) {
+		level_table = (const Level *)(data + sizeof(TextureFileHeader));
+		size_t tile_bytes = (size_t)header->tile_size * header->tile_size * 4;
+		for (int i = 0; i < header->levels && valid; ++i) {
+			const Level & level = level_table[i];
+			valid = level.width > 0 && level.height > 0 && level.offset > 0
+				&& level.tiles_x == (level.width + header->tile_size - 1) / header->tile_size
+				&& level.tiles_y == (level.height + header->tile_size - 1) / header->tile_size
+				&& (size_t)level.offset + (size_t)level.tiles_x * level.tiles_y * tile_bytes <= size;
+		}
+	}
+	if (!valid) {
+		std::cerr << "ImageTexture::open() error : " << path << " isn't a texture made by --make-texture" << std::endl;
+		return false;
+	}
+
+	static std::atomic<uint32_t> next_id(0);
+	id = next_id++;
+	width = header->width;
+	height = header->height;
+	levels = header->levels;
+	tile_size = header->tile_size;
+	return true;
+}
+
+bool ImageTexture::convert(const Image & image, const std::string & path, int tile_size)
+{
+	if (image.width <= 0 || image.height <= 0 || tile_size <= 0) {
+		std::cerr << "ImageTexture::convert() error : empty image or bad tile size" << std::endl;
+		return false;
+	}
+
+	std::vector<Image> chain(1, image);
+	while (chain.back().width > 1 || chain.back().height > 1) {
+		const Image & src = chain.back();
+		Image dst(std::max(src.width / 2, 1), std::max(src.height / 2, 1));
+		for (int y = 0; y < dst.height; ++y) {
+			for (int x = 0; x < dst.width; ++x) {
+				int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+				int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+				dst.at(x, y) = (src.at(x0, y0) + src.at(x1, y0) + src.at(x0, y1) + src.at(x1, y1)) * 0.25;
+			}
+		}
+		chain.push_back(dst);
+	}
+
+	TextureFileHeader header;
+	memcpy(header.magic, TEXTURE_MAGIC, 4);
+	header.version = TEXTURE_VERSION;
+	header.width = image.width;
+	header.height = image.height;
+	header.tile_size = tile_size;
+	header.levels = (int32_t)chain.size();
+
+	std::vector<Level> table(chain.size());
+	int64_t offset = sizeof(TextureFileHeader) + table.size() * sizeof(Level);
+	for (size_t i = 0; i < chain.size(); ++i) {
+		table[i].width = chain[i].width;
+		table[i].height = chain[i].height;
+		table[i].tiles_x = (chain[i].width + tile_size - 1) / tile_size;
+		table[i].tiles_y = (chain[i].height + tile_size - 1) / tile_size;
+		table[i].offset = offset;
+		offset += (int64_t)table[i].tiles_x * table[i].tiles_y * tile_size * tile_size * 4;
+	}
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file) {
+		std::cerr << "ImageTexture::convert() error : can't open " << path << std::endl;
+		return false;
+	}
+	file.write((const char *)&header, sizeof(header));
+	file.write((const char *)table.data(), table.size() * sizeof(Level));
+
+	// Texels past the image edge pad the last tiles and are never read
+	std::vector<unsigned char> tile(tile_size * tile_size * 4);
+	for (size_t i = 0; i < chain.size(); ++i) {
+		const Image & level = chain[i];
+		for (int ty = 0; ty < table[i].tiles_y; ++ty) {
+			for (int tx = 0; tx < table[i].tiles_x; ++tx) {
+				std::fill(tile.begin(), tile.end(), 0);
+				for (int y = 0; y < tile_size && ty * tile_size + y < level.height; ++y) {
+					for (int x = 0; x < tile_size && tx * tile_size + x < level.width; ++x) {
+						encode_rgbe(level.at(tx * tile_size + x, ty * tile_size + y), &tile[(y * tile_size + x) * 4]);
+					}
+				}
+				file.write((const char *)tile.data(), tile.size());
+			}
+		}
+	}
+	return file.good();
+}
+
+Vec3 ImageTexture::texel(int level, int x, int y) const
+{
+	const Level & l = level_table[level];
+	int tx = x / tile_size, ty = y / tile_size;
+	uint64_t key = ((uint64_t)id << 40) | ((uint64_t)level << 32) | (uint32_t)(ty * l.tiles_x + tx);
+
+	// Bilinear taps mostly land in the tile of the one before, which spares the cache lock
+	static thread_local uint64_t recent_key = ~(uint64_t)0;
+	static thread_local TileCache::Tile recent;
+	if (key != recent_key) {
+		TileCache & cache = TileCache::shared();
+		TileCache::Tile tile = cache.find(key);
+		if (!tile) {
+			std::vector<float> texels(tile_size * tile_size * 3);
+			const unsigned char * rgbe = data + l.offset + (size_t)(ty * l.tiles_x + tx) * tile_size * tile_size * 4;
+			const float * scales = rgbe_scales();
+			for (int i = 0; i < tile_size * tile_size; ++i) {
+				const unsigned char * p = rgbe + i * 4;
+				float f = scales[p[3]];
+				for (int c = 0; c < 3; ++c) {
+					texels[i * 3 + c] = p[c] * f;
+				}
+			}
+			tile = cache.insert(key, std::move(texels));
+		}
+		recent_key = key;
+		recent = tile;
+	}
+	const float * p = recent->data() + ((y - ty * tile_size) * tile_size + (x - tx * tile_size)) * 3;
+	return Vec3(p[0], p[1], p[2]);
+}
+
+Vec3 ImageTexture::bilinear(int level, double u, double v) const
+{
+	const Level & l = level_table[level];
+	double x = (u - floor(u)) * l.width - 0.5;
+	double y = (v - floor(v)) * l.height - 0.5;
+	double fx = floor(x), fy = floor(y);
+	double ax = x - fx, ay = y - fy;
+	int x0 = ((int)fx + l.width) % l.width, x1 = (x0 + 1) % l.width;
+	int y0 = ((int)fy + l.height) % l.height, y1 = (y0 + 1) % l.height;
+	return (texel(level, x0, y0) * (1.0 - ax) + texel(level, x1, y0) * ax) * (1.0 - ay)
+		+ (texel(level, x0, y1) * (1.0 - ax) + texel(level, x1, y1) * ax) * ay;
+}
+
+Vec3 ImageTexture::filtered(double u, double v, double footprint) const
+{
+	double lod = (footprint > 1.0) ? log2(footprint) : 0.0;
+	if (lod >= levels - 1) {
+		return bilinear(levels - 1, u, v);
+	}
+	int level = (int)lod;
+	double t = lod - level;
+	Vec3 color = bilinear(level, u, v);
+	if (t > 0.0) {
+		color = color * (1.0 - t) + bilinear(level + 1, u, v) * t;
+	}
+	return color;
+}
+
+TileCache & TileCache::shared()
+{
+	static TileCache cache;
+	return cache;
+}
+
+TileCache::TileCache()
+{
+	for (int i = 0; i < SHARDS; ++i) {
+		shards[i].bytes = 0;
+	}
+	set_capacity((size_t)64 << 20);
+}
+
+void TileCache::set_capacity(size_t bytes)
+{
+	shard_capacity = bytes / SHARDS;
+	for (int i = 0; i < SHARDS; ++i) {
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		evict(shards[i]);
+	}
+}
+
+void TileCache::evict(Shard & shard)
+{
+	// The newest tile always stays, even if it alone is over the capacity
+	size_t capacity = shard_capacity;
+	while (shard.bytes > capacity && shard.order.size() > 1) {
+		shard.bytes -= shard.order.back().second->size() * sizeof(float);
+		shard.tiles.erase(shard.order.back().first);
+		shard.order.pop_back();
+	}
+}
+
+static inline int shard_of(uint64_t key)
+{
+	return (int)((key * 0x9E3779B97F4A7C15ull) >> 60);
+}
+
+TileCache::Tile TileCache::find(uint64_t key)
+{
+	Shard & shard = shards[shard_of(key)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.tiles.find(key);
+	if (it == shard.tiles.end()) {
+		return nullptr;
+	}
+	shard.order.splice(shard.order.begin(), shard.order, it->second);
+	return it->second->second;
+}
+
+TileCache::Tile TileCache::insert(uint64_t key, std::vector<float> && texels)
+{
+	Shard & shard = shards[shard_of(key)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.tiles.find(key);
+	if (it != shard.tiles.end()) {
+		shard.order.splice(shard.order.begin(), shard.order, it->second);
+		return it->second->second;
+	}
+
+	Tile tile = std::make_shared<const std::vector<float>>(std::move(texels));
+	shard.order.push_front(std::make_pair(key, tile));
+	shard.tiles[key] = shard.order.begin();
+	shard.bytes += tile->size() * sizeof(float);
+	evict(shard);
+	return tile;
+}
+
+ImageChannel::ImageChannel(std::shared_ptr<const ImageTexture> texture, Vec3 origin, Vec3 u_axis, Vec3 v_axis)
+	: texture(texture), origin(origin)
+{
+	double u_length = u_axis.length(), v_length = v_axis.length();
+	this->u_axis = u_axis / (u_length * u_length);
+	this->v_axis = v_axis / (v_length * v_length);
+	this->texels_per_unit = std::max(texture->width / u_length, texture->height / v_length);
+}
+
+Vec3 ImageChannel::operator() (Vec3 p, Vec3 n) const
+{
+	Vec3 d = p - origin;
+	return texture->filtered(d.dot(u_axis), d.dot(v_axis), texture_footprint() * texels_per_unit);
+}
+
+double ImageChannel::operator() (Vec3 p) const
+{
+	Vec3 c = (*this)(p, Vec3(0.0, 0.0, 0.0));
+	return 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b;
+}
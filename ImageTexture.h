@@ -0,0 +1,133 @@
+#pragma once
+
+#ifndef _IMAGE_TEXTURE_H_
+#define _IMAGE_TEXTURE_H_
+
+#include "Vec3.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+class Image;
+
+// Image texture in a tiled, mipmapped file (.rtt, made by --make-texture) that is mapped into
+// memory instead of read. Texels are RGBE like Radiance HDR, stored in square tiles level after
+// level, so a lookup only touches the pages of the tiles it needs. Decoded tiles live in the
+// process wide TileCache, which bounds memory however many textures a scene uses.
+
+class ImageTexture {
+
+public:
+
+	ImageTexture();
+	~ImageTexture();
+
+	bool open(const std::string & path);
+
+	// Writes the mip chain of the image, every level halves the one before with a box filter
+	static bool convert(const Image & image, const std::string & path, int tile_size = 64);
+
+	int width;
+	int height;
+	int levels;
+
+	// Bilinear lookup in one level, (0, 0) is the top left corner of the image and it repeats
+	Vec3 bilinear(int level, double u, double v) const;
+	// Trilinear lookup between the levels a footprint of that many level 0 texels falls between
+	Vec3 filtered(double u, double v, double footprint) const;
+
+private:
+
+	ImageTexture(const ImageTexture &) = delete;
+	ImageTexture & operator = (const ImageTexture &) = delete;
+
+	struct Level {
+		int32_t width;
+		int32_t height;
+		int32_t tiles_x;
+		int32_t tiles_y;
+		int64_t offset; // of the first tile from the start of the file
+	};
+
+	Vec3 texel(int level, int x, int y) const;
+
+	const unsigned char * data;
+	size_t size;
+	int tile_size;
+	const Level * level_table;
+	uint32_t id; // part of the tile cache keys
+
+#ifdef _WIN32
+	void * file_handle;
+	void * mapping_handle;
+#endif
+
+};
+
+// Least recently used decoded tiles of all image textures, split into shards by key so
+// threads rarely wait on each other. A tile a thread still holds stays valid after eviction.
+class TileCache {
+
+public:
+
+	typedef std::shared_ptr<const std::vector<float>> Tile;
+
+	static TileCache & shared();
+
+	// Safe while other threads look tiles up, a lower capacity evicts the tiles over it right away
+	void set_capacity(size_t bytes);
+
+	// Null if the tile isn't cached
+	Tile find(uint64_t key);
+	// Returns the tile already cached under the key if another thread was first
+	Tile insert(uint64_t key, std::vector<float> && texels);
+
+	static const int SHARDS = 16;
+
+private:
+
+	TileCache();
+
+	struct Shard {
+		std::mutex mutex;
+		std::list<std::pair<uint64_t, Tile>> order; // most recently used first
+		std::unordered_map<uint64_t, std::list<std::pair<uint64_t, Tile>>::iterator> tiles;
+		size_t bytes;
+	};
+
+	Shard shards[SHARDS];
+	std::atomic<size_t> shard_capacity;
+
+	// Drops least recently used tiles of a locked shard until it fits
+	void evict(Shard & shard);
+
+};
+
+// Material channel looking the texture up at the hit projected onto a plane. The axes span one
+// repeat of the image (their lengths are its world size), u goes right and v down the image.
+// Called as a bump map it gives the luminance.
+class ImageChannel {
+
+public:
+
+	ImageChannel(std::shared_ptr<const ImageTexture> texture, Vec3 origin, Vec3 u_axis, Vec3 v_axis);
+
+	Vec3 operator() (Vec3 p, Vec3 n) const;
+	double operator() (Vec3 p) const;
+
+private:
+
+	std::shared_ptr<const ImageTexture> texture;
+	Vec3 origin;
+	Vec3 u_axis; // divided by its squared length, so a dot product gives u
+	Vec3 v_axis;
+	double texels_per_unit; // level 0 texels per world unit, the denser axis
+
+};
+
+#endif // _IMAGE_TEXTURE_H_
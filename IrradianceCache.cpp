@@ -0,0 +1,115 @@
+#include "IrradianceCache.h"
+#include "Configurer.h"
+#include <math.h>
+#include <algorithm>
+
+IrradianceCache::IrradianceCache(const Configurer & config)
+{
+	this->ACCURACY = config.irradiance_accuracy;
+	this->MIN_SPACING = config.irradiance_min_spacing;
+	this->MAX_SPACING = config.irradiance_max_spacing;
+	// Influence of any record fits in a cell, so it overlaps at most 8 of them
+	this->CELL_SIZE = ACCURACY * MAX_SPACING;
+}
+
+long long IrradianceCache::cell_key(int x, int y, int z) const
+{
+	return ((long long)(x & 0x1FFFFF) << 42) | ((long long)(y & 0x1FFFFF) << 21) | (long long)(z & 0x1FFFFF);
+}
+
+void IrradianceCache::cell_coords(Vec3 position, int & x, int & y, int & z) const
+{
+	x = (int)floor(position.x / CELL_SIZE);
+	y = (int)floor(position.y / CELL_SIZE);
+	z = (int)floor(position.z / CELL_SIZE);
+}
+
+bool IrradianceCache::lookup(Vec3 position, Vec3 normal, int bounce, Vec3 & irradiance, BodyMask & touched) const
+{
+	int x, y, z;
+	cell_coords(position, x, y, z);
+	long long key = cell_key(x, y, z);
+
+	const Cell * cell;
+	{
+		std::lock_guard<std::mutex> lock(cells_mutex);
+		auto it = cells.find(key);
+		if (it == cells.end()) return false;
+		cell = &it->second;
+	}
+
+	Vec3 sum = Vec3(0.0, 0.0, 0.0);
+	double weight_sum = 0.0;
+	BodyMask mask = 0;
+	{
+		std::lock_guard<std::mutex> lock(cell_locks[(unsigned long long)key % LOCKS_COUNT]);
+		for (size_t i = 0; i < cell->records.size(); ++i) {
+			const Record & record = cell->records[i];
+			// A record after a mirror has fewer bounces in it, it is darker than one of a primary hit
+			if (record.bounce != bounce) continue;
+			Vec3 offset = position - record.position;
+			// Record lies in front of the point, it may see occluders the point doesn't
+			if (offset.dot(normal + record.normal) < -0.1 * record.radius) continue;
+
+			// Ward's weight, error grows with distance relative to the record radius and with the normal change
+			double error = offset.length() / record.radius + sqrt(std::max(0.0, 1.0 - normal.dot(record.normal)));
+			if (error >= ACCURACY) continue;
+			double weight = (error > 1e-9) ? 1.0 / error : 1e9;
+
+			// First order extrapolation with the record gradients
+			Vec3 value = record.irradiance + Vec3(record.gradient_r.dot(offset), record.gradient_g.dot(offset), record.gradient_b.dot(offset));
+			value = Vec3(std::max(value.r, 0.0), std::max(value.g, 0.0), std::max(value.b, 0.0));
+
+			sum = sum + value * weight;
+			weight_sum += weight;
+			mask |= record.touched;
+		}
+	}
+
+	if (weight_sum == 0.0) return false;
+	irradiance = sum / weight_sum;
+	touched = mask;
+	return true;
+}
+
+void IrradianceCache::insert(Record record)
+{
+	record.radius = std::min(std::max(record.radius, MIN_SPACING), MAX_SPACING);
+	double reach = ACCURACY * record.radius;
+
+	int x0, y0, z0, x1, y1, z1;
+	cell_coords(record.position - Vec3(reach, reach, reach), x0, y0, z0);
+	cell_coords(record.position + Vec3(reach, reach, reach), x1, y1, z1);
+
+	for (int x = x0; x <= x1; ++x) {
+		for (int y = y0; y <= y1; ++y) {
+			for (int z = z0; z <= z1; ++z) {
+				long long key = cell_key(x, y, z);
+				Cell * cell;
+				{
+					std::lock_guard<std::mutex> lock(cells_mutex);
+					// Elements of unordered_map stay in place when it grows
+					cell = &cells[key];
+				}
+				std::lock_guard<std::mutex> lock(cell_locks[(unsigned long long)key % LOCKS_COUNT]);
+				cell->records.push_back(record);
+			}
+		}
+	}
+}
+
+void IrradianceCache::clear()
+{
+	std::lock_guard<std::mutex> lock(cells_mutex);
+	cells.clear();
+}
+
+size_t IrradianceCache::size() const
+{
+	std::lock_guard<std::mutex> lock(cells_mutex);
+	size_t count = 0;
+	for (auto it = cells.begin(); it != cells.end(); ++it) {
+		count += it->second.records.size();
+	}
+	return count;
+}
\ No newline at end of file
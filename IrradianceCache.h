@@ -0,0 +1,67 @@
+#pragma once
+
+#ifndef _IRRADIANCECACHE_H_
+#define _IRRADIANCECACHE_H_
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Vec3.h"
+#include "Body.h"
+
+class Configurer;
+
+// Sparse records of diffuse interreflection, shading points near a record interpolate from it
+// instead of sampling the hemisphere again (Ward's irradiance caching). Records live in a hashed
+// grid, cells are locked separately so threads can look up and insert concurrently.
+
+class IrradianceCache {
+
+public:
+
+	struct Record {
+		Vec3 position;
+		Vec3 normal;
+		Vec3 irradiance;
+		// Change of irradiance channels when moving the record position
+		Vec3 gradient_r, gradient_g, gradient_b;
+		double radius; // harmonic mean distance to surfaces the record rays hit
+		BodyMask touched; // bodies the record rays touched
+		int bounce; // of the ray that hit the point, its rays had MAX_BOUNCE minus this left
+	};
+
+	IrradianceCache(const Configurer & config);
+
+	// Weighted interpolation of records valid at the point, false if there are none. Only records
+	// made at the same bounce count, they are the ones whose rays had the same depth left.
+	bool lookup(Vec3 position, Vec3 normal, int bounce, Vec3 & irradiance, BodyMask & touched) const;
+	void insert(Record record);
+	void clear();
+	// Stored records, copies in neighbouring cells included
+	size_t size() const;
+
+private:
+
+	static const int LOCKS_COUNT = 64;
+
+	struct Cell {
+		std::vector<Record> records;
+	};
+
+	std::unordered_map<long long, Cell> cells;
+	// Guards cells map structure
+	mutable std::mutex cells_mutex;
+	// Guard records of cells with hash modulo LOCKS_COUNT
+	mutable std::mutex cell_locks[LOCKS_COUNT];
+
+	long long cell_key(int x, int y, int z) const;
+	void cell_coords(Vec3 position, int & x, int & y, int & z) const;
+
+	double ACCURACY;
+	double MIN_SPACING;
+	double MAX_SPACING;
+	double CELL_SIZE;
+
+};
+
+#endif // _IRRADIANCECACHE_H_
\ No newline at end of file
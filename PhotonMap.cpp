@@ -0,0 +1,110 @@
+#include "PhotonMap.h"
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <thread>
+#include <algorithm>
+
+PhotonMap::PhotonMap(double radius)
+{
+	this->RADIUS = radius;
+	this->BUCKETS_COUNT = 1;
+}
+
+void PhotonMap::cell_coords(Vec3 position, int & x, int & y, int & z) const
+{
+	x = (int)floor(position.x / RADIUS);
+	y = (int)floor(position.y / RADIUS);
+	z = (int)floor(position.z / RADIUS);
+}
+
+size_t PhotonMap::bucket(int x, int y, int z) const
+{
+	unsigned long long h = (unsigned long long)(unsigned)x * 73856093ull ^ (unsigned long long)(unsigned)y * 19349663ull ^ (unsigned long long)(unsigned)z * 83492791ull;
+	return (size_t)(h % BUCKETS_COUNT);
+}
+
+void PhotonMap::build(std::vector<std::vector<Photon>> & lists)
+{
+	size_t total = 0;
+	for (size_t t = 0; t < lists.size(); ++t) total += lists[t].size();
+	BUCKETS_COUNT = total * 2 + 1;
+
+	// Counting sort by bucket: every thread counts its own photons, offsets are prefix sums
+	// over buckets and threads, then every thread scatters its photons to its own slots
+	std::vector<std::vector<size_t>> counts(lists.size(), std::vector<size_t>(BUCKETS_COUNT, 0));
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < lists.size(); ++t) {
+		threads.push_back(std::thread([this, &lists, &counts, t]() {
+			for (size_t i = 0; i < lists[t].size(); ++i) {
+				int x, y, z;
+				cell_coords(lists[t][i].position, x, y, z);
+				counts[t][bucket(x, y, z)]++;
+			}
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+	threads.clear();
+
+	bucket_start.assign(BUCKETS_COUNT + 1, 0);
+	size_t offset = 0;
+	for (size_t b = 0; b < BUCKETS_COUNT; ++b) {
+		bucket_start[b] = offset;
+		for (size_t t = 0; t < lists.size(); ++t) {
+			size_t count = counts[t][b];
+			counts[t][b] = offset;
+			offset += count;
+		}
+	}
+	bucket_start[BUCKETS_COUNT] = offset;
+
+	photons.resize(total);
+	for (size_t t = 0; t < lists.size(); ++t) {
+		threads.push_back(std::thread([this, &lists, &counts, t]() {
+			for (size_t i = 0; i < lists[t].size(); ++i) {
+				int x, y, z;
+				cell_coords(lists[t][i].position, x, y, z);
+				photons[counts[t][bucket(x, y, z)]++] = lists[t][i];
+			}
+			std::vector<Photon>().swap(lists[t]);
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+}
+
+Vec3 PhotonMap::irradiance(Vec3 position, Vec3 normal, bool per_solid_angle, BodyMask * touched) const
+{
+	Vec3 sum = Vec3(0.0, 0.0, 0.0);
+	if (photons.empty()) return sum;
+
+	int cx, cy, cz;
+	cell_coords(position, cx, cy, cz);
+	double radius2 = RADIUS * RADIUS;
+
+	for (int x = cx - 1; x <= cx + 1; ++x) {
+		for (int y = cy - 1; y <= cy + 1; ++y) {
+			for (int z = cz - 1; z <= cz + 1; ++z) {
+				size_t b = bucket(x, y, z);
+				for (size_t i = bucket_start[b]; i < bucket_start[b + 1]; ++i) {
+					const Photon & photon = photons[i];
+					// Other cells may share the bucket, skip them so no photon is counted twice
+					int px, py, pz;
+					cell_coords(photon.position, px, py, pz);
+					if (px != x || py != y || pz != z) continue;
+
+					Vec3 offset = photon.position - position;
+					if (offset.dot(offset) > radius2) continue;
+					// Only photons arriving from the front, lying close to the tangent plane,
+					// so light doesn't leak through thin walls and around corners
+					double cosine = -photon.direction.dot(normal);
+					if (cosine <= 0.0) continue;
+					if (fabs(offset.dot(normal)) > 0.1 * RADIUS) continue;
+
+					sum = sum + (per_solid_angle ? photon.power / std::max(cosine, 0.1) : photon.power);
+					if (touched) *touched |= photon.touched;
+				}
+			}
+		}
+	}
+
+	return sum / (M_PI * radius2);
+}
\ No newline at end of file
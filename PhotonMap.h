@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef _PHOTONMAP_H_
+#define _PHOTONMAP_H_
+
+#include <vector>
+#include "Vec3.h"
+#include "Body.h"
+
+// Photons that reached diffuse surfaces, stored in a hashed grid of cells as big as the gather
+// radius. Photons are sorted by bucket into one array, so a lookup reads 27 contiguous ranges.
+
+class PhotonMap {
+
+public:
+
+	struct Photon {
+		Vec3 position;
+		Vec3 direction; // of travel, towards the surface
+		Vec3 power;
+		BodyMask touched; // bodies on the photon path
+	};
+
+	PhotonMap(double radius);
+
+	// Takes photons traced by each thread, buckets are filled by the same threads
+	void build(std::vector<std::vector<Photon>> & lists);
+	// Photon power per area arriving at the front side of the surface within the radius. With
+	// per_solid_angle every photon is divided by its incidence cosine, for estimators that integrate
+	// light over the solid angle without the cosine term (Tracer::diffuse_light()).
+	Vec3 irradiance(Vec3 position, Vec3 normal, bool per_solid_angle, BodyMask * touched = nullptr) const;
+	size_t size() const { return photons.size(); }
+
+private:
+
+	std::vector<Photon> photons;
+	// Photons of bucket b are photons[bucket_start[b]] to photons[bucket_start[b + 1] - 1]
+	std::vector<size_t> bucket_start;
+
+	void cell_coords(Vec3 position, int & x, int & y, int & z) const;
+	size_t bucket(int x, int y, int z) const;
+
+	double RADIUS;
+	size_t BUCKETS_COUNT;
+
+};
+
+#endif // _PHOTONMAP_H_
\ No newline at end of file
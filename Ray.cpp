@@ -1,6 +1,6 @@
 #include "Ray.h"
 
-Ray::Ray(Vec3 origin, Vec3 direction, int bounce)
-	:origin(origin), direction(direction), bounce(bounce)
+Ray::Ray(Vec3 origin, Vec3 direction, int bounce, Path path)
+	:origin(origin), direction(direction), bounce(bounce), path(path), cone_width(0.0), cone_spread(0.0)
 {
 }
@@ -9,11 +9,27 @@ class Ray {
 
 public:
 
-	Ray(Vec3 origin, Vec3 direction, int bounce = 0);
+	// Surfaces the ray came through, light reaching a CAUSTIC ray is also carried by photons
+	enum class Path {
+		PRIMARY, // camera ray, possibly after mirrors and glass
+		DIFFUSE, // left a diffuse surface, possibly after mirrors and glass
+		CAUSTIC, // as DIFFUSE, but the last surface was a caustic caster (refractive body)
+	};
+
+	Ray(Vec3 origin, Vec3 direction, int bounce = 0, Path path = Path::PRIMARY);
 	
 	int bounce;
+	Path path;
 	Vec3 origin;
 	Vec3 direction;
+	// Ray cone for texture level of detail, width at the origin and growth per unit of distance.
+	// Zero for rays that don't stand for an area (shadow rays, photons), textures keep full detail.
+	double cone_width;
+	double cone_spread;
+
+	Ray & with_cone(double width, double spread) { cone_width = width; cone_spread = spread; return *this; }
+	// Cone width after travelling the distance
+	double footprint(double distance) const { return cone_width + cone_spread * distance; }
 
 private:
 
@@ -1,45 +1,153 @@
 #include "Render.h"
 #include "Body.h"
+#include "Statistics.h"
+#include "Wavefront.h"
+#include "ImageTexture.h"
+#include <math.h>
 
 Render::Render(const Configurer & config)
-	:tracer(config)
+	:tracer(config), camera(config)
+{
+	setup(config);
+}
+
+Render::Render(const Render & scene, const Configurer & config, const std::vector<int> & moved_bodies, int threads_count)
+	:tracer(scene.tracer), camera(config)
+{
+	tracer.replace_bodies(moved_bodies, config, threads_count);
+	setup(config);
+}
+
+void Render::setup(const Configurer & config)
 {
 	this->SCREEN_WIDTH = config.window_width;
 	this->SCREEN_HEIGHT = config.window_height;
-	this->CAM_POSITION = config.cam_position;
-	this->CAM_FORWARD = config.cam_forward;
-	this->CAM_UPPY = config.cam_uppy;
-	this->CAM_UP = config.cam_up;
-	this->CAM_RIGHT = config.cam_right;
-	this->CAM_WIDTH = config.cam_width;
-	this->CAM_HEIGHT = config.cam_height;
-	this->CAM_DEPTH = config.cam_depth;
-	
-	this->EXPOSURE = config.exposure;
 	this->AA_FACTOR = config.aa_factor;
+	this->TEXTURE_LOD = config.texture_lod;
+	TileCache::shared().set_capacity((size_t)config.texture_cache_mb << 20);
+
+	if (config.wavefront) {
+		wavefront_config.reset(new Configurer(config));
+	}
+	if (config.gbuffer_cache) {
+		primary_hits.reset(new GBuffer(SCREEN_WIDTH, SCREEN_HEIGHT, AA_FACTOR * AA_FACTOR));
+	}
 }
 
 Vec3 Render::pixel_color(int x, int y) const
+{
+	return pixel_color(x, y, camera, AA_FACTOR);
+}
+
+Vec3 Render::pixel_color(int x, int y, const Camera & camera, int aa_factor, BodyMask * touched) const
 {
 	double dx = (double)x / SCREEN_WIDTH;
 	double dy = (double)y / SCREEN_HEIGHT;
 
-	Vec3 col = Vec3(0.0, 0.0, 0.0);
-	for (int ax = 0; ax < AA_FACTOR; ++ax) {
-		for (int ay = 0; ay < AA_FACTOR; ++ay) {
-			Vec3 direction = CAM_FORWARD * CAM_DEPTH + 
-				CAM_RIGHT * CAM_WIDTH  * ( (dx + (double)ax / (SCREEN_WIDTH * AA_FACTOR) ) - 0.5) + 
-				CAM_UP    * CAM_HEIGHT * (0.5 - (dy + (double)ay / (SCREEN_WIDTH * AA_FACTOR)));
-			Ray ray = Ray(CAM_POSITION, direction.normalized());
-	
-			Vec3 col_part = tracer.trace(ray);
+	// Single sample previews share their sample with the first one of the full pass. With texture LOD
+	// their cone is AA_FACTOR times wider and the channels they evaluate too blurred for the full pass.
+	bool cached = primary_hits && (aa_factor == AA_FACTOR || (aa_factor == 1 && !TEXTURE_LOD));
+	int px = y * SCREEN_WIDTH + x;
+
+	std::vector<Ray> rays;
+	std::vector<int> samples;
+	std::vector<SurfaceHit> surfaces(aa_factor * aa_factor);
+	// Samples the cache doesn't have are intersected together, so texture programs run on all of them at once
+	std::vector<Ray> missed_rays;
+	std::vector<int> missed;
+	for (int ax = 0; ax < aa_factor; ++ax) {
+		for (int ay = 0; ay < aa_factor; ++ay) {
+			Vec3 direction = camera.direction(
+				dx + (double)ax / (SCREEN_WIDTH * aa_factor), 
+				dy + (double)ay / (SCREEN_WIDTH * aa_factor));
+			Ray ray = Ray(camera.position, direction.normalized());
+			if (TEXTURE_LOD) ray.with_cone(0.0, camera.width / (SCREEN_WIDTH * aa_factor * camera.depth));
+			rays.push_back(ray);
+			samples.push_back(ax * AA_FACTOR + ay);
 
-			col_part = Vec3(1.0, 1.0, 1.0) - (col_part * EXPOSURE).exp();
-			
-			col = col + col_part;
+			if (!cached || !primary_hits->lookup(px, samples.back(), surfaces[rays.size() - 1])) {
+				STAT_RAY(CAMERA);
+				missed_rays.push_back(ray);
+				missed.push_back((int)rays.size() - 1);
+			}
 		}
 	}
-	col = col / (AA_FACTOR * AA_FACTOR);
+
+	std::vector<SurfaceHit> missed_surfaces;
+	tracer.intersect(missed_rays, missed_surfaces);
+	for (size_t k = 0; k < missed.size(); ++k) {
+		surfaces[missed[k]] = missed_surfaces[k];
+		if (cached) primary_hits->store(px, samples[missed[k]], missed_surfaces[k]);
+	}
+
+	Vec3 col = Vec3(0.0, 0.0, 0.0);
+	for (size_t k = 0; k < rays.size(); ++k) {
+		col = col + tracer.shade(rays[k], surfaces[k], touched);
+	}
+	col = col / (aa_factor * aa_factor);
 	
 	return col;
-}
\ No newline at end of file
+}
+
+void Render::render_tile(Image & image, int x0, int y0, int width, int height) const
+{
+	if (wavefront_config) {
+		// Ray queues are per call, tiles rendered by different threads share nothing
+		Wavefront wavefront(tracer, *wavefront_config);
+		wavefront.render(camera, image, x0, y0, width, height);
+		return;
+	}
+	for (int y = y0; y < y0 + height; ++y) {
+		for (int x = x0; x < x0 + width; ++x) {
+			image.at(x, y) = pixel_color(x, y);
+		}
+	}
+}
+
+bool Render::pixel_features(int x, int y, const Camera & camera, Vec3 & normal, Vec3 & albedo, double & depth) const
+{
+	Vec3 direction = camera.direction(((double)x + 0.5) / SCREEN_WIDTH, ((double)y + 0.5) / SCREEN_HEIGHT);
+	SurfaceHit surface = tracer.intersect(Ray(camera.position, direction.normalized()));
+	if (surface.body < 0) {
+		normal = albedo = Vec3(0.0, 0.0, 0.0);
+		depth = 0.0;
+		return false;
+	}
+	normal = surface.normal;
+	albedo = surface.simple_diffuse + surface.diffuse + surface.pure_reflective + surface.refractive + surface.light_source;
+	depth = surface.distance;
+	return true;
+}
+
+int Render::pick_body(int x, int y, const Camera & camera) const
+{
+	Vec3 direction = camera.direction(((double)x + 0.5) / SCREEN_WIDTH, ((double)y + 0.5) / SCREEN_HEIGHT);
+	return tracer.nearest_body(Ray(camera.position, direction.normalized()));
+}
+
+int Render::pixel_surface(int x, int y, const Camera & camera, Vec3 & position, Vec3 & normal) const
+{
+	Vec3 direction = camera.direction(((double)x + 0.5) / SCREEN_WIDTH, ((double)y + 0.5) / SCREEN_HEIGHT);
+	return tracer.nearest_body(Ray(camera.position, direction.normalized()), &position, &normal);
+}
+
+bool Render::body_screen_bounds(int body_number, const Camera & camera, int & x0, int & y0, int & x1, int & y1) const
+{
+	const Shape & shape = *tracer.get_body(body_number).shape;
+	if (!shape.bounded()) return false;
+
+	Vec3 rel = shape.center - camera.position;
+	double z = rel.dot(camera.forward);
+	// Bounding sphere reaches the camera plane, projection is unbounded
+	if (z <= shape.radius) return false;
+
+	// Perspective stretches the sphere towards screen edges, radius is enlarged to stay conservative
+	double sx = 0.5 + rel.dot(camera.right) / z * camera.depth / camera.width;
+	double sy = 0.5 - rel.dot(camera.up) / z * camera.depth / camera.height;
+	double sr = 1.5 * shape.radius / (z - shape.radius) * camera.depth;
+	x0 = (int)floor((sx - sr / camera.width) * SCREEN_WIDTH) - 1;
+	x1 = (int)ceil((sx + sr / camera.width) * SCREEN_WIDTH) + 1;
+	y0 = (int)floor((sy - sr / camera.height) * SCREEN_HEIGHT) - 1;
+	y1 = (int)ceil((sy + sr / camera.height) * SCREEN_HEIGHT) + 1;
+	return true;
+}
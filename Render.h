@@ -5,33 +5,64 @@
 
 #include "Configurer.h"
 #include "Vec3.h"
+#include "Camera.h"
 #include "Tracer.h"
+#include "GBuffer.h"
+#include "Image.h"
+#include <memory>
 
 class Render {
 
 public:
 
 	Render(const Configurer & config);
+	// Frame of an animation: shares what the scene has built (environment, caches) and takes the
+	// camera and the moved bodies from the frame's config, see Tracer::replace_bodies()
+	Render(const Render & scene, const Configurer & config, const std::vector<int> & moved_bodies, int threads_count);
+	// Linear radiance averaged over the pixel's samples, Tonemap makes display colors of it
 	Vec3 pixel_color(int x, int y) const;
+	Vec3 pixel_color(int x, int y, const Camera & camera, int aa_factor, BodyMask * touched = nullptr) const;
+	// Colors of a screen rectangle, per pixel or through the wavefront pipeline if configured
+	void render_tile(Image & image, int x0, int y0, int width, int height) const;
+
+	// Primary hit cache, nullptr when disabled. Only valid for one camera, so it has to be
+	// invalidated on camera moves and scene edits while no thread renders.
+	GBuffer * gbuffer() const { return primary_hits.get(); }
+
+	// Denoiser guides of the surface seen through the pixel center, false and zeros if none
+	bool pixel_features(int x, int y, const Camera & camera, Vec3 & normal, Vec3 & albedo, double & depth) const;
+
+	// Body seen through the pixel center, -1 if none
+	int pick_body(int x, int y, const Camera & camera) const;
+	// Same with the position and geometric normal of the hit
+	int pixel_surface(int x, int y, const Camera & camera, Vec3 & position, Vec3 & normal) const;
+	// Screen rectangle (inclusive) the body may cover directly, false if it may cover everything
+	bool body_screen_bounds(int body_number, const Camera & camera, int & x0, int & y0, int & x1, int & y1) const;
+
+	// Scene edits, must not be called while any thread renders
+	const Body & get_body(int body_number) const { return tracer.get_body(body_number); }
+	void set_body(int body_number, const Body & body) { tracer.set_body(body_number, body); }
+	int bodies_count() const { return tracer.bodies_count(); }
+
+	const Camera & default_camera() const { return camera; }
 
 private:
 
 	Tracer tracer;
+	Camera camera;
+	std::unique_ptr<GBuffer> primary_hits;
 
 	int SCREEN_WIDTH;
 	int SCREEN_HEIGHT;
-	Vec3 CAM_POSITION;
-	Vec3 CAM_FORWARD;
-	Vec3 CAM_UPPY;
-	Vec3 CAM_UP;
-	Vec3 CAM_RIGHT;
-	double CAM_WIDTH;
-	double CAM_HEIGHT;
-	double CAM_DEPTH;
-
-	double EXPOSURE;
+
 	int AA_FACTOR;
+	bool TEXTURE_LOD;
+
+	// Kept to set up wavefront pipelines, nullptr disables them
+	std::unique_ptr<Configurer> wavefront_config;
+
+	void setup(const Configurer & config);
 
 };
 
-#endif // _RENDER_H_
\ No newline at end of file
+#endif // _RENDER_H_
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "Sequence.h"
+#include "ThreadPool.h"
+#include <stdio.h>
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+SequenceRenderer::SequenceRenderer(const Configurer & config)
+	: config(config), denoise_config(config)
+{
+	denoise_config.threads_count = 1;
+	this->WIDTH = config.window_width;
+	this->HEIGHT = config.window_height;
+	this->TILE_SIZE = config.tile_size;
+	this->TILES_X = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+	this->TILES_PER_FRAME = TILES_X * ((HEIGHT + TILE_SIZE - 1) / TILE_SIZE);
+	this->THREADS_COUNT = config.threads_count;
+
+	for (size_t i = 0; i < config.body_tracks.size(); ++i) {
+		moved_bodies.push_back(config.body_tracks[i].body_number);
+	}
+}
+
+bool SequenceRenderer::render(int first, int last)
+{
+	if (last < first) return true;
+
+	frames.clear();
+	frames.resize(last - first + 1);
+	first_frame = first;
+	tasks_count = (int)frames.size() * TILES_PER_FRAME;
+	saved_count = 0;
+	failed = false;
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Environment, caches and caustics are shared by the frames unless bodies move
+	scene.reset(new Render(config));
+
+	// Each NUMA node gets a contiguous run of frames, so a frame's scene is built and read on one node
+	ThreadPool pool(THREADS_COUNT);
+	pool.run(tasks_count, [this](int task, int) { render_task(task); });
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	scene.reset();
+
+	std::cout << "Rendered " << saved_count << " frames in " << seconds << " s, "
+		<< saved_count / seconds << " frames per second" << std::endl;
+
+	return !failed;
+}
+
+void SequenceRenderer::render_task(int task)
+{
+	Frame * frame = &frames[task / TILES_PER_FRAME];
+	int frame_number = first_frame + task / TILES_PER_FRAME;
+	int tile = task % TILES_PER_FRAME;
+	bool build = false;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		// First thread to reach a frame sets it up, the others wait for it
+		if (!frame->started) {
+			frame->started = true;
+			build = true;
+		}
+		else {
+			frame_ready.wait(lock, [frame] { return frame->render != nullptr; });
+		}
+	}
+
+	if (build) {
+		// Only the camera and moved bodies are new, caustics of moved bodies use this thread only
+		std::unique_ptr<Render> render(new Render(*scene, config.at_time(frame_number / config.frame_rate), moved_bodies, 1));
+		Image image(WIDTH, HEIGHT);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			frame->render = std::move(render);
+			frame->image = std::move(image);
+			frame->tiles_left = TILES_PER_FRAME;
+		}
+		frame_ready.notify_all();
+	}
+
+	render_tile(*frame->render, frame->image, tile);
+
+	Image image;
+	std::unique_ptr<Render> render;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--frame->tiles_left > 0) return;
+		// Last tile of the frame, take it out and finish it outside of the lock
+		image = std::move(frame->image);
+		render = std::move(frame->render);
+	}
+
+	Tonemap(config).apply(image);
+	if (denoise_config.denoise_iterations > 0) {
+		// Other threads are busy with the following frames, filter on this one only
+		Denoiser denoiser(denoise_config);
+		denoiser.gather(*render, render->default_camera());
+		denoiser.apply(image);
+	}
+	render.reset();
+
+	char path[1024];
+	snprintf(path, sizeof(path), config.sequence_path.c_str(), frame_number);
+	bool saved = image.save_ppm(path);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (saved) {
+		++saved_count;
+		std::cout << "Saved " << path << std::endl;
+	}
+	else {
+		failed = true;
+	}
+}
+
+void SequenceRenderer::render_tile(const Render & render, Image & image, int tile) const
+{
+	int x0 = (tile % TILES_X) * TILE_SIZE;
+	int y0 = (tile / TILES_X) * TILE_SIZE;
+	render.render_tile(image, x0, y0, std::min(TILE_SIZE, WIDTH - x0), std::min(TILE_SIZE, HEIGHT - y0));
+}
\ No newline at end of file
@@ -0,0 +1,68 @@
+#pragma once
+
+#ifndef _SEQUENCE_H_
+#define _SEQUENCE_H_
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include "Configurer.h"
+#include "Render.h"
+#include "Image.h"
+#include "Denoiser.h"
+#include "Tonemap.h"
+
+// Renders the animation to numbered image files. Threads take tiles in frame order, so a thread
+// that is out of work on one frame starts the next one instead of waiting for the slowest tile.
+// The scene is built once. Each frame in flight gets a copy with the camera and animated bodies
+// at the frame time, made by the first thread to reach it outside of the lock, so on NUMA machines
+// it lives on the node rendering that frame. Other threads on the frame wait for it meanwhile.
+
+class SequenceRenderer {
+
+public:
+
+	SequenceRenderer(const Configurer & config);
+
+	// Renders frames first to last inclusive, false if any frame couldn't be saved
+	bool render(int first, int last);
+
+private:
+
+	struct Frame {
+		std::unique_ptr<Render> render;
+		Image image;
+		int tiles_left;
+		bool started; // a thread is building the render
+
+		Frame() : tiles_left(0), started(false) {}
+	};
+
+	void render_task(int task);
+	void render_tile(const Render & render, Image & image, int tile) const;
+
+	const Configurer & config;
+	Configurer denoise_config;
+
+	std::unique_ptr<Render> scene;
+	std::vector<int> moved_bodies; // bodies with a translation track
+
+	std::mutex mutex;
+	std::condition_variable frame_ready;
+	std::vector<Frame> frames;
+	int first_frame;
+	int tasks_count;
+	int saved_count;
+	bool failed;
+
+	int WIDTH;
+	int HEIGHT;
+	int TILE_SIZE;
+	int TILES_X;
+	int TILES_PER_FRAME;
+	int THREADS_COUNT;
+
+};
+
+#endif // _SEQUENCE_H_
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include "Statistics.h"
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <iomanip>
+
+thread_local Statistics * Statistics::current = nullptr;
+
+// Blocks outlive their threads, so counters can be collected after workers exit
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<Statistics>> registry;
+
+Statistics::Statistics()
+	: casts(0), intersection_tests(0), csg_iterations(0), texture_evaluations(0)
+{
+	for (int i = 0; i < (int)RayKind::COUNT; ++i) rays[i] = 0;
+	for (int i = 0; i <= MAX_DEPTH; ++i) bounce_histogram[i] = 0;
+}
+
+void Statistics::merge(const Statistics & other)
+{
+	for (int i = 0; i < (int)RayKind::COUNT; ++i) rays[i] += other.rays[i];
+	casts += other.casts;
+	intersection_tests += other.intersection_tests;
+	csg_iterations += other.csg_iterations;
+	texture_evaluations += other.texture_evaluations;
+	for (int i = 0; i <= MAX_DEPTH; ++i) bounce_histogram[i] += other.bounce_histogram[i];
+}
+
+void Statistics::print(std::ostream & out) const
+{
+	static const char * names[] = { "camera", "shadow", "diffuse", "reflective", "refractive" };
+
+	unsigned long long total = 0;
+	for (int i = 0; i < (int)RayKind::COUNT; ++i) total += rays[i];
+
+	out << "Tracer statistics :" << std::endl;
+	for (int i = 0; i < (int)RayKind::COUNT; ++i) {
+		out << "  " << std::setw(12) << std::left << names[i] << " rays : " << rays[i] << std::endl;
+	}
+	out << "  total rays          : " << total << std::endl;
+	out << "  scene casts         : " << casts << std::endl;
+	out << "  intersection tests  : " << intersection_tests;
+	if (casts) out << " (" << (double)intersection_tests / casts << " per cast)";
+	out << std::endl;
+	out << "  csg iterations      : " << csg_iterations << std::endl;
+	out << "  texture evaluations : " << texture_evaluations << std::endl;
+	out << "  bounce depth histogram :" << std::endl;
+	for (int i = 0; i <= MAX_DEPTH; ++i) {
+		if (bounce_histogram[i]) {
+			out << "    " << std::setw(2) << std::right << i << (i == MAX_DEPTH ? "+" : " ") << " : " << bounce_histogram[i] << std::endl;
+		}
+	}
+}
+
+Statistics * Statistics::register_thread()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	registry.push_back(std::unique_ptr<Statistics>(new Statistics()));
+	return registry.back().get();
+}
+
+Statistics & Statistics::local()
+{
+	if (current == nullptr) current = register_thread();
+	return *current;
+}
+
+Statistics Statistics::collect()
+{
+	Statistics result;
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	for (size_t i = 0; i < registry.size(); ++i) {
+		result.merge(*registry[i]);
+	}
+	return result;
+}
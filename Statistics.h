@@ -0,0 +1,67 @@
+#pragma once
+
+#ifndef _STATISTICS_H_
+#define _STATISTICS_H_
+
+#include <ostream>
+
+// Tracer counters. Every thread increments its own block, blocks are only
+// merged once the render is done. Build with -DRAYTRACER_STATISTICS to enable,
+// otherwise the STAT_* macros expand to nothing.
+
+class Statistics {
+
+public:
+
+	enum class RayKind {
+		CAMERA,
+		SHADOW,
+		DIFFUSE,
+		REFLECTIVE,
+		REFRACTIVE,
+		COUNT
+	};
+
+	static const int MAX_DEPTH = 31;
+
+	unsigned long long rays[(int)RayKind::COUNT];
+	unsigned long long casts;
+	unsigned long long intersection_tests;
+	unsigned long long csg_iterations;
+	unsigned long long texture_evaluations;
+	unsigned long long bounce_histogram[MAX_DEPTH + 1];
+
+	Statistics();
+
+	void merge(const Statistics & other);
+	void print(std::ostream & out) const;
+
+	// Counters of the calling thread
+	static Statistics & local();
+	// Sum of all threads counters
+	static Statistics collect();
+
+private:
+
+	static thread_local Statistics * current;
+	static Statistics * register_thread();
+
+};
+
+#ifdef RAYTRACER_STATISTICS
+#define STAT_RAY(kind) (++Statistics::local().rays[(int)Statistics::RayKind::kind])
+#define STAT_CAST() (++Statistics::local().casts)
+#define STAT_INTERSECTION() (++Statistics::local().intersection_tests)
+#define STAT_CSG_ITERATION() (++Statistics::local().csg_iterations)
+#define STAT_TEXTURE(count) (Statistics::local().texture_evaluations += (count))
+#define STAT_BOUNCE(depth) (++Statistics::local().bounce_histogram[(depth) < Statistics::MAX_DEPTH ? (depth) : Statistics::MAX_DEPTH])
+#else
+#define STAT_RAY(kind) ((void)0)
+#define STAT_CAST() ((void)0)
+#define STAT_INTERSECTION() ((void)0)
+#define STAT_CSG_ITERATION() ((void)0)
+#define STAT_TEXTURE(count) ((void)0)
+#define STAT_BOUNCE(depth) ((void)0)
+#endif
+
+#endif // _STATISTICS_H_
\ No newline at end of file
@@ -0,0 +1,710 @@
+#include "TextureProgram.h"
+#include "Textures.h"
+#include <math.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TEXTURE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Expression tree of one source, turned into TextureProgram code by emit()
+class TextureCompiler {
+
+public:
+
+	TextureCompiler(const std::string & source) : source(source), pos(0) {}
+
+	bool compile(TextureProgram & program);
+
+private:
+
+	typedef TextureProgram::Op Op;
+
+	enum class Kind {
+		POINT,
+		NORMAL,
+		CONSTANT,
+		OPERATION,
+	};
+
+	struct Node {
+		Kind kind;
+		Op op;
+		Vec3 value;
+		std::vector<int> args;
+	};
+
+	struct Function {
+		const char * name;
+		Op op;
+		int arity;
+	};
+
+	static const Function functions[];
+
+	const std::string & source;
+	size_t pos;
+	std::string error;
+	std::vector<Node> nodes;
+	std::map<std::string, int> variables;
+
+	// Parser, returns node index or -1 with error set
+	int parse_program();
+	int parse_sum();
+	int parse_product();
+	int parse_unary();
+	int parse_postfix();
+	int parse_primary();
+	int operation(Op op, const std::vector<int> & args);
+	int constant(Vec3 value);
+
+	void skip_space();
+	bool accept(char c);
+	std::string identifier();
+	bool fail(const std::string & message);
+
+	// Register allocation
+	std::vector<int> uses;
+	std::vector<int> registers;
+	std::vector<int> free_registers;
+	std::map<std::pair<double, std::pair<double, double>>, int> constant_registers;
+	int next_register;
+
+	bool emit(int node, TextureProgram & program);
+	void release(int node);
+
+};
+
+const TextureCompiler::Function TextureCompiler::functions[] = {
+	{ "sin", Op::SIN, 1 },
+	{ "cos", Op::COS, 1 },
+	{ "abs", Op::ABS, 1 },
+	{ "sqrt", Op::SQRT, 1 },
+	{ "floor", Op::FLOOR, 1 },
+	{ "fract", Op::FRACT, 1 },
+	{ "exp", Op::EXP, 1 },
+	{ "pow", Op::POW, 2 },
+	{ "min", Op::MIN, 2 },
+	{ "max", Op::MAX, 2 },
+	{ "mix", Op::MIX, 3 },
+	{ "clamp", Op::CLAMP, 3 },
+	{ "vec", Op::VEC, 3 },
+	{ "dot", Op::DOT, 2 },
+	{ "length", Op::LENGTH, 1 },
+	{ "normalize", Op::NORMALIZE, 1 },
+	{ "cross", Op::CROSS, 2 },
+	// (p, origin, size, patch size), the same as the functions of Textures.h
+	{ "noise", Op::NOISE, 4 },
+	{ "smooth_noise", Op::SMOOTH_NOISE, 4 },
+	{ "turbulence", Op::TURBULENCE, 5 },
+	{ "vornoi", Op::VORNOI, 4 },
+	// (p, origin, cell), integer lattice hashing
+	{ "hash_noise", Op::HASH_NOISE, 3 },
+	{ "value_noise", Op::VALUE_NOISE, 3 },
+	{ "perlin", Op::PERLIN, 3 },
+	{ "fbm", Op::FBM, 4 },
+	{ "worley", Op::WORLEY, 3 },
+};
+
+bool TextureCompiler::compile(TextureProgram & program)
+{
+	int root = parse_program();
+	if (root == -1) {
+		std::cerr << "TextureProgram::compile() error : " << error << " at " << pos << " in \"" << source << "\"" << std::endl;
+		return false;
+	}
+
+	TextureProgram compiled;
+	compiled.constants.clear();
+	compiled.code.clear();
+
+	// Constants that something evaluated at run time reads get a register of their own
+	uses.assign(nodes.size(), 0);
+	std::vector<int> stack(1, root);
+	std::vector<bool> visited(nodes.size(), false);
+	while (!stack.empty()) {
+		int node = stack.back();
+		stack.pop_back();
+		if (visited[node]) continue;
+		visited[node] = true;
+		for (size_t i = 0; i < nodes[node].args.size(); ++i) {
+			int arg = nodes[node].args[i];
+			++uses[arg];
+			stack.push_back(arg);
+		}
+	}
+	registers.assign(nodes.size(), -1);
+	next_register = 2;
+	for (size_t node = 0; node < nodes.size(); ++node) {
+		if (!visited[node] || nodes[node].kind != Kind::CONSTANT) continue;
+		Vec3 v = nodes[node].value;
+		auto key = std::make_pair(v.x, std::make_pair(v.y, v.z));
+		auto found = constant_registers.find(key);
+		if (found == constant_registers.end()) {
+			found = constant_registers.insert(std::make_pair(key, next_register++)).first;
+			compiled.constants.push_back(v);
+		}
+		registers[node] = found->second;
+	}
+
+	if (!emit(root, compiled)) {
+		std::cerr << "TextureProgram::compile() error : " << error << " in \"" << source << "\"" << std::endl;
+		return false;
+	}
+	compiled.result = registers[root];
+	compiled.registers_count = next_register;
+	program = compiled;
+	return true;
+}
+
+// Registers are handed out in evaluation order and reused once all readers are emitted.
+// A destination never shares a register with its arguments, vector operations read them after writing.
+bool TextureCompiler::emit(int node, TextureProgram & program)
+{
+	if (registers[node] != -1) return true;
+	const Node & n = nodes[node];
+	if (n.kind == Kind::POINT || n.kind == Kind::NORMAL) {
+		registers[node] = (n.kind == Kind::POINT) ? 0 : 1;
+		return true;
+	}
+
+	TextureProgram::Instruction instruction = {};
+	instruction.op = n.op;
+	for (size_t i = 0; i < n.args.size(); ++i) {
+		if (!emit(n.args[i], program)) return false;
+		instruction.args[i] = (uint8_t)registers[n.args[i]];
+	}
+
+	int dst;
+	if (!free_registers.empty()) {
+		dst = free_registers.back();
+		free_registers.pop_back();
+	}
+	else {
+		dst = next_register++;
+	}
+	if (dst > 255) {
+		error = "expression too large";
+		return false;
+	}
+	instruction.dst = (uint8_t)dst;
+	registers[node] = dst;
+	program.code.push_back(instruction);
+
+	for (size_t i = 0; i < n.args.size(); ++i) {
+		release(n.args[i]);
+	}
+	return true;
+}
+
+void TextureCompiler::release(int node)
+{
+	if (--uses[node] > 0 || nodes[node].kind != Kind::OPERATION) return;
+	free_registers.push_back(registers[node]);
+}
+
+int TextureCompiler::parse_program()
+{
+	for (;;) {
+		// name = expression; binds a value, anything else is the result
+		size_t start = pos;
+		std::string name = identifier();
+		skip_space();
+		if (!name.empty() && pos < source.size() && source[pos] == '=') {
+			++pos;
+			int value = parse_sum();
+			if (value == -1) return -1;
+			if (!accept(';')) return fail("expected ;"), -1;
+			variables[name] = value;
+			continue;
+		}
+		pos = start;
+		int result = parse_sum();
+		if (result == -1) return -1;
+		accept(';');
+		skip_space();
+		if (pos != source.size()) return fail("unexpected text"), -1;
+		return result;
+	}
+}
+
+int TextureCompiler::parse_sum()
+{
+	int left = parse_product();
+	while (left != -1) {
+		if (accept('+')) {
+			int right = parse_product();
+			if (right == -1) return -1;
+			left = operation(Op::ADD, { left, right });
+		}
+		else if (accept('-')) {
+			int right = parse_product();
+			if (right == -1) return -1;
+			left = operation(Op::SUB, { left, right });
+		}
+		else break;
+	}
+	return left;
+}
+
+int TextureCompiler::parse_product()
+{
+	int left = parse_unary();
+	while (left != -1) {
+		if (accept('*')) {
+			int right = parse_unary();
+			if (right == -1) return -1;
+			left = operation(Op::MUL, { left, right });
+		}
+		else if (accept('/')) {
+			int right = parse_unary();
+			if (right == -1) return -1;
+			left = operation(Op::DIV, { left, right });
+		}
+		else break;
+	}
+	return left;
+}
+
+int TextureCompiler::parse_unary()
+{
+	if (accept('-')) {
+		int value = parse_unary();
+		return (value == -1) ? -1 : operation(Op::NEG, { value });
+	}
+	return parse_postfix();
+}
+
+int TextureCompiler::parse_postfix()
+{
+	int value = parse_primary();
+	while (value != -1 && accept('.')) {
+		std::string component = identifier();
+		if (component == "x" || component == "r") value = operation(Op::X, { value });
+		else if (component == "y" || component == "g") value = operation(Op::Y, { value });
+		else if (component == "z" || component == "b") value = operation(Op::Z, { value });
+		else return fail("unknown component " + component), -1;
+	}
+	return value;
+}
+
+int TextureCompiler::parse_primary()
+{
+	skip_space();
+	if (pos >= source.size()) return fail("unexpected end"), -1;
+
+	if (accept('(')) {
+		int value = parse_sum();
+		if (value != -1 && !accept(')')) return fail("expected )"), -1;
+		return value;
+	}
+
+	if (isdigit((unsigned char)source[pos]) || source[pos] == '.') {
+		const char * begin = source.c_str() + pos;
+		char * end = nullptr;
+		double number = strtod(begin, &end);
+		pos += end - begin;
+		return constant(Vec3(number, number, number));
+	}
+
+	std::string name = identifier();
+	if (name.empty()) return fail(std::string("unexpected ") + source[pos]), -1;
+
+	if (accept('(')) {
+		const Function * function = nullptr;
+		for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); ++i) {
+			if (name == functions[i].name) function = &functions[i];
+		}
+		if (!function) return fail("unknown function " + name), -1;
+		std::vector<int> args;
+		if (!accept(')')) {
+			do {
+				int arg = parse_sum();
+				if (arg == -1) return -1;
+				args.push_back(arg);
+			} while (accept(','));
+			if (!accept(')')) return fail("expected )"), -1;
+		}
+		if ((int)args.size() != function->arity) return fail(name + " takes " + std::to_string(function->arity) + " arguments"), -1;
+		return operation(function->op, args);
+	}
+
+	auto variable = variables.find(name);
+	if (variable != variables.end()) return variable->second;
+	if (name == "pi") return constant(Vec3(M_PI, M_PI, M_PI));
+	if (name == "p" || name == "n") {
+		Node node = {};
+		node.kind = (name == "p") ? Kind::POINT : Kind::NORMAL;
+		nodes.push_back(node);
+		return (int)nodes.size() - 1;
+	}
+	return fail("unknown name " + name), -1;
+}
+
+// Operations of constants are folded by running them through the interpreter once
+int TextureCompiler::operation(Op op, const std::vector<int> & args)
+{
+	bool folded = true;
+	for (size_t i = 0; i < args.size(); ++i) {
+		folded = folded && nodes[args[i]].kind == Kind::CONSTANT;
+	}
+	if (folded) {
+		TextureProgram single;
+		single.constants.clear();
+		TextureProgram::Instruction instruction = {};
+		instruction.op = op;
+		for (size_t i = 0; i < args.size(); ++i) {
+			single.constants.push_back(nodes[args[i]].value);
+			instruction.args[i] = (uint8_t)(2 + i);
+		}
+		instruction.dst = (uint8_t)(2 + args.size());
+		single.code.push_back(instruction);
+		single.result = instruction.dst;
+		single.registers_count = instruction.dst + 1;
+		Vec3 zero, value;
+		single.evaluate(&zero, &zero, nullptr, &value, 1);
+		return constant(value);
+	}
+
+	Node node = {};
+	node.kind = Kind::OPERATION;
+	node.op = op;
+	node.args = args;
+	nodes.push_back(node);
+	return (int)nodes.size() - 1;
+}
+
+int TextureCompiler::constant(Vec3 value)
+{
+	Node node = {};
+	node.kind = Kind::CONSTANT;
+	node.value = value;
+	nodes.push_back(node);
+	return (int)nodes.size() - 1;
+}
+
+void TextureCompiler::skip_space()
+{
+	while (pos < source.size() && isspace((unsigned char)source[pos])) ++pos;
+}
+
+bool TextureCompiler::accept(char c)
+{
+	skip_space();
+	if (pos < source.size() && source[pos] == c) {
+		++pos;
+		return true;
+	}
+	return false;
+}
+
+std::string TextureCompiler::identifier()
+{
+	skip_space();
+	size_t start = pos;
+	while (pos < source.size() && (isalpha((unsigned char)source[pos]) || source[pos] == '_'
+		|| (pos > start && isdigit((unsigned char)source[pos])))) {
+		++pos;
+	}
+	return source.substr(start, pos - start);
+}
+
+bool TextureCompiler::fail(const std::string & message)
+{
+	if (error.empty()) error = message;
+	return false;
+}
+
+
+TextureProgram::TextureProgram()
+	: constants(1, Vec3(0.0, 0.0, 0.0)), registers_count(3), result(2)
+{
+}
+
+bool TextureProgram::compile(const std::string & source)
+{
+	TextureCompiler compiler(source);
+	return compiler.compile(*this);
+}
+
+Vec3 TextureProgram::operator() (Vec3 p, Vec3 n) const
+{
+	double footprint = texture_footprint();
+	Vec3 color;
+	evaluate(&p, &n, &footprint, &color, 1);
+	return color;
+}
+
+void TextureProgram::evaluate(const Vec3 * points, const Vec3 * normals, const double * footprints, Vec3 * colors, int count) const
+{
+	// Component c of register r for all lanes is at registers[(r * 3 + c) * BATCH]
+	thread_local std::vector<double> scratch;
+	scratch.resize(std::max(scratch.size(), (size_t)registers_count * 3 * BATCH));
+	double * registers = scratch.data();
+
+	// Constants are the same in every batch
+	int lanes = std::min(count, (int)BATCH);
+	for (size_t k = 0; k < constants.size(); ++k) {
+		double * value = registers + (2 + k) * 3 * BATCH;
+		std::fill(value, value + lanes, constants[k].x);
+		std::fill(value + BATCH, value + BATCH + lanes, constants[k].y);
+		std::fill(value + 2 * BATCH, value + 2 * BATCH + lanes, constants[k].z);
+	}
+
+	for (int start = 0; start < count; start += BATCH) {
+		lanes = std::min(count - start, (int)BATCH);
+		for (int i = 0; i < lanes; ++i) {
+			registers[i] = points[start + i].x;
+			registers[BATCH + i] = points[start + i].y;
+			registers[2 * BATCH + i] = points[start + i].z;
+			registers[3 * BATCH + i] = normals[start + i].x;
+			registers[4 * BATCH + i] = normals[start + i].y;
+			registers[5 * BATCH + i] = normals[start + i].z;
+		}
+		run(registers, lanes, footprints ? footprints + start : nullptr);
+		const double * value = registers + result * 3 * BATCH;
+		for (int i = 0; i < lanes; ++i) {
+			colors[start + i] = Vec3(value[i], value[BATCH + i], value[2 * BATCH + i]);
+		}
+	}
+}
+
+// Same operation on every component of every lane
+template <class F>
+static inline void per_component(double * dst, const double * a, int lanes, F f)
+{
+	const int BATCH = TextureProgram::BATCH;
+	for (int c = 0; c < 3; ++c) {
+		for (int i = 0; i < lanes; ++i) dst[c * BATCH + i] = f(a[c * BATCH + i]);
+	}
+}
+
+template <class F>
+static inline void per_component(double * dst, const double * a, const double * b, int lanes, F f)
+{
+	const int BATCH = TextureProgram::BATCH;
+	for (int c = 0; c < 3; ++c) {
+		for (int i = 0; i < lanes; ++i) dst[c * BATCH + i] = f(a[c * BATCH + i], b[c * BATCH + i]);
+	}
+}
+
+template <class F>
+static inline void per_component(double * dst, const double * a, const double * b, const double * t, int lanes, F f)
+{
+	const int BATCH = TextureProgram::BATCH;
+	for (int c = 0; c < 3; ++c) {
+		for (int i = 0; i < lanes; ++i) dst[c * BATCH + i] = f(a[c * BATCH + i], b[c * BATCH + i], t[c * BATCH + i]);
+	}
+}
+
+static inline Vec3 lane_vec(const double * r, int i)
+{
+	return Vec3(r[i], r[TextureProgram::BATCH + i], r[2 * TextureProgram::BATCH + i]);
+}
+
+static inline void set_lane(double * r, int i, double x, double y, double z)
+{
+	r[i] = x;
+	r[TextureProgram::BATCH + i] = y;
+	r[2 * TextureProgram::BATCH + i] = z;
+}
+
+#ifdef TEXTURE_SSE2
+// Same operation on every component of every lane, two lanes at a time. An odd lane count computes
+// one lane more, BATCH is even so it is still inside the register and nothing reads it back.
+template <class F>
+static inline void per_component_sse2(double * dst, const double * a, const double * b, const double * t, int lanes, F f)
+{
+	const int BATCH = TextureProgram::BATCH;
+	for (int c = 0; c < 3 * BATCH; c += BATCH) {
+		for (int i = c; i < c + lanes; i += 2) {
+			_mm_storeu_pd(dst + i, f(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i), _mm_loadu_pd(t + i)));
+		}
+	}
+}
+
+// Length or dot product of two lanes of a and b
+static inline __m128d dot_sse2(const double * a, const double * b, int i)
+{
+	const int BATCH = TextureProgram::BATCH;
+	return _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)),
+		_mm_mul_pd(_mm_loadu_pd(a + BATCH + i), _mm_loadu_pd(b + BATCH + i))),
+		_mm_mul_pd(_mm_loadu_pd(a + 2 * BATCH + i), _mm_loadu_pd(b + 2 * BATCH + i)));
+}
+
+bool TextureProgram::run_sse2(Op op, double * d, const double * a, const double * b, const double * c, int lanes)
+{
+	const __m128d sign = _mm_set1_pd(-0.0);
+	switch (op) {
+	case Op::NEG: per_component_sse2(d, a, b, c, lanes, [sign](__m128d x, __m128d, __m128d) { return _mm_xor_pd(x, sign); }); return true;
+	case Op::ABS: per_component_sse2(d, a, b, c, lanes, [sign](__m128d x, __m128d, __m128d) { return _mm_andnot_pd(sign, x); }); return true;
+	case Op::SQRT: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d, __m128d) { return _mm_sqrt_pd(x); }); return true;
+	case Op::ADD: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d y, __m128d) { return _mm_add_pd(x, y); }); return true;
+	case Op::SUB: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d y, __m128d) { return _mm_sub_pd(x, y); }); return true;
+	case Op::MUL: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d y, __m128d) { return _mm_mul_pd(x, y); }); return true;
+	case Op::DIV: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d y, __m128d) { return _mm_div_pd(x, y); }); return true;
+	case Op::MIN: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d y, __m128d) { return _mm_min_pd(x, y); }); return true;
+	case Op::MAX: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d y, __m128d) { return _mm_max_pd(x, y); }); return true;
+	case Op::MIX: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d y, __m128d t) { return _mm_add_pd(x, _mm_mul_pd(_mm_sub_pd(y, x), t)); }); return true;
+	case Op::CLAMP: per_component_sse2(d, a, b, c, lanes, [](__m128d x, __m128d lo, __m128d hi) { return _mm_min_pd(_mm_max_pd(x, lo), hi); }); return true;
+
+	case Op::DOT:
+	case Op::LENGTH:
+		for (int i = 0; i < lanes; i += 2) {
+			__m128d s = (op == Op::DOT) ? dot_sse2(a, b, i) : _mm_sqrt_pd(dot_sse2(a, a, i));
+			_mm_storeu_pd(d + i, s);
+			_mm_storeu_pd(d + BATCH + i, s);
+			_mm_storeu_pd(d + 2 * BATCH + i, s);
+		}
+		return true;
+	case Op::NORMALIZE:
+		for (int i = 0; i < lanes; i += 2) {
+			__m128d s = _mm_sqrt_pd(dot_sse2(a, a, i));
+			// Zero vectors stay zero
+			__m128d k = _mm_and_pd(_mm_div_pd(_mm_set1_pd(1.0), s), _mm_cmpgt_pd(s, _mm_setzero_pd()));
+			_mm_storeu_pd(d + i, _mm_mul_pd(_mm_loadu_pd(a + i), k));
+			_mm_storeu_pd(d + BATCH + i, _mm_mul_pd(_mm_loadu_pd(a + BATCH + i), k));
+			_mm_storeu_pd(d + 2 * BATCH + i, _mm_mul_pd(_mm_loadu_pd(a + 2 * BATCH + i), k));
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+#endif
+
+void TextureProgram::run(double * registers, int lanes, const double * footprints) const
+{
+	for (size_t k = 0; k < code.size(); ++k) {
+		const Instruction & in = code[k];
+		double * d = registers + in.dst * 3 * BATCH;
+		const double * a = registers + in.args[0] * 3 * BATCH;
+		const double * b = registers + in.args[1] * 3 * BATCH;
+		const double * c = registers + in.args[2] * 3 * BATCH;
+		const double * e = registers + in.args[3] * 3 * BATCH;
+		const double * f = registers + in.args[4] * 3 * BATCH;
+
+#ifdef TEXTURE_SSE2
+		if (run_sse2(in.op, d, a, b, c, lanes)) continue;
+#endif
+		switch (in.op) {
+		case Op::NEG: per_component(d, a, lanes, [](double x) { return -x; }); break;
+		case Op::X: for (int j = 0; j < 3; ++j) std::copy(a, a + lanes, d + j * BATCH); break;
+		case Op::Y: for (int j = 0; j < 3; ++j) std::copy(a + BATCH, a + BATCH + lanes, d + j * BATCH); break;
+		case Op::Z: for (int j = 0; j < 3; ++j) std::copy(a + 2 * BATCH, a + 2 * BATCH + lanes, d + j * BATCH); break;
+
+		case Op::SIN: per_component(d, a, lanes, [](double x) { return sin(x); }); break;
+		case Op::COS: per_component(d, a, lanes, [](double x) { return cos(x); }); break;
+		case Op::ABS: per_component(d, a, lanes, [](double x) { return fabs(x); }); break;
+		case Op::SQRT: per_component(d, a, lanes, [](double x) { return sqrt(x); }); break;
+		case Op::FLOOR: per_component(d, a, lanes, [](double x) { return floor(x); }); break;
+		case Op::FRACT: per_component(d, a, lanes, [](double x) { return x - floor(x); }); break;
+		case Op::EXP: per_component(d, a, lanes, [](double x) { return exp(x); }); break;
+
+		case Op::ADD: per_component(d, a, b, lanes, [](double x, double y) { return x + y; }); break;
+		case Op::SUB: per_component(d, a, b, lanes, [](double x, double y) { return x - y; }); break;
+		case Op::MUL: per_component(d, a, b, lanes, [](double x, double y) { return x * y; }); break;
+		case Op::DIV: per_component(d, a, b, lanes, [](double x, double y) { return x / y; }); break;
+		case Op::POW: per_component(d, a, b, lanes, [](double x, double y) { return pow(x, y); }); break;
+		case Op::MIN: per_component(d, a, b, lanes, [](double x, double y) { return std::min(x, y); }); break;
+		case Op::MAX: per_component(d, a, b, lanes, [](double x, double y) { return std::max(x, y); }); break;
+		case Op::MIX: per_component(d, a, b, c, lanes, [](double x, double y, double t) { return x + (y - x) * t; }); break;
+		case Op::CLAMP: per_component(d, a, b, c, lanes, [](double x, double lo, double hi) { return std::min(std::max(x, lo), hi); }); break;
+
+		case Op::VEC:
+			std::copy(a, a + lanes, d);
+			std::copy(b, b + lanes, d + BATCH);
+			std::copy(c, c + lanes, d + 2 * BATCH);
+			break;
+		case Op::DOT:
+			for (int i = 0; i < lanes; ++i) {
+				double s = a[i] * b[i] + a[BATCH + i] * b[BATCH + i] + a[2 * BATCH + i] * b[2 * BATCH + i];
+				set_lane(d, i, s, s, s);
+			}
+			break;
+		case Op::LENGTH:
+			for (int i = 0; i < lanes; ++i) {
+				double s = sqrt(a[i] * a[i] + a[BATCH + i] * a[BATCH + i] + a[2 * BATCH + i] * a[2 * BATCH + i]);
+				set_lane(d, i, s, s, s);
+			}
+			break;
+		case Op::NORMALIZE:
+			for (int i = 0; i < lanes; ++i) {
+				double s = sqrt(a[i] * a[i] + a[BATCH + i] * a[BATCH + i] + a[2 * BATCH + i] * a[2 * BATCH + i]);
+				double k = (s > 0.0) ? 1.0 / s : 0.0;
+				set_lane(d, i, a[i] * k, a[BATCH + i] * k, a[2 * BATCH + i] * k);
+			}
+			break;
+		case Op::CROSS:
+			for (int i = 0; i < lanes; ++i) {
+				Vec3 v = lane_vec(a, i).cross(lane_vec(b, i));
+				set_lane(d, i, v.x, v.y, v.z);
+			}
+			break;
+
+		// Noise keeps the level of detail of NoiseTexture, SmoothNoiseTexture and TurbulentTexture
+		case Op::NOISE:
+		case Op::SMOOTH_NOISE:
+			for (int i = 0; i < lanes; ++i) {
+				Vec3 patch = lane_vec(e, i);
+				double weight = detail_weight(std::min(std::min(patch.x, patch.y), patch.z), footprints ? footprints[i] : 0.0);
+				double s = 0.5;
+				if (weight > 0.0) {
+					double value = (in.op == Op::NOISE)
+						? zoomed_noise(lane_vec(a, i), lane_vec(b, i), lane_vec(c, i), patch)
+						: smooth_noise(lane_vec(a, i), lane_vec(b, i), lane_vec(c, i), patch);
+					s = 0.5 + (value - 0.5) * weight;
+				}
+				set_lane(d, i, s, s, s);
+			}
+			break;
+		case Op::TURBULENCE:
+			for (int i = 0; i < lanes; ++i) {
+				double s = turbulence(lane_vec(a, i), lane_vec(b, i), lane_vec(c, i), lane_vec(e, i), (int)f[i],
+					footprints ? footprints[i] : 0.0);
+				set_lane(d, i, s, s, s);
+			}
+			break;
+		case Op::VORNOI:
+			for (int i = 0; i < lanes; ++i) {
+				double s = vornoi(lane_vec(a, i), lane_vec(b, i), lane_vec(c, i), lane_vec(e, i));
+				set_lane(d, i, s, s, s);
+			}
+			break;
+		case Op::HASH_NOISE:
+		case Op::VALUE_NOISE:
+		case Op::PERLIN:
+			for (int i = 0; i < lanes; ++i) {
+				Vec3 cell = lane_vec(c, i);
+				double weight = detail_weight(std::min(std::min(cell.x, cell.y), cell.z), footprints ? footprints[i] : 0.0);
+				double s = 0.5;
+				if (weight > 0.0) {
+					double value = (in.op == Op::HASH_NOISE) ? hash_noise(lane_vec(a, i), lane_vec(b, i), cell)
+						: (in.op == Op::VALUE_NOISE) ? value_noise(lane_vec(a, i), lane_vec(b, i), cell)
+						: perlin_noise(lane_vec(a, i), lane_vec(b, i), cell);
+					s = 0.5 + (value - 0.5) * weight;
+				}
+				set_lane(d, i, s, s, s);
+			}
+			break;
+		case Op::FBM:
+			for (int i = 0; i < lanes; ++i) {
+				double s = fbm(lane_vec(a, i), lane_vec(b, i), lane_vec(c, i), (int)e[i], footprints ? footprints[i] : 0.0);
+				set_lane(d, i, s, s, s);
+			}
+			break;
+		case Op::WORLEY:
+			for (int i = 0; i < lanes; ++i) {
+				double s = worley(lane_vec(a, i), lane_vec(b, i), lane_vec(c, i));
+				set_lane(d, i, s, s, s);
+			}
+			break;
+		}
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#ifndef _TEXTURE_PROGRAM_H_
+#define _TEXTURE_PROGRAM_H_
+
+#include "Vec3.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+// Procedural texture written as an expression of the hit point p and its normal n, e.g.
+//   d = length(p) + 4 * turbulence(p, vec(-25, -50, -50), 100, 7, 5); vec(0.8, 0.5, 0.2) * pow(0.5 + 0.5 * sin(d), 0.5)
+// Every value has three components, numbers and .x, .y, .z of a vector hold the same value in all of them.
+// Assignments before the last expression name intermediate values. The source is compiled to
+// register code with constant parts folded, and evaluate() runs it for a batch of points one
+// instruction at a time, so dispatch is paid once per batch and arithmetic runs on two points per SSE2 instruction.
+
+class TextureProgram {
+
+public:
+
+	TextureProgram();
+
+	// Prints the error and keeps the previous program if the source doesn't compile
+	bool compile(const std::string & source);
+
+	// Colors of points in a row. Footprints (see texture_footprint()) may be nullptr for full detail.
+	void evaluate(const Vec3 * points, const Vec3 * normals, const double * footprints, Vec3 * colors, int count) const;
+
+	// Single point with the footprint of the lookup in flight
+	Vec3 operator() (Vec3 p, Vec3 n) const;
+
+	static const int BATCH = 16;
+
+private:
+
+	enum class Op : uint8_t {
+		NEG, X, Y, Z,
+		SIN, COS, ABS, SQRT, FLOOR, FRACT, EXP,
+		ADD, SUB, MUL, DIV, POW, MIN, MAX,
+		MIX, CLAMP,
+		VEC, DOT, LENGTH, NORMALIZE, CROSS,
+		NOISE, SMOOTH_NOISE, TURBULENCE, VORNOI,
+		HASH_NOISE, VALUE_NOISE, PERLIN, FBM, WORLEY,
+	};
+
+	// Registers 0 and 1 are p and n, then constants, then temporaries
+	struct Instruction {
+		Op op;
+		uint8_t dst;
+		uint8_t args[5];
+	};
+
+	std::vector<Instruction> code;
+	std::vector<Vec3> constants;
+	int registers_count;
+	int result;
+
+	void run(double * registers, int lanes, const double * footprints) const;
+	// Arithmetic instructions of run() with SSE2, false for the rest. Only built where SSE2 is available.
+	static bool run_sse2(Op op, double * d, const double * a, const double * b, const double * c, int lanes);
+
+	friend class TextureCompiler;
+
+};
+
+// Material channel running a program. Tracer::evaluate_surfaces() recognizes it and evaluates
+// all hits of a body at once, called as a bump map it gives the first component.
+class TextureChannel {
+
+public:
+
+	TextureChannel(std::shared_ptr<const TextureProgram> program) : program(program) {}
+
+	Vec3 operator() (Vec3 p, Vec3 n) const { return (*program)(p, n); }
+	double operator() (Vec3 p) const { return (*program)(p, Vec3(0.0, 0.0, 0.0)).x; }
+
+	std::shared_ptr<const TextureProgram> program;
+
+};
+
+#endif // _TEXTURE_PROGRAM_H_
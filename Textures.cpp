@@ -1,4 +1,5 @@
 #include "Textures.h"
+#include <algorithm>
 
 double noise_function(Vec3 v) {
 	return fmod(fmod(sin(v.dot(Vec3(12.9898, 78.233, 31.4159))) * 43758.5453, 1.0) + 1.0, 1.0);
@@ -52,6 +53,47 @@ double turbulence(Vec3 p, Vec3 origin, Vec3 size, Vec3 patch_size, int depth) {
 	return t;
 }
 
+double turbulence(Vec3 p, Vec3 origin, Vec3 size, Vec3 patch_size, int depth, double footprint) {
+	double k = 0.5;
+	double n = 0.0;
+	double t = 0.0;
+	for (int i = 0; i < depth; ++i) {
+		double weight = detail_weight(std::min(std::min(patch_size.x, patch_size.y), patch_size.z), footprint);
+		if (weight <= 0.0) {
+			// This and all finer octaves average out over the footprint, their sum is known
+			n = 0.5 * k * pow(0.5, depth - 1 - i);
+			t += 0.5 * k * 2.0 * (1.0 - pow(0.5, depth - i));
+			break;
+		}
+		n = (0.5 + (smooth_noise(p, origin, size, patch_size) - 0.5) * weight) * k;
+		t += n;
+		k = k * 0.5;
+		patch_size = patch_size * 0.5;
+	}
+	t += n;
+	return t;
+}
+
+static thread_local double current_footprint = 0.0;
+
+double texture_footprint() {
+	return current_footprint;
+}
+
+TextureFootprintScope::TextureFootprintScope(double footprint) {
+	previous = current_footprint;
+	current_footprint = footprint;
+}
+
+TextureFootprintScope::~TextureFootprintScope() {
+	current_footprint = previous;
+}
+
+double detail_weight(double cell, double footprint) {
+	if (footprint <= 0.0) return 1.0;
+	return std::min(std::max(cell / footprint - 1.0, 0.0), 1.0);
+}
+
 Vec3 noise_vector(Vec3 v) {
 	return Vec3(
 		fmod(fmod(sin(v.dot(Vec3(12.9898, 78.233, 31.4159))) * 43758.5453, 1.0) + 1.0, 1.0),
@@ -82,3 +124,138 @@ double vornoi(Vec3 p, Vec3 origin, Vec3 size, Vec3 patch_size) {
 			}
 	return min_dist / sqrt(3.0);
 }
+
+uint32_t pcg_hash(uint32_t v) {
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+static inline double hash_unit(uint32_t h) {
+	return (h >> 8) * (1.0 / 16777216.0);
+}
+
+// Integer cell of the point and where it is inside, both in cells. Coordinates wrap at 2^32 cells.
+static inline void lattice(Vec3 p, Vec3 origin, Vec3 cell, uint32_t * c, double * f) {
+	double pos[3] = { (p.x - origin.x) / cell.x, (p.y - origin.y) / cell.y, (p.z - origin.z) / cell.z };
+	for (int i = 0; i < 3; ++i) {
+		double fl = floor(pos[i]);
+		c[i] = (uint32_t)(int64_t)fl;
+		f[i] = pos[i] - fl;
+	}
+}
+
+static inline double fade(double t) {
+	return t * t * t * (t * (t * 6.0 - 15.0) + 10.0);
+}
+
+static inline double lerp(double a, double b, double t) {
+	return a + (b - a) * t;
+}
+
+// Hashes of the 8 corners, z and yz parts are shared between them
+static inline void corner_hashes(const uint32_t * c, uint32_t * h) {
+	uint32_t hz[2] = { pcg_hash(c[2]), pcg_hash(c[2] + 1u) };
+	for (int j = 0; j < 4; ++j) {
+		uint32_t hyz = pcg_hash(c[1] + (j >> 1) + hz[j & 1]);
+		h[j] = pcg_hash(c[0] + hyz);
+		h[j + 4] = pcg_hash(c[0] + 1u + hyz);
+	}
+}
+
+double hash_noise(Vec3 p, Vec3 origin, Vec3 cell) {
+	uint32_t c[3];
+	double f[3];
+	lattice(p, origin, cell, c, f);
+	return hash_unit(pcg_hash(c[0] + pcg_hash(c[1] + pcg_hash(c[2]))));
+}
+
+double value_noise(Vec3 p, Vec3 origin, Vec3 cell) {
+	uint32_t c[3];
+	double f[3];
+	uint32_t h[8];
+	lattice(p, origin, cell, c, f);
+	corner_hashes(c, h);
+	double u = f[0] * f[0] * (3.0 - 2.0 * f[0]);
+	double v = f[1] * f[1] * (3.0 - 2.0 * f[1]);
+	double w = f[2] * f[2] * (3.0 - 2.0 * f[2]);
+	// Corner index is x * 4 + y * 2 + z
+	return lerp(
+		lerp(lerp(hash_unit(h[0]), hash_unit(h[1]), w), lerp(hash_unit(h[2]), hash_unit(h[3]), w), v),
+		lerp(lerp(hash_unit(h[4]), hash_unit(h[5]), w), lerp(hash_unit(h[6]), hash_unit(h[7]), w), v),
+		u);
+}
+
+static inline double gradient(uint32_t h, double x, double y, double z) {
+	h = h >> 28;
+	double u = (h < 8) ? x : y;
+	double v = (h < 4) ? y : ((h == 12 || h == 14) ? x : z);
+	return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+}
+
+double perlin_noise(Vec3 p, Vec3 origin, Vec3 cell) {
+	uint32_t c[3];
+	double f[3];
+	uint32_t h[8];
+	lattice(p, origin, cell, c, f);
+	corner_hashes(c, h);
+	double x = f[0], y = f[1], z = f[2];
+	double n = lerp(
+		lerp(lerp(gradient(h[0], x, y, z), gradient(h[1], x, y, z - 1.0), fade(z)),
+			lerp(gradient(h[2], x, y - 1.0, z), gradient(h[3], x, y - 1.0, z - 1.0), fade(z)), fade(y)),
+		lerp(lerp(gradient(h[4], x - 1.0, y, z), gradient(h[5], x - 1.0, y, z - 1.0), fade(z)),
+			lerp(gradient(h[6], x - 1.0, y - 1.0, z), gradient(h[7], x - 1.0, y - 1.0, z - 1.0), fade(z)), fade(y)),
+		fade(x));
+	return std::min(std::max(0.5 + 0.5 * n, 0.0), 1.0);
+}
+
+double fbm(Vec3 p, Vec3 origin, Vec3 cell, int depth, double footprint) {
+	double k = 0.5;
+	double n = 0.0;
+	double t = 0.0;
+	for (int i = 0; i < depth; ++i) {
+		double weight = detail_weight(std::min(std::min(cell.x, cell.y), cell.z), footprint);
+		if (weight <= 0.0) {
+			n = 0.5 * k * pow(0.5, depth - 1 - i);
+			t += 0.5 * k * 2.0 * (1.0 - pow(0.5, depth - i));
+			break;
+		}
+		n = (0.5 + (perlin_noise(p, origin, cell) - 0.5) * weight) * k;
+		t += n;
+		k = k * 0.5;
+		cell = cell * 0.5;
+	}
+	t += n;
+	return t;
+}
+
+double worley(Vec3 p, Vec3 origin, Vec3 cell) {
+	uint32_t c[3];
+	double f[3];
+	lattice(p, origin, cell, c, f);
+	double best = 3.0;
+	// Own cell first, its point usually rules most neighbours out
+	for (int k = 0; k < 27; ++k) {
+		int index = (k + 13) % 27;
+		int d[3] = { index / 9 - 1, (index / 3) % 3 - 1, index % 3 - 1 };
+		double bound = 0.0;
+		for (int i = 0; i < 3; ++i) {
+			if (d[i] < 0) bound += f[i] * f[i];
+			if (d[i] > 0) bound += (1.0 - f[i]) * (1.0 - f[i]);
+		}
+		if (bound >= best) continue;
+		// PCG3D, the three words are the feature point inside the cell
+		uint32_t v[3];
+		for (int i = 0; i < 3; ++i) v[i] = (c[i] + (uint32_t)d[i]) * 1664525u + 1013904223u;
+		v[0] += v[1] * v[2]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1];
+		for (int i = 0; i < 3; ++i) v[i] ^= v[i] >> 16u;
+		v[0] += v[1] * v[2]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1];
+		double dist = 0.0;
+		for (int i = 0; i < 3; ++i) {
+			double delta = d[i] + hash_unit(v[i]) - f[i];
+			dist += delta * delta;
+		}
+		if (dist < best) best = dist;
+	}
+	return sqrt(best / 3.0);
+}
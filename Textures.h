@@ -4,7 +4,9 @@
 #define _TEXTURES_H_
 
 #include "Vec3.h"
-#include <math.h>
+#include <math.h>
+#include <algorithm>
+#include <stdint.h>
 
 double noise_function(Vec3 v);
 
@@ -18,6 +20,53 @@ Vec3 noise_vector(Vec3 v);
 
 double vornoi(Vec3 p, Vec3 origin, Vec3 size, Vec3 patch_size);
 
+// Integer lattice noise. The point is cut into cells of the given size from origin, cell corners
+// are hashed from their integer coordinates (PCG), so values are the same on every platform and
+// don't degrade far from origin. Results are in [0, 1].
+
+uint32_t pcg_hash(uint32_t v);
+
+// Constant in every cell
+double hash_noise(Vec3 p, Vec3 origin, Vec3 cell);
+
+// Corner values blended with a smoothstep
+double value_noise(Vec3 p, Vec3 origin, Vec3 cell);
+
+// Gradient noise, corner gradients are the 12 edge directions of improved Perlin noise
+double perlin_noise(Vec3 p, Vec3 origin, Vec3 cell);
+
+// Octaves of perlin_noise weighted like turbulence(), finer than the footprint replaced by their mean
+double fbm(Vec3 p, Vec3 origin, Vec3 cell, int depth, double footprint);
+
+// Distance to the nearest feature point, one per cell, in cells over sqrt(3). Neighbour
+// cells farther than the best point found so far are skipped without hashing.
+double worley(Vec3 p, Vec3 origin, Vec3 cell);
+
+// World size of the surface area the texture lookup in flight stands for, 0 for a point. The
+// tracer sets it from the ray cone around material evaluation, so procedurals can leave out
+// detail smaller than a pixel instead of aliasing on it.
+double texture_footprint();
+
+class TextureFootprintScope {
+
+public:
+
+	TextureFootprintScope(double footprint);
+	~TextureFootprintScope();
+
+private:
+
+	double previous;
+
+};
+
+// How much of noise with cells of this size to keep, 1 for cells of twice the footprint or more,
+// 0 once a cell fits in it. Noise that isn't kept is replaced by its mean.
+double detail_weight(double cell, double footprint);
+
+// Octaves smaller than the footprint are replaced by their mean and not evaluated
+double turbulence(Vec3 p, Vec3 origin, Vec3 size, Vec3 patch_size, int depth, double footprint);
+
 
 class NoiseTexture {
 
@@ -31,7 +80,9 @@ public:
 	}
 
 	Vec3 operator() (Vec3 p, Vec3 n) {
-		return color * zoomed_noise(p, origin, size, patch_size);
+		double weight = detail_weight(std::min(std::min(patch_size.x, patch_size.y), patch_size.z), texture_footprint());
+		if (weight <= 0.0) return color * 0.5;
+		return color * (0.5 + (zoomed_noise(p, origin, size, patch_size) - 0.5) * weight);
 	}
 
 	NoiseTexture operator * (Vec3 col) {
@@ -61,7 +112,9 @@ public:
 	}
 
 	Vec3 operator() (Vec3 p, Vec3 n) {
-		return color * smooth_noise(p, origin, size, patch_size);
+		double weight = detail_weight(std::min(std::min(patch_size.x, patch_size.y), patch_size.z), texture_footprint());
+		if (weight <= 0.0) return color * 0.5;
+		return color * (0.5 + (smooth_noise(p, origin, size, patch_size) - 0.5) * weight);
 	}
 
 	SmoothNoiseTexture operator * (Vec3 col) {
@@ -92,7 +145,7 @@ public:
 	}
 
 	Vec3 operator() (Vec3 p, Vec3 n) {
-		return color * turbulence(p, origin, size, patch_size, depth);
+		return color * turbulence(p, origin, size, patch_size, depth, texture_footprint());
 	}
 
 	TurbulentTexture operator * (Vec3 col) {
@@ -111,4 +164,64 @@ private:
 
 };
 
+class PerlinTexture {
+
+public:
+
+	PerlinTexture(Vec3 origin, Vec3 cell) {
+		this->origin = origin;
+		this->cell = cell;
+		this->color = Vec3(1.0, 1.0, 1.0);
+	}
+
+	Vec3 operator() (Vec3 p, Vec3 n) {
+		double weight = detail_weight(std::min(std::min(cell.x, cell.y), cell.z), texture_footprint());
+		if (weight <= 0.0) return color * 0.5;
+		return color * (0.5 + (perlin_noise(p, origin, cell) - 0.5) * weight);
+	}
+
+	PerlinTexture operator * (Vec3 col) {
+		PerlinTexture clone(*this);
+		clone.color = clone.color * col;
+		return clone;
+	}
+
+private:
+
+	Vec3 color;
+	Vec3 origin;
+	Vec3 cell;
+
+};
+
+class FbmTexture {
+
+public:
+
+	FbmTexture(Vec3 origin, Vec3 cell, int depth) {
+		this->origin = origin;
+		this->cell = cell;
+		this->color = Vec3(1.0, 1.0, 1.0);
+		this->depth = depth;
+	}
+
+	Vec3 operator() (Vec3 p, Vec3 n) {
+		return color * fbm(p, origin, cell, depth, texture_footprint());
+	}
+
+	FbmTexture operator * (Vec3 col) {
+		FbmTexture clone(*this);
+		clone.color = clone.color * col;
+		return clone;
+	}
+
+private:
+
+	Vec3 color;
+	Vec3 origin;
+	Vec3 cell;
+	int depth;
+
+};
+
 #endif // _TEXTURES_H_
\ No newline at end of file
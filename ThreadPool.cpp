@@ -0,0 +1,112 @@
+#include "ThreadPool.h"
+#include "Topology.h"
+
+ThreadPool::ThreadPool(int threads_count)
+	: job(nullptr), job_generation(0), busy(0), steal(true), quit(false)
+{
+	const Topology & topology = Topology::get();
+	std::vector<int> cpus = topology.worker_cpus(topology.threads_for(threads_count));
+
+	// Nodes without workers get no range, the rest are numbered densely
+	std::vector<int> dense(topology.nodes_count(), -1);
+	for (size_t i = 0; i < cpus.size(); ++i) {
+		int node = topology.cpus()[cpus[i]].node;
+		if (dense[node] < 0) {
+			dense[node] = (int)node_workers.size();
+			node_workers.push_back(0);
+		}
+		worker_node.push_back(dense[node]);
+		node_workers[dense[node]]++;
+	}
+	range_next.resize(node_workers.size());
+	range_end.resize(node_workers.size());
+
+	for (size_t i = 0; i < cpus.size(); ++i) {
+		const Topology::Cpu & cpu = topology.cpus()[cpus[i]];
+		threads.push_back(std::thread([this, i, cpu]() {
+			Topology::pin_worker(cpu);
+			worker((int)i);
+		}));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+}
+
+void ThreadPool::start(int count, bool per_node, const std::function<void(int, int)> & task)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	int begin = 0;
+	for (size_t n = 0; n < node_workers.size(); ++n) {
+		range_next[n] = begin;
+		begin += per_node ? 1 : (int)((long long)count * node_workers[n] / threads.size());
+		range_end[n] = (n + 1 == node_workers.size()) ? count : begin;
+	}
+	steal = !per_node;
+	job = &task;
+	job_generation++;
+	busy = (int)threads.size();
+	wake.notify_all();
+	finished.wait(lock, [this]() { return busy == 0; });
+	job = nullptr;
+}
+
+void ThreadPool::run(int count, const std::function<void(int, int)> & task)
+{
+	start(count, false, task);
+}
+
+void ThreadPool::run_per_node(const std::function<void(int)> & task)
+{
+	// One index per node, and nobody takes another node's
+	std::function<void(int, int)> per_node = [&task](int, int node) { task(node); };
+	start((int)node_workers.size(), true, per_node);
+}
+
+bool ThreadPool::next_index(int node, int & index)
+{
+	if (range_next[node] < range_end[node]) {
+		index = range_next[node]++;
+		return true;
+	}
+	if (!steal) return false;
+	int victim = -1;
+	for (size_t n = 0; n < range_next.size(); ++n) {
+		if (range_next[n] < range_end[n] && (victim < 0 || range_end[n] - range_next[n] > range_end[victim] - range_next[victim])) {
+			victim = (int)n;
+		}
+	}
+	if (victim < 0) return false;
+	// From the far end, the owners keep walking their range in order
+	index = --range_end[victim];
+	return true;
+}
+
+void ThreadPool::worker(int index)
+{
+	int node = worker_node[index];
+	int generation = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		wake.wait(lock, [&]() { return quit || job_generation != generation; });
+		if (quit) return;
+		generation = job_generation;
+		const std::function<void(int, int)> & task = *job;
+		int task_index;
+		while (next_index(node, task_index)) {
+			lock.unlock();
+			task(task_index, node);
+			lock.lock();
+		}
+		if (--busy == 0) finished.notify_all();
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Worker threads pinned to the CPUs Topology::worker_cpus() picks. A job's indices are split in
+// contiguous ranges, one per NUMA node in proportion to its workers, so neighbouring tiles and
+// the memory their workers first touch stay on one socket. Workers that run out of their node's
+// range help the node with the most left.
+
+class ThreadPool {
+
+public:
+
+	// threads_count 0 starts one worker per hardware thread
+	ThreadPool(int threads_count);
+	~ThreadPool();
+
+	int size() const { return (int)threads.size(); }
+	// Nodes that have workers, tasks get node numbers 0 to nodes_count() - 1
+	int nodes_count() const { return (int)node_workers.size(); }
+	int node_size(int node) const { return node_workers[node]; }
+
+	// Runs task(index, node) for index in [0, count) and returns once all are done.
+	// Not reentrant, tasks must not run jobs of the same pool.
+	void run(int count, const std::function<void(int, int)> & task);
+	// Runs task(node) once on a worker of every node, e.g. to build data local to it
+	void run_per_node(const std::function<void(int)> & task);
+
+private:
+
+	void worker(int index);
+	void start(int count, bool per_node, const std::function<void(int, int)> & task);
+	// Next index for a worker of the node, false when the job has none left for it
+	bool next_index(int node, int & index);
+
+	std::vector<std::thread> threads;
+	std::vector<int> worker_node;
+	std::vector<int> node_workers;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	const std::function<void(int, int)> * job;
+	int job_generation;
+	int busy;
+	bool steal;
+	bool quit;
+	std::vector<int> range_next;
+	std::vector<int> range_end;
+
+};
+
+#endif // _THREADPOOL_H_
@@ -0,0 +1,113 @@
+#include "Tonemap.h"
+#include <math.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TONEMAP_SSE2
+#include <emmintrin.h>
+#endif
+
+Tonemap::Tonemap(const Configurer & config)
+	: exposure(config.exposure), gamma(config.gamma), r_shift(16), g_shift(8), b_shift(0)
+{
+	build_lut();
+}
+
+void Tonemap::set_exposure(double exposure)
+{
+	this->exposure = exposure;
+}
+
+void Tonemap::set_gamma(double gamma)
+{
+	this->gamma = gamma;
+	build_lut();
+}
+
+void Tonemap::set_pixel_format(int r_shift, int g_shift, int b_shift)
+{
+	this->r_shift = r_shift;
+	this->g_shift = g_shift;
+	this->b_shift = b_shift;
+}
+
+void Tonemap::build_lut()
+{
+	lut.resize(LUT_SIZE);
+	for (int i = 0; i < LUT_SIZE; ++i) {
+		double v = pow((double)i / (LUT_SIZE - 1), 1.0 / gamma);
+		lut[i] = (uint8_t)std::min(v * 0xFF + 0.5, 255.0);
+	}
+}
+
+Vec3 Tonemap::map(Vec3 radiance) const
+{
+	Vec3 col = Vec3(1.0, 1.0, 1.0) - (radiance * exposure).exp();
+	if (gamma != 1.0) {
+		col = Vec3(pow(std::max(col.r, 0.0), 1.0 / gamma), pow(std::max(col.g, 0.0), 1.0 / gamma), pow(std::max(col.b, 0.0), 1.0 / gamma));
+	}
+	return col;
+}
+
+void Tonemap::apply(Image & image) const
+{
+	for (size_t i = 0; i < image.pixels.size(); ++i) {
+		image.pixels[i] = map(image.pixels[i]);
+	}
+}
+
+#ifdef TONEMAP_SSE2
+// e^x for x <= 0, 2^fraction by polynomial and 2^integer through the float exponent bits
+static inline __m128 exp_ps(__m128 x)
+{
+	x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+	x = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+	__m128i n = _mm_cvttps_epi32(x);
+	__m128 fn = _mm_cvtepi32_ps(n);
+	// Truncation rounds negative numbers up, floor is one less
+	__m128 above = _mm_cmpgt_ps(fn, x);
+	fn = _mm_sub_ps(fn, _mm_and_ps(above, _mm_set1_ps(1.0f)));
+	n = _mm_cvtps_epi32(fn);
+	__m128 f = _mm_sub_ps(x, fn);
+
+	__m128 p = _mm_set1_ps(1.333355814e-3f);
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.618129108e-3f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.550410866e-2f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.402265070e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.931471806e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+
+	__m128i bits = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+	return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+#endif
+
+void Tonemap::apply(const float * rgb, uint32_t * pixels, int count) const
+{
+	// Lookup indices of all channels, rgb floats are processed as one flat array
+	const int n = count * 3;
+	std::vector<int> index(n + 3);
+	int i = 0;
+#ifdef TONEMAP_SSE2
+	const __m128 e = _mm_set1_ps((float)exposure);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 steps = _mm_set1_ps((float)(LUT_SIZE - 1));
+	for (; i + 4 <= n; i += 4) {
+		__m128 v = _mm_mul_ps(_mm_loadu_ps(rgb + i), e);
+		v = _mm_min_ps(v, _mm_setzero_ps());
+		__m128 t = _mm_sub_ps(one, exp_ps(v));
+		t = _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), one);
+		_mm_storeu_si128((__m128i *)&index[i], _mm_cvtps_epi32(_mm_mul_ps(t, steps)));
+	}
+#endif
+	for (; i < n; ++i) {
+		double t = 1.0 - exp(std::min(rgb[i] * exposure, 0.0));
+		index[i] = (int)(std::min(std::max(t, 0.0), 1.0) * (LUT_SIZE - 1) + 0.5);
+	}
+
+	for (int p = 0; p < count; ++p) {
+		pixels[p] = ((uint32_t)lut[index[p * 3 + 0]] << r_shift)
+			| ((uint32_t)lut[index[p * 3 + 1]] << g_shift)
+			| ((uint32_t)lut[index[p * 3 + 2]] << b_shift);
+	}
+}
\ No newline at end of file
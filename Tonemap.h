@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef _TONEMAP_H_
+#define _TONEMAP_H_
+
+#include <stdint.h>
+#include <vector>
+#include "Configurer.h"
+#include "Image.h"
+#include "Vec3.h"
+
+// Linear radiance to display colors: 1 - exp(radiance * exposure) tone curve, then gamma.
+// apply() converts packed float rgb straight to 32-bit pixels, four floats at a time with SSE2
+// where available, gamma and 8-bit quantization go through a lookup table.
+
+class Tonemap {
+
+public:
+
+	Tonemap(const Configurer & config);
+
+	double get_exposure() const { return exposure; }
+	double get_gamma() const { return gamma; }
+	void set_exposure(double exposure);
+	void set_gamma(double gamma);
+	// Bit positions of the 8-bit channels in pixels written by apply()
+	void set_pixel_format(int r_shift, int g_shift, int b_shift);
+
+	// Display color in [0, 1], not quantized
+	Vec3 map(Vec3 radiance) const;
+	void apply(Image & image) const;
+	// count pixels of rgb floats to packed pixels
+	void apply(const float * rgb, uint32_t * pixels, int count) const;
+
+private:
+
+	static const int LUT_SIZE = 16384;
+
+	void build_lut();
+
+	double exposure;
+	double gamma;
+	int r_shift, g_shift, b_shift;
+	std::vector<uint8_t> lut; // tone curve output in [0, 1] over LUT_SIZE - 1 steps to gamma corrected 8 bits
+
+};
+
+#endif // _TONEMAP_H_
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include "Topology.h"
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+#include <atomic>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+// CPUs in the affinity mask of the process, empty if it's unknown
+static std::vector<int> allowed_cpus()
+{
+	std::vector<int> ids;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int id = 0; id < CPU_SETSIZE; ++id) {
+			if (CPU_ISSET(id, &set)) ids.push_back(id);
+		}
+	}
+#endif
+	return ids;
+}
+
+Topology::Topology()
+	: cores(0), nodes(0)
+{
+	if (!read_sys()) {
+		std::vector<int> ids = allowed_cpus();
+		if (ids.empty()) {
+			for (int i = 0; i < std::max((int)std::thread::hardware_concurrency(), 1); ++i) ids.push_back(i);
+		}
+		int count = (int)ids.size();
+		cpu_list.clear();
+		for (int i = 0; i < count; ++i) {
+			Cpu cpu = { ids[i], i, 0 };
+			cpu_list.push_back(cpu);
+		}
+		cores = count;
+		nodes = 1;
+	}
+}
+
+const Topology & Topology::get()
+{
+	static const Topology topology;
+	return topology;
+}
+
+// Kernel cpu list format, e.g. "0-7,16-23"
+static std::vector<int> parse_cpu_list(const std::string & text)
+{
+	std::vector<int> ids;
+	std::stringstream stream(text);
+	std::string range;
+	while (std::getline(stream, range, ',')) {
+		if (range.empty() || range[0] < '0' || range[0] > '9') continue;
+		size_t dash = range.find('-');
+		int first = std::stoi(range.substr(0, dash));
+		int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+		for (int id = first; id <= last; ++id) ids.push_back(id);
+	}
+	return ids;
+}
+
+static bool read_line(const std::string & path, std::string & line)
+{
+	std::ifstream file(path);
+	return file && std::getline(file, line);
+}
+
+bool Topology::read_sys()
+{
+#ifdef __linux__
+	std::string line;
+	if (!read_line("/sys/devices/system/cpu/online", line)) return false;
+	std::vector<int> ids = parse_cpu_list(line);
+	std::vector<int> allowed = allowed_cpus();
+	if (!allowed.empty()) {
+		std::vector<int> online;
+		online.swap(ids);
+		std::sort(online.begin(), online.end());
+		std::set_intersection(online.begin(), online.end(), allowed.begin(), allowed.end(), std::back_inserter(ids));
+	}
+	if (ids.empty()) return false;
+
+	// Node directories may be missing (no NUMA support) or numbered sparsely, nodes
+	// with none of the allowed CPUs are left out
+	std::map<int, int> cpu_node;
+	std::map<int, int> node_numbers;
+	if (DIR * dir = opendir("/sys/devices/system/node")) {
+		while (dirent * entry = readdir(dir)) {
+			std::string name = entry->d_name;
+			if (name.compare(0, 4, "node") != 0 || name.size() < 5 || name[4] < '0' || name[4] > '9') continue;
+			int node = std::stoi(name.substr(4));
+			if (!read_line("/sys/devices/system/node/" + name + "/cpulist", line)) continue;
+			std::vector<int> node_cpus = parse_cpu_list(line);
+			for (size_t i = 0; i < node_cpus.size(); ++i) {
+				if (!std::binary_search(ids.begin(), ids.end(), node_cpus[i])) continue;
+				cpu_node[node_cpus[i]] = node;
+				node_numbers[node] = 0;
+			}
+		}
+		closedir(dir);
+	}
+	int dense = 0;
+	for (auto & node : node_numbers) node.second = dense++;
+
+	std::map<std::pair<int, int>, int> core_numbers;
+	for (size_t i = 0; i < ids.size(); ++i) {
+		std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(ids[i]) + "/topology/";
+		int package = 0, core = ids[i];
+		if (read_line(base + "physical_package_id", line)) package = std::stoi(line);
+		if (read_line(base + "core_id", line)) core = std::stoi(line);
+		std::pair<int, int> key(package, core);
+		if (!core_numbers.count(key)) {
+			int number = (int)core_numbers.size();
+			core_numbers[key] = number;
+		}
+		Cpu cpu = { ids[i], core_numbers[key], cpu_node.count(ids[i]) ? node_numbers[cpu_node[ids[i]]] : 0 };
+		cpu_list.push_back(cpu);
+	}
+	cores = (int)core_numbers.size();
+	nodes = std::max(dense, 1);
+	return true;
+#else
+	return false;
+#endif
+}
+
+int Topology::threads_for(int threads_count) const
+{
+	return threads_count > 0 ? threads_count : (int)cpu_list.size();
+}
+
+std::vector<int> Topology::worker_cpus(int count) const
+{
+	// Per node, first hardware thread of every core, then the second ones and so on
+	std::vector<std::vector<int>> node_cpus(nodes);
+	std::vector<int> core_seen(cores, 0);
+	std::vector<int> rank(cpu_list.size());
+	for (size_t i = 0; i < cpu_list.size(); ++i) rank[i] = core_seen[cpu_list[i].core]++;
+	for (int r = 0; r < (int)cpu_list.size(); ++r) {
+		for (size_t i = 0; i < cpu_list.size(); ++i) {
+			if (rank[i] == r) node_cpus[cpu_list[i].node].push_back((int)i);
+		}
+	}
+
+	// Largest remainder split of the workers over nodes
+	std::vector<int> node_workers(nodes, 0);
+	std::vector<std::pair<double, int>> remainders;
+	int given = 0;
+	for (int n = 0; n < nodes; ++n) {
+		double share = (double)count * node_cpus[n].size() / cpu_list.size();
+		node_workers[n] = (int)share;
+		given += node_workers[n];
+		remainders.push_back(std::make_pair(share - node_workers[n], -n));
+	}
+	std::sort(remainders.rbegin(), remainders.rend());
+	for (int i = 0; given < count; ++i) {
+		int n = -remainders[i % nodes].second;
+		if (node_cpus[n].empty()) continue;
+		node_workers[n]++;
+		given++;
+	}
+
+	std::vector<int> result;
+	for (int n = 0; n < nodes; ++n) {
+		for (int w = 0; w < node_workers[n] && !node_cpus[n].empty(); ++w) {
+			result.push_back(node_cpus[n][w % node_cpus[n].size()]);
+		}
+	}
+	return result;
+}
+
+Topology::PinResult Topology::pin_current_thread(const Cpu & cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu.id, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? PinResult::PINNED : PinResult::FAILED;
+#else
+	return PinResult::UNSUPPORTED;
+#endif
+}
+
+Topology::PinResult Topology::pin_worker(const Cpu & cpu)
+{
+	static std::atomic<bool> reported(false);
+	PinResult result = pin_current_thread(cpu);
+	if (result == PinResult::FAILED && !reported.exchange(true)) {
+		std::cerr << "Topology::pin_worker() error : can't pin to CPU " << cpu.id << ", workers run unpinned" << std::endl;
+	}
+	return result;
+}
+
+void Topology::print(std::ostream & out) const
+{
+	out << "Topology : " << cpu_list.size() << " hardware threads, " << cores << " cores, " << nodes << " NUMA nodes" << std::endl;
+}
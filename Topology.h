@@ -0,0 +1,64 @@
+#pragma once
+
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <vector>
+#include <ostream>
+
+// Hardware threads the process may run on with their physical core and NUMA node, read from /sys
+// and the affinity mask on Linux, so taskset and cgroup cpusets shrink the list. Elsewhere, or if
+// /sys can't be read, every allowed hardware thread is a core of node 0.
+
+class Topology {
+
+public:
+
+	struct Cpu {
+		int id; // as the OS numbers it, for pinning
+		int core; // physical core, SMT siblings share it
+		int node; // NUMA node, 0 to nodes_count() - 1
+	};
+
+	// Detected once, on first use
+	static const Topology & get();
+
+	const std::vector<Cpu> & cpus() const { return cpu_list; }
+	int cores_count() const { return cores; }
+	int nodes_count() const { return nodes; }
+
+	// Threads for a threads_count setting, 0 means one per hardware thread
+	int threads_for(int threads_count) const;
+
+	// CPUs (indices into cpus()) for count workers. Nodes get workers in proportion to their
+	// hardware threads and a node's workers are consecutive; one thread of every core is used
+	// before SMT siblings. More workers than hardware threads wrap around.
+	std::vector<int> worker_cpus(int count) const;
+
+	enum class PinResult {
+		PINNED,
+		UNSUPPORTED, // no thread affinity on this platform
+		FAILED,
+	};
+
+	// Pins the calling thread to the CPU
+	static PinResult pin_current_thread(const Cpu & cpu);
+	// Same for a worker thread. A failure is reported once per process and the thread runs unpinned,
+	// its node's memory is then only preferred by first touch.
+	static PinResult pin_worker(const Cpu & cpu);
+
+	void print(std::ostream & out) const;
+
+private:
+
+	Topology();
+
+	bool read_sys();
+
+	std::vector<Cpu> cpu_list;
+	int cores;
+	int nodes;
+
+};
+
+#endif // _TOPOLOGY_H_
@@ -3,6 +3,13 @@
 #include <math.h>
 #include <memory>
 #include "Textures.h"
+#include "TextureProgram.h"
+#include "Statistics.h"
+#include "IrradianceCache.h"
+#include "EnvironmentMap.h"
+#include "Topology.h"
+#include <algorithm>
+#include <thread>
 
 Tracer::Tracer(const Configurer & config)
 {
@@ -16,8 +23,32 @@ Tracer::Tracer(const Configurer & config)
 	environment = [](Vec3 direction) {
 		return Vec3(0.0, 0.0, 0.0);
 	};
+	if (!config.environment_path.empty()) {
+		std::shared_ptr<EnvironmentMap> map = std::make_shared<EnvironmentMap>();
+		if (map->load(config.environment_path, config.environment_scale)) {
+			environment_map = map;
+			environment = [map](Vec3 direction) {
+				return map->radiance(direction);
+			};
+		}
+	}
 
 	this->bodies = config.bodies;
+	this->DIFFUSE_MIS = config.diffuse_mis;
+	this->FRESNEL = config.fresnel;
+	find_lights();
+
+	this->IRRADIANCE_RAY_COUNT = config.irradiance_ray_count;
+	if (config.irradiance_cache) {
+		irradiance_cache = std::make_shared<IrradianceCache>(config);
+	}
+
+	this->CAUSTIC_PHOTONS = config.caustic_photons;
+	this->CAUSTIC_RADIUS = config.caustic_radius;
+	this->CAUSTIC_THREADS = Topology::get().threads_for(config.threads_count);
+	if (CAUSTIC_PHOTONS > 0) {
+		build_caustics(CAUSTIC_THREADS);
+	}
 	
 }
 
@@ -25,44 +56,142 @@ Tracer::~Tracer()
 {
 }
 
+void Tracer::set_body(int body_number, const Body & body)
+{
+	bodies[body_number] = body;
+	find_lights();
+	// Cached light may come from the old body anywhere in the scene
+	if (irradiance_cache) irradiance_cache->clear();
+	if (caustics) build_caustics(CAUSTIC_THREADS);
+}
+
+void Tracer::replace_bodies(const std::vector<int> & body_numbers, const Configurer & config, int threads_count)
+{
+	if (body_numbers.empty()) return;
+	for (size_t i = 0; i < body_numbers.size(); ++i) {
+		bodies[body_numbers[i]] = config.bodies[body_numbers[i]];
+	}
+	find_lights();
+	if (irradiance_cache) irradiance_cache = std::make_shared<IrradianceCache>(config);
+	if (caustics) build_caustics(threads_count);
+}
+
 double Tracer::get_nearest_hit(Ray ray, int * body_number, Vec3 * hit, Vec3 * normal) const 
 {
-	double nearest_dist = -1.0, temp_dist = 0;
+	STAT_CAST();
 	if (body_number) *body_number = -1;
-	Vec3 temp_hit;
-	Vec3 temp_normal;
+	int nearest = -1;
+	Shape::Hit nearest_hit, candidate;
+	double tmax = INFINITY;
 
+	// Every candidate closer than the best so far shrinks the interval for the rest
 	for (int i = (int)bodies.size() - 1; i >= 0; --i) {
-		Shape::HitResult result = bodies[i].shape->first_hit(ray, &temp_hit, &temp_normal, &temp_dist);
-		if (result == Shape::HitResult::HIT_HIT && (temp_dist < nearest_dist || nearest_dist <= 0.0)) {
-			nearest_dist = temp_dist;
-			if (body_number) *body_number = i;
-			if (hit) *hit = temp_hit;
-			if (normal) *normal = temp_normal;
-			if (ray.direction.dot(temp_normal) > 0.0) break;
-		}
+		if (bodies[i].shape->intersect(ray, 0.0, tmax, candidate) != Shape::HitResult::HIT_HIT) continue;
+		nearest = i;
+		nearest_hit = candidate;
+		tmax = (candidate.t > 0.0) ? candidate.t : INFINITY;
+		if (candidate.exiting) break;
+	}
+
+	if (nearest == -1) {
+		return -1.0;
 	}
+	if (body_number) *body_number = nearest;
+	if (hit || normal) bodies[nearest].shape->attributes(ray, nearest_hit, hit, normal);
+	return nearest_hit.t;
+}
 
-	return nearest_dist;
+int Tracer::nearest_body(Ray ray, Vec3 * hit, Vec3 * normal) const
+{
+	int body_number = -1;
+	get_nearest_hit(ray, &body_number, hit, normal);
+	return body_number;
 }
 
 int Tracer::find_medium(Ray ray) const
 {
-	Vec3 normal;
+	STAT_CAST();
+	Shape::Hit hit;
 	for (int i = (int)bodies.size() - 1; i >= 0; --i) {
-		Shape::HitResult result = bodies[i].shape->first_hit(ray, nullptr, &normal, nullptr);
-		if (result == Shape::HitResult::HIT_HIT && ray.direction.dot(normal) > 0.0) {
+		Shape::HitResult result = bodies[i].shape->intersect(ray, 0.0, INFINITY, hit);
+		if (result == Shape::HitResult::HIT_HIT && hit.exiting) {
 			return i;
 		}
 	}
 	return -1;
 }
 
-static Vec3 reflection(Vec3 vec, Vec3 normal)
+Vec3 Tracer::reflection(Vec3 vec, Vec3 normal)
 {
 	return vec - normal * 2.0 * vec.dot(normal);
 }
 
+Vec3 Tracer::refraction(Vec3 vec, Vec3 normal, double current_index, double next_index)
+{
+	double c = - vec.dot(normal);
+	double r = current_index / next_index;
+	double s2 = r * r * (1.0 - c * c);
+	
+	if (s2 > 1.0) // reflection (critical angle)
+		return vec + normal * 2.0 * c;
+	else // refraction
+		return (vec * r + normal * (r*c - sqrt(1.0 - s2)*(c > 0.0 ? 1.0 : -1.0)));
+}
+
+// Reflectance of a dielectric interface for unpolarized light
+double Tracer::fresnel(Vec3 vec, Vec3 normal, double current_index, double next_index)
+{
+	double cos_i = fabs(vec.dot(normal));
+	double r = current_index / next_index;
+	double s2 = r * r * (1.0 - cos_i * cos_i);
+	if (s2 > 1.0) return 1.0; // total internal reflection
+
+	double cos_t = sqrt(1.0 - s2);
+	double rs = (current_index * cos_i - next_index * cos_t) / (current_index * cos_i + next_index * cos_t);
+	double rp = (current_index * cos_t - next_index * cos_i) / (current_index * cos_t + next_index * cos_i);
+	return 0.5 * (rs * rs + rp * rp);
+}
+
+Tracer::SpecularBranches Tracer::specular_branches(const Ray & ray, const SurfaceHit & surface, double u) const
+{
+	const Material & material = bodies[surface.body].material;
+	bool glass = FRESNEL && material.pure_reflective_color && material.refractive_color;
+	SpecularBranches branches;
+	branches.reflect = material.pure_reflective_color && ray.bounce + REFLECTIVE_BOUNCE_VALUE <= MAX_BOUNCE;
+	branches.refract = material.refractive_color && ray.bounce + REFRACTIVE_BOUNCE_VALUE <= MAX_BOUNCE;
+	branches.next_medium = -1;
+	if (!branches.refract && !glass) return branches;
+
+	branches.next_medium = find_medium(Ray(surface.position + ray.direction * BIAS, ray.direction));
+	double current_index = (surface.medium == -1) ? 1.0 : bodies[surface.medium].material.refraction_index;
+	double next_index = (branches.next_medium == -1) ? 1.0 : bodies[branches.next_medium].material.refraction_index;
+	branches.refracted_vec = refraction(ray.direction, surface.normal, current_index, next_index);
+
+	// One branch per ray, reflection is taken with probability of the reflectance, so the
+	// channel colors weight the reflected and transmitted parts of the light. A branch past
+	// its bounce limit gives way to the other one rather than losing the light.
+	if (glass) {
+		bool reflected = u < fresnel(ray.direction, surface.normal, current_index, next_index);
+		if (reflected ? !branches.reflect : !branches.refract) reflected = !reflected;
+		branches.reflect = branches.reflect && reflected;
+		branches.refract = branches.refract && !reflected;
+	}
+	return branches;
+}
+
+// Path of a ray continuing from a mirror or glass
+Ray::Path Tracer::specular_path(Ray::Path path, int body_number) const
+{
+	if (path == Ray::Path::PRIMARY) return path;
+	return caustic_caster(body_number) ? Ray::Path::CAUSTIC : Ray::Path::DIFFUSE;
+}
+
+// Glass bodies photons are shot at, light coming out of them towards diffuse surfaces is in the photon map
+bool Tracer::caustic_caster(int body_number) const
+{
+	return bodies[body_number].material.refractive_color && bodies[body_number].shape->bounded();
+}
+
 Vec3 perpendicular(const Vec3 & v) {
 	if (abs(v.x) >= abs(v.y) && abs(v.x) >= abs(v.z))
 		return Vec3(-(v.y + v.z) / v.x, 1.0, 1.0).normalized();
@@ -72,42 +201,575 @@ Vec3 perpendicular(const Vec3 & v) {
 		return Vec3(1.0, 1.0, -(v.x + v.y) / v.z).normalized();
 }
 
-Vec3 Tracer::trace(Ray ray) const
+Vec3 Tracer::trace(Ray ray, BodyMask * touched) const
 {
 	if (ray.bounce > MAX_BOUNCE) {
 		return Vec3(0.0, 0.0, 0.0);
 	}
+	return shade(ray, intersect(ray), touched);
+}
 
-	Vec3 color_sum = Vec3(0.0, 0.0, 0.0);
-	Vec3 normal, hit;
-	int nearest_body;
-	double nearest_dist = get_nearest_hit(ray, &nearest_body, &hit, &normal);
-	int current_medium = find_medium(ray);
+SurfaceHit Tracer::intersect(Ray ray) const
+{
+	SurfaceHit surface;
+	surface.distance = get_nearest_hit(ray, &surface.body, &surface.position, &surface.normal);
+	evaluate_surface(ray, surface);
+	return surface;
+}
 
-	if (nearest_body != -1) {
-		// BUMP MAPPING
-		if (bodies[nearest_body].material.bump_mapping) {
-			Vec3 p1 = perpendicular(normal);
-			Vec3 p2 = normal.cross(p1);
-			double h0 = bodies[nearest_body].material.bump_mapping(hit);
-			double h1 = bodies[nearest_body].material.bump_mapping(hit + p1 * BIAS);
-			double h2 = bodies[nearest_body].material.bump_mapping(hit + p2 * BIAS);
-			double d1 = h0 - h1;
-			double d2 = h0 - h2;
-			Vec3 v1 = (p1 * BIAS + normal * d1);
-			Vec3 v2 = (p2 * BIAS + normal * d2);
-
-			Vec3 css = v1.cross(v2) * 100000.0;
-			
-			Vec3 bump_normal = css.normalized();
-			if (ray.direction.dot(normal) * ray.direction.dot(bump_normal) > 0.0) {
-				normal = bump_normal;
-				
+void Tracer::evaluate_surface(const Ray & ray, SurfaceHit & surface) const
+{
+	surface.medium = find_medium(ray);
+
+	if (surface.body == -1) {
+		return;
+	}
+
+	const Material & material = bodies[surface.body].material;
+	TextureFootprintScope footprint(surface_footprint(ray, surface));
+	bump_map(ray, surface);
+	Vec3 hit = surface.position;
+	Vec3 normal = surface.normal;
+
+	// Only channels shade() is going to use at this bounce
+	if (material.light_source_color) {
+		STAT_TEXTURE(1);
+		surface.light_source = material.light_source_color(hit, normal);
+	}
+	if (material.simple_diffuse_color) {
+		STAT_TEXTURE(1);
+		surface.simple_diffuse = material.simple_diffuse_color(hit, normal);
+	}
+	if (material.diffuse_color && ray.bounce + DIFFUSE_BOUNCE_VALUE <= MAX_BOUNCE) {
+		STAT_TEXTURE(1);
+		surface.diffuse = material.diffuse_color(hit, normal);
+	}
+	if (material.pure_reflective_color && ray.bounce + REFLECTIVE_BOUNCE_VALUE <= MAX_BOUNCE) {
+		STAT_TEXTURE(1);
+		surface.pure_reflective = material.pure_reflective_color(hit, normal);
+	}
+	if (material.refractive_color && ray.bounce + REFRACTIVE_BOUNCE_VALUE <= MAX_BOUNCE) {
+		STAT_TEXTURE(1);
+		surface.refractive = material.refractive_color(hit, normal);
+	}
+}
+
+void Tracer::evaluate_surfaces(const std::vector<Ray> & rays, const std::vector<SurfaceHit *> & surfaces) const
+{
+	std::vector<double> footprints(rays.size());
+	for (size_t i = 0; i < rays.size(); ++i) {
+		surfaces[i]->medium = find_medium(rays[i]);
+		if (surfaces[i]->body == -1) continue;
+		footprints[i] = surface_footprint(rays[i], *surfaces[i]);
+		TextureFootprintScope footprint(footprints[i]);
+		bump_map(rays[i], *surfaces[i]);
+	}
+	if (surfaces.empty() || surfaces[0]->body == -1) {
+		return;
+	}
+
+	// Channels in the order of evaluate_surface(), with the bounce value that has to fit
+	const Material & material = bodies[surfaces[0]->body].material;
+	const std::function<Vec3(Vec3, Vec3)> * channels[] = { &material.light_source_color, &material.simple_diffuse_color,
+		&material.diffuse_color, &material.pure_reflective_color, &material.refractive_color };
+	Vec3 SurfaceHit::* values[] = { &SurfaceHit::light_source, &SurfaceHit::simple_diffuse,
+		&SurfaceHit::diffuse, &SurfaceHit::pure_reflective, &SurfaceHit::refractive };
+	const int bounce_values[] = { 0, 0, DIFFUSE_BOUNCE_VALUE, REFLECTIVE_BOUNCE_VALUE, REFRACTIVE_BOUNCE_VALUE };
+
+	std::vector<size_t> lanes;
+	std::vector<Vec3> points, normals, colors;
+	std::vector<double> lane_footprints;
+	for (int c = 0; c < 5; ++c) {
+		if (!*channels[c]) continue;
+		lanes.clear();
+		for (size_t i = 0; i < rays.size(); ++i) {
+			if (bounce_values[c] == 0 || rays[i].bounce + bounce_values[c] <= MAX_BOUNCE) lanes.push_back(i);
+		}
+		STAT_TEXTURE(lanes.size());
+
+		const TextureChannel * texture = channels[c]->target<TextureChannel>();
+		if (!texture) {
+			for (size_t k = 0; k < lanes.size(); ++k) {
+				SurfaceHit & surface = *surfaces[lanes[k]];
+				TextureFootprintScope footprint(footprints[lanes[k]]);
+				surface.*values[c] = (*channels[c])(surface.position, surface.normal);
 			}
+			continue;
+		}
+
+		points.resize(lanes.size());
+		normals.resize(lanes.size());
+		colors.resize(lanes.size());
+		lane_footprints.resize(lanes.size());
+		for (size_t k = 0; k < lanes.size(); ++k) {
+			points[k] = surfaces[lanes[k]]->position;
+			normals[k] = surfaces[lanes[k]]->normal;
+			lane_footprints[k] = footprints[lanes[k]];
+		}
+		texture->program->evaluate(points.data(), normals.data(), lane_footprints.data(), colors.data(), (int)lanes.size());
+		for (size_t k = 0; k < lanes.size(); ++k) {
+			surfaces[lanes[k]]->*values[c] = colors[k];
+		}
+	}
+}
+
+void Tracer::intersect(const std::vector<Ray> & rays, std::vector<SurfaceHit> & surfaces) const
+{
+	surfaces.assign(rays.size(), SurfaceHit());
+	std::vector<std::pair<int, size_t>> order(rays.size());
+	for (size_t i = 0; i < rays.size(); ++i) {
+		SurfaceHit & surface = surfaces[i];
+		surface.distance = get_nearest_hit(rays[i], &surface.body, &surface.position, &surface.normal);
+		order[i] = std::make_pair(surface.body, i);
+	}
+
+	std::sort(order.begin(), order.end());
+	std::vector<Ray> body_rays;
+	std::vector<SurfaceHit *> body_surfaces;
+	for (size_t k = 0; k < order.size(); k += body_rays.size()) {
+		body_rays.clear();
+		body_surfaces.clear();
+		for (size_t j = k; j < order.size() && order[j].first == order[k].first; ++j) {
+			body_rays.push_back(rays[order[j].second]);
+			body_surfaces.push_back(&surfaces[order[j].second]);
+		}
+		evaluate_surfaces(body_rays, body_surfaces);
+	}
+}
+
+double Tracer::surface_footprint(const Ray & ray, const SurfaceHit & surface) const
+{
+	// Cone cross section stretches on surfaces seen at an angle, by 1 / cos along one axis.
+	// Textures filter isotropically, the geometric mean of both axes keeps them from blurring much.
+	double cos_incidence = std::max(fabs(ray.direction.dot(surface.normal)), 0.01);
+	return ray.footprint(surface.distance) / sqrt(cos_incidence);
+}
+
+void Tracer::bump_map(const Ray & ray, SurfaceHit & surface) const
+{
+	const Material & material = bodies[surface.body].material;
+	Vec3 hit = surface.position;
+	Vec3 normal = surface.normal;
+
+	// BUMP MAPPING
+	if (material.bump_mapping) {
+		STAT_TEXTURE(3);
+		Vec3 p1 = perpendicular(normal);
+		Vec3 p2 = normal.cross(p1);
+		double h0 = material.bump_mapping(hit);
+		double h1 = material.bump_mapping(hit + p1 * BIAS);
+		double h2 = material.bump_mapping(hit + p2 * BIAS);
+		double d1 = h0 - h1;
+		double d2 = h0 - h2;
+		Vec3 v1 = (p1 * BIAS + normal * d1);
+		Vec3 v2 = (p2 * BIAS + normal * d2);
+
+		Vec3 css = v1.cross(v2) * 100000.0;
+		
+		Vec3 bump_normal = css.normalized();
+		if (ray.direction.dot(normal) * ray.direction.dot(bump_normal) > 0.0) {
+			normal = bump_normal;
 		}
+	}
+	surface.normal = normal;
+}
+
+// Shoots photons from every light towards every caustic caster, photons that get through it
+// (and possibly more mirrors and glass) onto a diffuse surface are stored for shade()
+void Tracer::build_caustics(int threads_count)
+{
+	std::vector<std::pair<int, int>> pairs;
+	for (size_t light = 0; light < bodies.size(); ++light) {
+		if (!bodies[light].material.light_source_color || !bodies[light].shape->bounded()) continue;
+		for (size_t target = 0; target < bodies.size(); ++target) {
+			if (target == light || !caustic_caster((int)target)) continue;
+			pairs.push_back(std::make_pair((int)light, (int)target));
+		}
+	}
+
+	std::vector<std::vector<PhotonMap::Photon>> lists(threads_count);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threads_count; ++t) {
+		threads.push_back(std::thread([this, &pairs, &lists, t, threads_count]() {
+			std::mt19937 rng(t + 1);
+			std::uniform_real_distribution<double> uniform(0.0, 1.0);
+			for (size_t p = 0; p < pairs.size(); ++p) {
+				const Shape & light = *bodies[pairs[p].first].shape;
+				const Shape & target = *bodies[pairs[p].second].shape;
+				for (int i = t; i < CAUSTIC_PHOTONS; i += threads_count) {
+					// Point on the light hemisphere facing the target
+					double z = 2.0 * uniform(rng) - 1.0;
+					double phi = 2.0 * M_PI * uniform(rng);
+					Vec3 light_normal = Vec3(sqrt(1.0 - z*z) * cos(phi), sqrt(1.0 - z*z) * sin(phi), z);
+					if (light_normal.dot(target.center - light.center) < 0.0) light_normal = -light_normal;
+					Vec3 origin = light.center + light_normal * light.radius;
+
+					// Direction in the cone the target bounding sphere takes
+					Vec3 axis = target.center - origin;
+					double d = axis.length();
+					if (d <= target.radius) continue;
+					axis = axis / d;
+					double cos_max = sqrt(1.0 - target.radius * target.radius / (d * d));
+					double cos_theta = 1.0 - uniform(rng) * (1.0 - cos_max);
+					double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+					double alpha = 2.0 * M_PI * uniform(rng);
+					Vec3 per1 = perpendicular(axis);
+					Vec3 per2 = axis.cross(per1);
+					Vec3 direction = axis * cos_theta + per1 * sin_theta * sin(alpha) + per2 * sin_theta * cos(alpha);
+					double lambert = direction.dot(light_normal);
+					if (lambert <= 0.0) continue;
+
+					// Radiance times projected area of the hemisphere times cone solid angle, over photons count
+					Vec3 power = bodies[pairs[p].first].material.light_source_color(origin, light_normal)
+						* lambert * (2.0 * M_PI * light.radius * light.radius) * (2.0 * M_PI * (1.0 - cos_max)) / CAUSTIC_PHOTONS;
+					trace_photon(Ray(origin + direction * BIAS, direction), power, pairs[p].first, pairs[p].second, rng, lists[t]);
+				}
+			}
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+
+	caustics = std::make_shared<PhotonMap>(CAUSTIC_RADIUS);
+	caustics->build(lists);
+}
+
+void Tracer::trace_photon(Ray ray, Vec3 power, int light, int target, std::mt19937 & rng, std::vector<PhotonMap::Photon> & photons) const
+{
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	BodyMask path = body_bit(light);
+	bool specular = false;
+
+	for (int step = 0; step <= MAX_BOUNCE; ++step) {
+		SurfaceHit surface = intersect(ray);
+		// Photons that don't go through the target first are direct light, shade() handles that
+		if (surface.body == -1 || (step == 0 && surface.body != target)) return;
+		path |= body_bit(surface.body);
+		if (surface.medium != -1) {
+			path |= body_bit(surface.medium);
+			power = power * (bodies[surface.medium].material.refraction_density * surface.distance).exp();
+		}
+		const Material & material = bodies[surface.body].material;
+
+		// Light arriving at a diffuse surface, shading multiplies it by the diffuse color later
+		if (specular && (material.diffuse_color || material.simple_diffuse_color)) {
+			PhotonMap::Photon photon;
+			photon.position = surface.position;
+			photon.direction = ray.direction;
+			photon.power = power;
+			photon.touched = path;
+			photons.push_back(photon);
+		}
+		if (material.light_source_color) return;
+
+		// Same branches as an eye ray would take, Fresnel glass already picked one of them. Russian
+		// roulette between those left, weighted by their average color, eye rays trace them all.
+		SpecularBranches branches = specular_branches(ray, surface, uniform(rng));
+		double p_reflect = branches.reflect ? (surface.pure_reflective.r + surface.pure_reflective.g + surface.pure_reflective.b) / 3.0 : 0.0;
+		double p_refract = branches.refract ? (surface.refractive.r + surface.refractive.g + surface.refractive.b) / 3.0 : 0.0;
+		double scale = std::max(1.0, p_reflect + p_refract);
+		double u = uniform(rng) * scale;
+
+		Vec3 direction;
+		int bounce;
+		if (u < p_reflect) {
+			direction = reflection(ray.direction, surface.normal);
+			power = power * surface.pure_reflective * (scale / p_reflect);
+			bounce = ray.bounce + REFLECTIVE_BOUNCE_VALUE;
+		}
+		else if (u < p_reflect + p_refract) {
+			direction = branches.refracted_vec;
+			power = power * surface.refractive * (scale / p_refract);
+			bounce = ray.bounce + REFRACTIVE_BOUNCE_VALUE;
+		}
+		else {
+			return; // absorbed
+		}
+		specular = true;
+		ray = Ray(surface.position + direction * BIAS, direction, bounce);
+	}
+}
+
+Vec3 Tracer::diffuse_light(const Ray & ray, Vec3 hit, Vec3 normal, int ray_count, BodyMask * touched, Vec3 * gradients, double * harmonic_distance) const
+{
+	Vec3 color_part = Vec3(0.0, 0.0, 0.0);
+	double inverse_distance_sum = 0.0;
+	int distance_count = 0;
+	if (gradients) gradients[0] = gradients[1] = gradients[2] = Vec3(0.0, 0.0, 0.0);
+
+	for (size_t dst_body_number = 0; dst_body_number < bodies.size(); ++dst_body_number) {
+		// Solid angle
+		double r = bodies[dst_body_number].shape->radius;
+		double d = (bodies[dst_body_number].shape->center - hit).length();
+		double hemi_part = (r > d) ? 1.0 : 1.0 - sqrt(1.0 - r*r / (d*d));
+		
+		// Build base vector depending on where the object is (everywhere or on shadowvec direction)
+		Vec3 base_vec = (hemi_part == 1.0) ? normal : (bodies[dst_body_number].shape->center - hit).normalized();
+		// Vector basis
+		Vec3 per1 = perpendicular(base_vec);
+		Vec3 per2 = base_vec.cross(per1);
+	
+		// Rays that reach the body keep their hit and are shaded together after the loop,
+		// so its texture programs run once for all of them
+		std::vector<Ray> diffuse_rays;
+		std::vector<SurfaceHit> diffuse_hits;
+		diffuse_rays.reserve(ray_count);
+		diffuse_hits.reserve(ray_count);
+		for (int i = 0; i < ray_count; ++i) {
+			// Random vector to an object
+			double cos_phi = 1.0 - ((double)rand() / RAND_MAX) * hemi_part;
+			double sin_phi = sqrt(1.0 - cos_phi*cos_phi);
+			double alpha = 2.0 * M_PI * rand() / RAND_MAX;
+			Vec3 shifted_vec = base_vec * cos_phi + per1 * sin_phi * sin(alpha) + per2 * sin_phi * cos(alpha);
+			if (shifted_vec.dot(normal) > 0.0) {
+				STAT_RAY(DIFFUSE);
+				Ray diffuse_ray = Ray(hit + shifted_vec * BIAS, shifted_vec, ray.bounce + DIFFUSE_BOUNCE_VALUE, Ray::Path::DIFFUSE);
+				SurfaceHit surface;
+				surface.distance = get_nearest_hit(diffuse_ray, &surface.body, &surface.position, &surface.normal);
+				if (touched && surface.body != -1) *touched |= body_bit(surface.body);
+				if (harmonic_distance && surface.distance > 0.0) {
+					inverse_distance_sum += 1.0 / surface.distance;
+					distance_count++;
+				}
+				// Past the bounce limit trace() would give no light
+				if (surface.body == (int)dst_body_number && diffuse_ray.bounce <= MAX_BOUNCE) {
+					// Each ray stands for its share of the cone towards the body
+					diffuse_ray.with_cone(ray.footprint((hit - ray.origin).length()), sqrt(2.0 * M_PI * hemi_part / ray_count));
+					diffuse_rays.push_back(diffuse_ray);
+					diffuse_hits.push_back(surface);
+				}
+			}
+		}
+
+		std::vector<SurfaceHit *> surfaces(diffuse_hits.size());
+		for (size_t k = 0; k < diffuse_hits.size(); ++k) surfaces[k] = &diffuse_hits[k];
+		if (!surfaces.empty()) evaluate_surfaces(diffuse_rays, surfaces);
+
+		Vec3 color_object_part = Vec3(0.0, 0.0, 0.0);
+		for (size_t k = 0; k < diffuse_rays.size(); ++k) {
+			Vec3 light = shade(diffuse_rays[k], diffuse_hits[k], touched);
+			color_object_part = color_object_part + light;
+			if (gradients && diffuse_hits[k].distance > 0.0) {
+				// Moving towards a surface makes it cover more of the hemisphere, the closer it is the faster
+				Vec3 shifted_vec = diffuse_rays[k].direction;
+				Vec3 tangent = (shifted_vec - normal * shifted_vec.dot(normal)) * (hemi_part / ray_count / diffuse_hits[k].distance);
+				gradients[0] = gradients[0] + tangent * light.r;
+				gradients[1] = gradients[1] + tangent * light.g;
+				gradients[2] = gradients[2] + tangent * light.b;
+			}
+		}
+		color_part = color_part + color_object_part * hemi_part / ray_count;
+	}
+	if (environment_map) {
+		color_part = color_part + environment_light(hit, normal, ray_count, false, touched);
+	}
+
+	if (harmonic_distance) {
+		*harmonic_distance = (inverse_distance_sum > 0.0) ? distance_count / inverse_distance_sum : 1e9;
+	}
+	return color_part;
+}
+
+Vec3 Tracer::environment_light(Vec3 hit, Vec3 normal, int ray_count, bool lambert, BodyMask * touched) const
+{
+	Vec3 color_part = Vec3(0.0, 0.0, 0.0);
+	for (int i = 0; i < ray_count; ++i) {
+		double sky_pdf;
+		Vec3 sky_vec = environment_map->sample((double)rand() / RAND_MAX, (double)rand() / RAND_MAX, &sky_pdf);
+		double cos_phi = sky_vec.dot(normal);
+		if (cos_phi <= 0.0 || sky_pdf <= 0.0) continue;
+
+		int dst_nearest_number = -1;
+		STAT_RAY(SHADOW);
+		get_nearest_hit(Ray(hit + sky_vec * BIAS, sky_vec), &dst_nearest_number);
+		if (dst_nearest_number != -1) {
+			if (touched) *touched |= body_bit(dst_nearest_number);
+			continue;
+		}
+		color_part = color_part + environment_map->radiance(sky_vec) * ((lambert ? cos_phi : 1.0) / (2.0 * M_PI * sky_pdf));
+	}
+	return color_part / ray_count;
+}
+
+Vec3 Tracer::caustic_light(Vec3 hit, Vec3 normal, BodyMask * touched) const
+{
+	if (DIFFUSE_MIS && !irradiance_cache) {
+		// sampled_diffuse_light() estimates the integral of L cos over pi, that is irradiance over pi
+		return caustics->irradiance(hit, normal, false, touched) / M_PI;
+	}
+	// Hemisphere fractions of diffuse_light() integrate L over the solid angle, divided by 2 pi
+	return caustics->irradiance(hit, normal, true, touched) / (2.0 * M_PI);
+}
+
+Vec3 Tracer::cached_diffuse_light(const Ray & ray, Vec3 hit, Vec3 normal, BodyMask * touched) const
+{
+	Vec3 color_part;
+	BodyMask cached_touched = 0;
+	if (irradiance_cache->lookup(hit, normal, ray.bounce, color_part, cached_touched)) {
+		if (touched) *touched |= cached_touched;
+		return color_part;
+	}
+
+	// New record, it is reused by many pixels so it gets more rays
+	IrradianceCache::Record record;
+	Vec3 gradients[3];
+	record.touched = 0;
+	record.bounce = ray.bounce;
+	record.irradiance = diffuse_light(ray, hit, normal, IRRADIANCE_RAY_COUNT, &record.touched, gradients, &record.radius);
+	record.position = hit;
+	record.normal = normal;
+	record.gradient_r = gradients[0];
+	record.gradient_g = gradients[1];
+	record.gradient_b = gradients[2];
+	irradiance_cache->insert(record);
+	if (touched) *touched |= record.touched;
+	return record.irradiance;
+}
+
+void Tracer::find_lights()
+{
+	lights.clear();
+	for (size_t i = 0; i < bodies.size(); ++i) {
+		if (bodies[i].material.light_source_color && bodies[i].shape->bounded()) {
+			lights.push_back((int)i);
+		}
+	}
+}
+
+// Lights sampled from a hit, each picked in proportion to its cone so that all directions of a cone
+// get the same density 1 / (2 pi hemi_sum). Overlapping cones add up.
+double Tracer::light_pdf(const std::vector<LightCone> & cones, double hemi_sum, Vec3 direction) const
+{
+	int count = 0;
+	for (size_t i = 0; i < cones.size(); ++i) {
+		if (direction.dot(cones[i].axis) >= 1.0 - cones[i].hemi_part) count++;
+	}
+	return count / (2.0 * M_PI * hemi_sum);
+}
+
+static bool sampled_light(const std::vector<Tracer::LightCone> & cones, int body_number)
+{
+	for (size_t i = 0; i < cones.size(); ++i) {
+		if (cones[i].body == body_number) return true;
+	}
+	return false;
+}
+
+Vec3 Tracer::sampled_diffuse_light(const Ray & ray, Vec3 hit, Vec3 normal, BodyMask * touched) const
+{
+	// Lights whose bounding sphere does not contain the hit, the others are only found by BSDF rays.
+	// Local, shade() of the BSDF rays below comes back here with its own list.
+	std::vector<LightCone> cones;
+	cones.reserve(lights.size());
+	double hemi_sum = 0.0;
+	for (size_t i = 0; i < lights.size(); ++i) {
+		const Shape & shape = *bodies[lights[i]].shape;
+		double r = shape.radius;
+		double d = (shape.center - hit).length();
+		if (r >= d) continue;
+		LightCone cone;
+		cone.body = lights[i];
+		cone.axis = (shape.center - hit) / d;
+		cone.hemi_part = 1.0 - sqrt(1.0 - r*r / (d*d));
+		cones.push_back(cone);
+		hemi_sum += cone.hemi_part;
+	}
+
+	Vec3 per1 = perpendicular(normal);
+	Vec3 per2 = normal.cross(per1);
+	Vec3 color_part = Vec3(0.0, 0.0, 0.0);
+	// Both estimators weight lights by the balance heuristic, bsdf_pdf / (bsdf_pdf + light_pdf)
+	for (int i = 0; i < DIFFUSE_RAY_COUNT; ++i) {
+		// BSDF SAMPLE, cosine weighted so the lambert term cancels out
+		double cos_phi = sqrt((double)rand() / RAND_MAX);
+		double sin_phi = sqrt(1.0 - cos_phi*cos_phi);
+		double alpha = 2.0 * M_PI * rand() / RAND_MAX;
+		Vec3 bsdf_vec = normal * cos_phi + per1 * sin_phi * sin(alpha) + per2 * sin_phi * cos(alpha);
+		Ray bsdf_ray = Ray(hit + bsdf_vec * BIAS, bsdf_vec, ray.bounce + DIFFUSE_BOUNCE_VALUE, Ray::Path::DIFFUSE);
+		bsdf_ray.with_cone(ray.footprint((hit - ray.origin).length()), sqrt(2.0 * M_PI / DIFFUSE_RAY_COUNT));
+		STAT_RAY(DIFFUSE);
+		SurfaceHit surface = intersect(bsdf_ray);
+		if (surface.body == -1 && environment_map) {
+			double bsdf_pdf = cos_phi / M_PI;
+			color_part = color_part + environment(bsdf_vec) * (bsdf_pdf / (bsdf_pdf + environment_map->pdf(bsdf_vec)));
+		}
+		else {
+			if (surface.body != -1 && sampled_light(cones, surface.body)) {
+				double bsdf_pdf = cos_phi / M_PI;
+				color_part = color_part + surface.light_source * (bsdf_pdf / (bsdf_pdf + light_pdf(cones, hemi_sum, bsdf_vec)));
+				surface.light_source = Vec3(0.0, 0.0, 0.0);
+			}
+			color_part = color_part + shade(bsdf_ray, surface, touched);
+		}
+
+		// ENVIRONMENT SAMPLE
+		if (environment_map) {
+			double sky_pdf;
+			Vec3 sky_vec = environment_map->sample((double)rand() / RAND_MAX, (double)rand() / RAND_MAX, &sky_pdf);
+			double lambert = sky_vec.dot(normal);
+			if (lambert > 0.0 && sky_pdf > 0.0) {
+				int dst_nearest_number = -1;
+				STAT_RAY(SHADOW);
+				get_nearest_hit(Ray(hit + sky_vec * BIAS, sky_vec), &dst_nearest_number);
+				if (touched && dst_nearest_number != -1) *touched |= body_bit(dst_nearest_number);
+				if (dst_nearest_number == -1) {
+					double bsdf_pdf = lambert / M_PI;
+					color_part = color_part + environment_map->radiance(sky_vec) * (bsdf_pdf / (bsdf_pdf + sky_pdf));
+				}
+			}
+		}
+
+		// LIGHT SAMPLE
+		if (cones.empty()) continue;
+		double pick = hemi_sum * rand() / RAND_MAX;
+		size_t c = 0;
+		while (c + 1 < cones.size() && pick > cones[c].hemi_part) {
+			pick -= cones[c].hemi_part;
+			++c;
+		}
+		Vec3 light_per1 = perpendicular(cones[c].axis);
+		Vec3 light_per2 = cones[c].axis.cross(light_per1);
+		double cos_theta = 1.0 - ((double)rand() / RAND_MAX) * cones[c].hemi_part;
+		double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+		double beta = 2.0 * M_PI * rand() / RAND_MAX;
+		Vec3 light_vec = cones[c].axis * cos_theta + light_per1 * sin_theta * sin(beta) + light_per2 * sin_theta * cos(beta);
+		double lambert = light_vec.dot(normal);
+		if (lambert <= 0.0) continue;
+
+		int dst_nearest_number = -1;
+		Vec3 dst_hit, dst_normal;
+		STAT_RAY(SHADOW);
+		get_nearest_hit(Ray(hit + light_vec * BIAS, light_vec), &dst_nearest_number, &dst_hit, &dst_normal);
+		if (touched && dst_nearest_number != -1) *touched |= body_bit(dst_nearest_number);
+		if (dst_nearest_number != -1 && sampled_light(cones, dst_nearest_number)) {
+			double bsdf_pdf = lambert / M_PI;
+			STAT_TEXTURE(1);
+			color_part = color_part + bodies[dst_nearest_number].material.light_source_color(dst_hit, dst_normal)
+				* (bsdf_pdf / (bsdf_pdf + light_pdf(cones, hemi_sum, light_vec)));
+		}
+	}
+	return color_part / DIFFUSE_RAY_COUNT;
+}
+
+Vec3 Tracer::shade(Ray ray, const SurfaceHit & surface, BodyMask * touched) const
+{
+	STAT_BOUNCE(ray.bounce);
+
+	Vec3 color_sum = Vec3(0.0, 0.0, 0.0);
+	int nearest_body = surface.body;
+	int current_medium = surface.medium;
+	double nearest_dist = surface.distance;
+	Vec3 hit = surface.position;
+	Vec3 normal = surface.normal;
+	if (touched) {
+		if (nearest_body != -1) *touched |= body_bit(nearest_body);
+		if (current_medium != -1) *touched |= body_bit(current_medium);
+	}
+
+	if (nearest_body != -1) {
 		// LIGHT SOURCE
-		if (bodies[nearest_body].material.light_source_color) {
-			color_sum = color_sum + bodies[nearest_body].material.light_source_color(hit, normal);
+		// Photon map carries light that reaches diffuse surfaces through caustic casters
+		if (bodies[nearest_body].material.light_source_color && !(caustics && ray.path == Ray::Path::CAUSTIC)) {
+			color_sum = color_sum + surface.light_source;
 		}
 		// SIMPLE DIFFUSE
 		if (bodies[nearest_body].material.simple_diffuse_color) {
@@ -120,73 +782,56 @@ Vec3 Tracer::trace(Ray ray) const
 
 					int dst_nearest_number = -1;
 					Vec3 dst_hit, dst_normal;
+					STAT_RAY(SHADOW);
 					get_nearest_hit(Ray(hit + shadow_vec * BIAS, shadow_vec), &dst_nearest_number, &dst_hit, &dst_normal);
+					// Light or its occluder
+					if (touched && dst_nearest_number != -1) *touched |= body_bit(dst_nearest_number);
 					if (dst_nearest_number == dst_body_number && shadow_vec.dot(normal) > 0.0) {
 						double lambert = shadow_vec.dot(normal);
+						STAT_TEXTURE(1);
 						// TODO: remove 2.0
-						color_sum = color_sum + bodies[nearest_body].material.simple_diffuse_color(hit, normal) * bodies[dst_body_number].material.light_source_color(dst_hit, dst_normal) * hemi_part * lambert;
+						color_sum = color_sum + surface.simple_diffuse * bodies[dst_body_number].material.light_source_color(dst_hit, dst_normal) * hemi_part * lambert;
 					}
 				}
 			}
+			if (environment_map) {
+				color_sum = color_sum + surface.simple_diffuse * environment_light(hit, normal, 1, true, touched);
+			}
 		}
 		// DIFFUSE
 		if (bodies[nearest_body].material.diffuse_color && ray.bounce + DIFFUSE_BOUNCE_VALUE <= MAX_BOUNCE) {
-			//TODO: enviroment diffuse
-			Vec3 color_part = Vec3(0.0, 0.0, 0.0);
-			for (size_t dst_body_number = 0; dst_body_number < bodies.size(); ++dst_body_number) {
-				// Solid angle
-				double r = bodies[dst_body_number].shape->radius;
-				double d = (bodies[dst_body_number].shape->center - hit).length();
-				double hemi_part = (r > d) ? 1.0 : 1.0 - sqrt(1.0 - r*r / (d*d));
-				
-				// Build base vector depending on where the object is (everywhere or on shadowvec direction)
-				Vec3 base_vec = (hemi_part == 1.0) ? normal : (bodies[dst_body_number].shape->center - hit).normalized();
-				// Vector basis
-				Vec3 per1 = perpendicular(base_vec);
-				Vec3 per2 = base_vec.cross(per1);
-			
-				Vec3 color_object_part = Vec3(0.0, 0.0, 0.0);
-				for (int i = 0; i < DIFFUSE_RAY_COUNT; ++i) {
-					// Random vector to an object
-					double cos_phi = 1.0 - ((double)rand() / RAND_MAX) * hemi_part;
-					double sin_phi = sqrt(1.0 - cos_phi*cos_phi);
-					double alpha = 2.0 * M_PI * rand() / RAND_MAX;
-					Vec3 shifted_vec = base_vec * cos_phi + per1 * sin_phi * sin(alpha) + per2 * sin_phi * cos(alpha);
-					if (shifted_vec.dot(normal) > 0.0) {
-						int dst_nearest_number = -1;
-						get_nearest_hit(Ray(hit + shifted_vec * BIAS, shifted_vec), &dst_nearest_number, nullptr, nullptr);
-						if (dst_nearest_number == dst_body_number) {
-							color_object_part = color_object_part + trace(Ray(hit + shifted_vec * BIAS, shifted_vec, ray.bounce + DIFFUSE_BOUNCE_VALUE));
-						}
-					}
-				}
-				color_part = color_part + color_object_part * hemi_part / DIFFUSE_RAY_COUNT;
+			Vec3 color_part;
+			if (irradiance_cache) {
+				color_part = cached_diffuse_light(ray, hit, normal, touched);
+			}
+			else if (DIFFUSE_MIS) {
+				color_part = sampled_diffuse_light(ray, hit, normal, touched);
+			}
+			else {
+				color_part = diffuse_light(ray, hit, normal, DIFFUSE_RAY_COUNT, touched);
+			}
+			if (caustics) {
+				color_part = color_part + caustic_light(hit, normal, touched);
 			}
-			color_sum = color_sum + color_part * bodies[nearest_body].material.diffuse_color(hit, normal);
+			color_sum = color_sum + color_part * surface.diffuse;
 		}
+		SpecularBranches branches = specular_branches(ray, surface, (double)rand() / RAND_MAX);
+		if (touched && branches.next_medium != -1) *touched |= body_bit(branches.next_medium);
 		// PURE REFLECTIVE
-		if (bodies[nearest_body].material.pure_reflective_color && ray.bounce + REFLECTIVE_BOUNCE_VALUE <= MAX_BOUNCE) {
+		if (branches.reflect) {
 			Vec3 reflected_vec = reflection(ray.direction, normal);
-			color_sum = color_sum + trace(Ray(hit + reflected_vec * BIAS, reflected_vec, ray.bounce + REFLECTIVE_BOUNCE_VALUE)) * bodies[nearest_body].material.pure_reflective_color(hit, normal);
+			STAT_RAY(REFLECTIVE);
+			Ray reflected_ray = Ray(hit + reflected_vec * BIAS, reflected_vec, ray.bounce + REFLECTIVE_BOUNCE_VALUE, specular_path(ray.path, nearest_body));
+			// Flat mirror, the cone keeps spreading as before; curvature isn't accounted for
+			reflected_ray.with_cone(ray.footprint(surface.distance), ray.cone_spread);
+			color_sum = color_sum + trace(reflected_ray, touched) * surface.pure_reflective;
 		}
 		// REFRACTIVE
-		if (bodies[nearest_body].material.refractive_color && ray.bounce + REFRACTIVE_BOUNCE_VALUE <= MAX_BOUNCE) {
-			Vec3 refracted_vec = ray.direction;
-			
-			int next_medium = find_medium(Ray(hit + ray.direction * BIAS, ray.direction));
-			
-			double current_index = (current_medium == -1) ? 1.0 : bodies[current_medium].material.refraction_index;
-			double next_index = (next_medium == -1) ? 1.0 : bodies[next_medium].material.refraction_index;
-			double c = - ray.direction.dot(normal);
-			double r = current_index / next_index;
-			double s2 = r * r * (1.0 - c * c);
-			
-			if (s2 > 1.0) // reflection (critical angle)
-				refracted_vec = ray.direction + normal * 2.0 * c;
-			else // refraction
-				refracted_vec = (ray.direction * r + normal * (r*c - sqrt(1.0 - s2)*(c > 0.0 ? 1.0 : -1.0)));
-			// TODO: fresnel
-			color_sum = color_sum + trace(Ray(hit + refracted_vec * BIAS, refracted_vec, ray.bounce + REFRACTIVE_BOUNCE_VALUE)) * bodies[nearest_body].material.refractive_color(hit, normal);
+		if (branches.refract) {
+			STAT_RAY(REFRACTIVE);
+			Ray refracted_ray = Ray(hit + branches.refracted_vec * BIAS, branches.refracted_vec, ray.bounce + REFRACTIVE_BOUNCE_VALUE, specular_path(ray.path, nearest_body));
+			refracted_ray.with_cone(ray.footprint(surface.distance), ray.cone_spread);
+			color_sum = color_sum + trace(refracted_ray, touched) * surface.refractive;
 		}
 	}
 	else { // No object intersection
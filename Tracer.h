@@ -4,9 +4,35 @@
 #define _TRACER_H_
 
 #include <vector>
+#include <memory>
+#include <random>
 #include "Configurer.h"
 #include "Body.h"
 #include "Ray.h"
+#include "PhotonMap.h"
+
+class IrradianceCache;
+class EnvironmentMap;
+
+// Some unit vector perpendicular to v
+Vec3 perpendicular(const Vec3 & v);
+
+// Nearest hit of a ray with everything shading needs, see Tracer::intersect()
+struct SurfaceHit {
+	int body; // -1 if nothing was hit
+	int medium; // body the ray travels through, -1 for vacuum
+	double distance;
+	Vec3 position;
+	Vec3 normal; // bump mapped
+	// Material channels evaluated at the hit
+	Vec3 light_source;
+	Vec3 simple_diffuse;
+	Vec3 diffuse;
+	Vec3 pure_reflective;
+	Vec3 refractive;
+
+	SurfaceHit() : body(-1), medium(-1), distance(-1.0) {}
+};
 
 class Tracer {
 
@@ -14,21 +40,103 @@ public:
 	
 	Tracer(const Configurer & config);
 	~Tracer();
-	Vec3 trace(Ray ray) const;
+	Vec3 trace(Ray ray, BodyMask * touched = nullptr) const;
+
+	// trace() split in two, so the first part of camera rays can be cached
+	SurfaceHit intersect(Ray ray) const;
+	// Second half of intersect(), fills medium, bump mapped normal and material channels of a hit
+	// that has body, position, normal and distance set
+	void evaluate_surface(const Ray & ray, SurfaceHit & surface) const;
+	// evaluate_surface() of hits that are all on the same body, texture programs run on all of them at once
+	void evaluate_surfaces(const std::vector<Ray> & rays, const std::vector<SurfaceHit *> & surfaces) const;
+	// intersect() of many rays, hits are evaluated a body at a time through evaluate_surfaces()
+	void intersect(const std::vector<Ray> & rays, std::vector<SurfaceHit> & surfaces) const;
+	Vec3 shade(Ray ray, const SurfaceHit & surface, BodyMask * touched = nullptr) const;
+
+	// Scene edits, must not be called while any thread is tracing
+	int bodies_count() const { return (int)bodies.size(); }
+	const Body & get_body(int body_number) const { return bodies[body_number]; }
+	void set_body(int body_number, const Body & body);
+	// Several bodies at once from config, for a copy of the tracer. The copy gets its own empty
+	// irradiance cache, the shared one holds light of the old bodies, and its caustics are shot
+	// again with threads_count threads. Nothing changes if the list is empty.
+	void replace_bodies(const std::vector<int> & body_numbers, const Configurer & config, int threads_count);
+	int nearest_body(Ray ray, Vec3 * hit = nullptr, Vec3 * normal = nullptr) const;
+
+	// Diffuse interreflection cache, nullptr when disabled
+	IrradianceCache * irradiance() const { return irradiance_cache.get(); }
+
+	// Directions from a point towards a light's bounding sphere
+	struct LightCone {
+		int body;
+		Vec3 axis;
+		double hemi_part; // 1 - cos of the half angle, fraction of the hemisphere solid angle
+	};
 
 private:
+
+	friend class Wavefront;
 	
 	std::vector<Body> bodies;
 	std::function<Vec3(Vec3)> environment;
+	// Importance sampled sky behind environment, nullptr for the black background
+	std::shared_ptr<EnvironmentMap> environment_map;
+	// Shared by copies of the tracer, it locks internally
+	std::shared_ptr<IrradianceCache> irradiance_cache;
+	// Photons that came through glass bodies, nullptr when disabled
+	std::shared_ptr<PhotonMap> caustics;
+	// Bounded light sources, directly sampled by sampled_diffuse_light()
+	std::vector<int> lights;
 	int MAX_BOUNCE;
 	int DIFFUSE_RAY_COUNT;
 	int DIFFUSE_BOUNCE_VALUE;
+	bool DIFFUSE_MIS;
+	bool FRESNEL;
 	int REFRACTIVE_BOUNCE_VALUE;
 	int REFLECTIVE_BOUNCE_VALUE;
 	double BIAS;
+	int IRRADIANCE_RAY_COUNT;
+	int CAUSTIC_PHOTONS;
+	double CAUSTIC_RADIUS;
+	int CAUSTIC_THREADS;
 
+	// Distance to the nearest body, -1 if none. Position and normal are only computed for that one.
 	double get_nearest_hit(Ray ray, int * body_number = nullptr, Vec3 * hit = nullptr, Vec3 * normal = nullptr) const;
 	int find_medium(Ray ray) const;
+	static Vec3 reflection(Vec3 vec, Vec3 normal);
+	static Vec3 refraction(Vec3 vec, Vec3 normal, double current_index, double next_index);
+	static double fresnel(Vec3 vec, Vec3 normal, double current_index, double next_index);
+	// Specular continuations of a hit within the bounce limits
+	struct SpecularBranches {
+		bool reflect;
+		bool refract;
+		int next_medium; // body behind the surface, -1 if not looked up
+		Vec3 refracted_vec;
+	};
+	// u is a uniform number in [0, 1] picking the branch of Fresnel glass
+	SpecularBranches specular_branches(const Ray & ray, const SurfaceHit & surface, double u) const;
+	bool caustic_caster(int body_number) const;
+	double surface_footprint(const Ray & ray, const SurfaceHit & surface) const;
+	void bump_map(const Ray & ray, SurfaceHit & surface) const;
+	Ray::Path specular_path(Ray::Path path, int body_number) const;
+	void build_caustics(int threads_count);
+	void trace_photon(Ray ray, Vec3 power, int light, int target, std::mt19937 & rng, std::vector<PhotonMap::Photon> & photons) const;
+	// Light arriving from other bodies at a diffuse hit, before multiplying by the diffuse color.
+	// With gradients it also estimates the translational gradient and harmonic mean hit distance.
+	Vec3 diffuse_light(const Ray & ray, Vec3 hit, Vec3 normal, int ray_count, BodyMask * touched,
+		Vec3 * gradients = nullptr, double * harmonic_distance = nullptr) const;
+	// Sky light through unoccluded directions, sampled by its brightness. Normalized like diffuse_light(),
+	// or like simple diffuse lights when lambert is set.
+	Vec3 environment_light(Vec3 hit, Vec3 normal, int ray_count, bool lambert, BodyMask * touched) const;
+	// diffuse_light() interpolated from the irradiance cache, a new record is made if none fits
+	Vec3 cached_diffuse_light(const Ray & ray, Vec3 hit, Vec3 normal, BodyMask * touched) const;
+	// Lambertian diffuse_light() from DIFFUSE_RAY_COUNT cosine weighted rays and as many light samples,
+	// combined with multiple importance sampling. Cost does not depend on the body count.
+	Vec3 sampled_diffuse_light(const Ray & ray, Vec3 hit, Vec3 normal, BodyMask * touched) const;
+	double light_pdf(const std::vector<LightCone> & cones, double hemi_sum, Vec3 direction) const;
+	// Photon map light normalized like the diffuse estimator shade() uses, so caustics match the light next to them
+	Vec3 caustic_light(Vec3 hit, Vec3 normal, BodyMask * touched) const;
+	void find_lights();
 };
 
 #endif // _TRACER_H_
\ No newline at end of file
@@ -0,0 +1,299 @@
+#include "Wavefront.h"
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <algorithm>
+#include "IrradianceCache.h"
+#include "Statistics.h"
+
+void Wavefront::RayQueue::push(Vec3 origin, Vec3 direction, Vec3 weight, int sample, int bounce, int target, Ray::Path path, double cone_width, double cone_spread)
+{
+	ox.push_back(origin.x); oy.push_back(origin.y); oz.push_back(origin.z);
+	dx.push_back(direction.x); dy.push_back(direction.y); dz.push_back(direction.z);
+	wr.push_back(weight.r); wg.push_back(weight.g); wb.push_back(weight.b);
+	this->sample.push_back(sample);
+	this->bounce.push_back(bounce);
+	this->target.push_back(target);
+	this->path.push_back(path);
+	this->cone_width.push_back(cone_width);
+	this->cone_spread.push_back(cone_spread);
+}
+
+template <typename T>
+static void move_tail(std::vector<T> & from, std::vector<T> & to, size_t count)
+{
+	to.assign(from.end() - count, from.end());
+	from.resize(from.size() - count);
+}
+
+void Wavefront::RayQueue::take_back(RayQueue & other, size_t count)
+{
+	move_tail(ox, other.ox, count); move_tail(oy, other.oy, count); move_tail(oz, other.oz, count);
+	move_tail(dx, other.dx, count); move_tail(dy, other.dy, count); move_tail(dz, other.dz, count);
+	move_tail(wr, other.wr, count); move_tail(wg, other.wg, count); move_tail(wb, other.wb, count);
+	move_tail(sample, other.sample, count);
+	move_tail(bounce, other.bounce, count);
+	move_tail(target, other.target, count);
+	move_tail(path, other.path, count);
+	move_tail(cone_width, other.cone_width, count);
+	move_tail(cone_spread, other.cone_spread, count);
+}
+
+void Wavefront::RayQueue::clear()
+{
+	ox.clear(); oy.clear(); oz.clear();
+	dx.clear(); dy.clear(); dz.clear();
+	wr.clear(); wg.clear(); wb.clear();
+	sample.clear();
+	bounce.clear();
+	target.clear();
+	path.clear();
+	cone_width.clear();
+	cone_spread.clear();
+}
+
+Wavefront::Wavefront(const Tracer & tracer, const Configurer & config)
+	: tracer(tracer)
+{
+	this->SCREEN_WIDTH = config.window_width;
+	this->SCREEN_HEIGHT = config.window_height;
+	this->AA_FACTOR = config.aa_factor;
+	this->TEXTURE_LOD = config.texture_lod;
+	this->BATCH_SIZE = config.wavefront_batch > 0 ? config.wavefront_batch : 1;
+}
+
+void Wavefront::render(const Camera & camera, Image & image, int x0, int y0, int width, int height)
+{
+	const int samples_per_pixel = AA_FACTOR * AA_FACTOR;
+	radiance.assign(width * height * samples_per_pixel, Vec3(0.0, 0.0, 0.0));
+
+	// GENERATE
+	queue.clear();
+	double pixel_spread = TEXTURE_LOD ? camera.width / (SCREEN_WIDTH * AA_FACTOR * camera.depth) : 0.0;
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			double dx = (double)(x0 + x) / SCREEN_WIDTH;
+			double dy = (double)(y0 + y) / SCREEN_HEIGHT;
+			for (int ax = 0; ax < AA_FACTOR; ++ax) {
+				for (int ay = 0; ay < AA_FACTOR; ++ay) {
+					Vec3 direction = camera.direction(
+						dx + (double)ax / (SCREEN_WIDTH * AA_FACTOR),
+						dy + (double)ay / (SCREEN_WIDTH * AA_FACTOR));
+					STAT_RAY(CAMERA);
+					queue.push(camera.position, direction.normalized(), Vec3(1.0, 1.0, 1.0),
+						(y * width + x) * samples_per_pixel + ax * AA_FACTOR + ay, 0, -1, Ray::Path::PRIMARY, 0.0, pixel_spread);
+				}
+			}
+		}
+	}
+
+	// Newest rays first keeps the queue from growing with every diffuse fan
+	RayQueue batch;
+	while (queue.size() > 0) {
+		queue.take_back(batch, std::min(BATCH_SIZE, queue.size()));
+		process(batch);
+		process_shadows();
+	}
+
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			Vec3 col = Vec3(0.0, 0.0, 0.0);
+			for (int s = 0; s < samples_per_pixel; ++s) {
+				col = col + radiance[(y * width + x) * samples_per_pixel + s];
+			}
+			image.at(x0 + x, y0 + y) = col / samples_per_pixel;
+		}
+	}
+}
+
+static unsigned spread_bits(unsigned v)
+{
+	v &= 0x3FF;
+	v = (v | (v << 16)) & 0x030000FF;
+	v = (v | (v << 8)) & 0x0300F00F;
+	v = (v | (v << 4)) & 0x030C30C3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+void Wavefront::sort_by_ray(const RayQueue & batch, std::vector<unsigned> & order) const
+{
+	const double CELL = 4.0;
+	std::vector<std::pair<unsigned long long, unsigned>> keys(batch.size());
+	for (size_t i = 0; i < batch.size(); ++i) {
+		unsigned octant = (batch.dx[i] < 0.0 ? 1 : 0) | (batch.dy[i] < 0.0 ? 2 : 0) | (batch.dz[i] < 0.0 ? 4 : 0);
+		unsigned morton = spread_bits((unsigned)(int)floor(batch.ox[i] / CELL))
+			| (spread_bits((unsigned)(int)floor(batch.oy[i] / CELL)) << 1)
+			| (spread_bits((unsigned)(int)floor(batch.oz[i] / CELL)) << 2);
+		keys[i] = std::make_pair(((unsigned long long)octant << 30) | morton, (unsigned)i);
+	}
+	std::sort(keys.begin(), keys.end());
+	order.resize(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i) order[i] = keys[i].second;
+}
+
+void Wavefront::process(RayQueue & batch)
+{
+	std::vector<unsigned> order;
+	std::vector<SurfaceHit> hits(batch.size());
+	std::vector<std::pair<int, unsigned>> alive;
+	alive.reserve(batch.size());
+
+	// INTERSECT
+	sort_by_ray(batch, order);
+	for (size_t k = 0; k < order.size(); ++k) {
+		unsigned i = order[k];
+		SurfaceHit & surface = hits[i];
+		surface.distance = tracer.get_nearest_hit(batch.ray(i), &surface.body, &surface.position, &surface.normal);
+		// Diffuse rays only count the body they were aimed at
+		if (batch.target[i] != -1 && surface.body != batch.target[i]) continue;
+		alive.push_back(std::make_pair(surface.body, i));
+	}
+
+	// MATERIALS AND SHADING, grouped by body so each material code and texture runs in a row
+	std::sort(alive.begin(), alive.end());
+	std::vector<Ray> rays;
+	std::vector<SurfaceHit *> surfaces;
+	for (size_t k = 0; k < alive.size(); k += rays.size()) {
+		rays.clear();
+		surfaces.clear();
+		for (size_t j = k; j < alive.size() && alive[j].first == alive[k].first; ++j) {
+			rays.push_back(batch.ray(alive[j].second));
+			surfaces.push_back(&hits[alive[j].second]);
+		}
+		tracer.evaluate_surfaces(rays, surfaces);
+		for (size_t j = 0; j < rays.size(); ++j) {
+			unsigned i = alive[k + j].second;
+			shade(rays[j], hits[i], batch.weight(i), batch.sample[i]);
+		}
+	}
+	batch.clear();
+}
+
+void Wavefront::process_shadows()
+{
+	std::vector<unsigned> order;
+	sort_by_ray(shadows, order);
+	for (size_t k = 0; k < order.size(); ++k) {
+		unsigned i = order[k];
+		int dst_nearest_number = -1;
+		Vec3 dst_hit, dst_normal;
+		tracer.get_nearest_hit(shadows.ray(i), &dst_nearest_number, &dst_hit, &dst_normal);
+		if (dst_nearest_number == shadows.target[i]) {
+			STAT_TEXTURE(1);
+			radiance[shadows.sample[i]] = radiance[shadows.sample[i]]
+				+ shadows.weight(i) * tracer.bodies[dst_nearest_number].material.light_source_color(dst_hit, dst_normal);
+		}
+	}
+	shadows.clear();
+}
+
+// Tracer::shade() with recursion replaced by queued rays
+void Wavefront::shade(const Ray & ray, const SurfaceHit & surface, Vec3 weight, int sample)
+{
+	STAT_BOUNCE(ray.bounce);
+	const std::vector<Body> & bodies = tracer.bodies;
+	const double BIAS = tracer.BIAS;
+	const int MAX_BOUNCE = tracer.MAX_BOUNCE;
+
+	// Medium absorption of the way here scales everything that comes from the hit
+	if (surface.medium != -1) {
+		weight = weight * (bodies[surface.medium].material.refraction_density * surface.distance).exp();
+	}
+
+	int nearest_body = surface.body;
+	if (nearest_body == -1) {
+		radiance[sample] = radiance[sample] + weight * tracer.environment(ray.direction);
+		return;
+	}
+	const Material & material = bodies[nearest_body].material;
+	Vec3 hit = surface.position;
+	Vec3 normal = surface.normal;
+
+	// LIGHT SOURCE
+	if (material.light_source_color && !(tracer.caustics && ray.path == Ray::Path::CAUSTIC)) {
+		radiance[sample] = radiance[sample] + weight * surface.light_source;
+	}
+	// SIMPLE DIFFUSE
+	if (material.simple_diffuse_color) {
+		for (size_t dst_body_number = 0; dst_body_number < bodies.size(); ++dst_body_number) {
+			if (bodies[dst_body_number].material.light_source_color) {
+				Vec3 shadow_vec = (bodies[dst_body_number].shape->center - hit).normalized();
+				double r = bodies[dst_body_number].shape->radius;
+				double d = (bodies[dst_body_number].shape->center - hit).length();
+				double hemi_part = (r > d) ? 1.0 : 1.0 - sqrt(1.0 - r*r / (d*d));
+				double lambert = shadow_vec.dot(normal);
+				STAT_RAY(SHADOW);
+				// Light behind the surface adds nothing, no need to cast
+				if (lambert > 0.0) {
+					shadows.push(hit + shadow_vec * BIAS, shadow_vec, weight * surface.simple_diffuse * hemi_part * lambert,
+						sample, ray.bounce, (int)dst_body_number, ray.path);
+				}
+			}
+		}
+		if (tracer.environment_map) {
+			radiance[sample] = radiance[sample] + weight * surface.simple_diffuse * tracer.environment_light(hit, normal, 1, true, nullptr);
+		}
+	}
+	// DIFFUSE
+	if (material.diffuse_color && ray.bounce + tracer.DIFFUSE_BOUNCE_VALUE <= MAX_BOUNCE) {
+		Vec3 color_part = Vec3(0.0, 0.0, 0.0);
+		if (tracer.irradiance_cache) {
+			// Records are made depth first, they are rare compared to lookups
+			color_part = tracer.cached_diffuse_light(ray, hit, normal, nullptr);
+		}
+		else if (tracer.DIFFUSE_MIS) {
+			// MIS weights of emission depend on the light cones of this hit, kept depth first
+			color_part = tracer.sampled_diffuse_light(ray, hit, normal, nullptr);
+		}
+		else {
+			const int DIFFUSE_RAY_COUNT = tracer.DIFFUSE_RAY_COUNT;
+			if (tracer.environment_map) {
+				color_part = tracer.environment_light(hit, normal, DIFFUSE_RAY_COUNT, false, nullptr);
+			}
+			for (size_t dst_body_number = 0; dst_body_number < bodies.size(); ++dst_body_number) {
+				// Solid angle
+				double r = bodies[dst_body_number].shape->radius;
+				double d = (bodies[dst_body_number].shape->center - hit).length();
+				double hemi_part = (r > d) ? 1.0 : 1.0 - sqrt(1.0 - r*r / (d*d));
+
+				Vec3 base_vec = (hemi_part == 1.0) ? normal : (bodies[dst_body_number].shape->center - hit).normalized();
+				Vec3 per1 = perpendicular(base_vec);
+				Vec3 per2 = base_vec.cross(per1);
+				Vec3 ray_weight = weight * surface.diffuse * (hemi_part / DIFFUSE_RAY_COUNT);
+
+				for (int i = 0; i < DIFFUSE_RAY_COUNT; ++i) {
+					double cos_phi = 1.0 - ((double)rand() / RAND_MAX) * hemi_part;
+					double sin_phi = sqrt(1.0 - cos_phi*cos_phi);
+					double alpha = 2.0 * M_PI * rand() / RAND_MAX;
+					Vec3 shifted_vec = base_vec * cos_phi + per1 * sin_phi * sin(alpha) + per2 * sin_phi * cos(alpha);
+					if (shifted_vec.dot(normal) > 0.0) {
+						STAT_RAY(DIFFUSE);
+						queue.push(hit + shifted_vec * BIAS, shifted_vec, ray_weight, sample,
+							ray.bounce + tracer.DIFFUSE_BOUNCE_VALUE, (int)dst_body_number, Ray::Path::DIFFUSE,
+							ray.footprint(surface.distance), sqrt(2.0 * M_PI * hemi_part / DIFFUSE_RAY_COUNT));
+					}
+				}
+			}
+		}
+		if (tracer.caustics) {
+			color_part = color_part + tracer.caustic_light(hit, normal, nullptr);
+		}
+		radiance[sample] = radiance[sample] + weight * color_part * surface.diffuse;
+	}
+	Tracer::SpecularBranches branches = tracer.specular_branches(ray, surface, (double)rand() / RAND_MAX);
+	// PURE REFLECTIVE
+	if (branches.reflect) {
+		Vec3 reflected_vec = Tracer::reflection(ray.direction, normal);
+		STAT_RAY(REFLECTIVE);
+		queue.push(hit + reflected_vec * BIAS, reflected_vec, weight * surface.pure_reflective, sample,
+			ray.bounce + tracer.REFLECTIVE_BOUNCE_VALUE, -1, tracer.specular_path(ray.path, nearest_body),
+			ray.footprint(surface.distance), ray.cone_spread);
+	}
+	// REFRACTIVE
+	if (branches.refract) {
+		STAT_RAY(REFRACTIVE);
+		queue.push(hit + branches.refracted_vec * BIAS, branches.refracted_vec, weight * surface.refractive, sample,
+			ray.bounce + tracer.REFRACTIVE_BOUNCE_VALUE, -1, tracer.specular_path(ray.path, nearest_body),
+			ray.footprint(surface.distance), ray.cone_spread);
+	}
+}
\ No newline at end of file
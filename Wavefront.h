@@ -0,0 +1,69 @@
+#pragma once
+
+#ifndef _WAVEFRONT_H_
+#define _WAVEFRONT_H_
+
+#include <vector>
+#include "Configurer.h"
+#include "Tracer.h"
+#include "Camera.h"
+#include "Image.h"
+
+// Breadth-first alternative to the recursive Tracer::trace(). Rays of a whole tile go through
+// stages in large batches: intersect (sorted by direction and origin), evaluate materials and shade
+// (sorted by body), queue secondary and shadow rays. Every ray carries the weight its light gets in
+// the sample it belongs to, so recursion is replaced by adding weighted light into sample sums.
+// Results match trace() in expectation, random numbers are drawn in a different order.
+
+class Wavefront {
+
+public:
+
+	Wavefront(const Tracer & tracer, const Configurer & config);
+
+	// Linear colors of a screen rectangle, same as Render::pixel_color() of every pixel
+	void render(const Camera & camera, Image & image, int x0, int y0, int width, int height);
+
+private:
+
+	// Structure of arrays, stages read only the fields they need
+	struct RayQueue {
+		std::vector<double> ox, oy, oz;
+		std::vector<double> dx, dy, dz;
+		std::vector<double> wr, wg, wb; // weight
+		std::vector<int> sample;
+		std::vector<int> bounce;
+		std::vector<int> target; // body the ray has to hit first, -1 for any
+		std::vector<Ray::Path> path;
+		std::vector<double> cone_width, cone_spread;
+
+		size_t size() const { return ox.size(); }
+		void push(Vec3 origin, Vec3 direction, Vec3 weight, int sample, int bounce, int target, Ray::Path path, double cone_width = 0.0, double cone_spread = 0.0);
+		Ray ray(size_t i) const { return Ray(Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i]), bounce[i], path[i]).with_cone(cone_width[i], cone_spread[i]); }
+		Vec3 weight(size_t i) const { return Vec3(wr[i], wg[i], wb[i]); }
+		// Moves the last count rays to the other queue
+		void take_back(RayQueue & other, size_t count);
+		void clear();
+	};
+
+	void process(RayQueue & batch);
+	void process_shadows();
+	void shade(const Ray & ray, const SurfaceHit & surface, Vec3 weight, int sample);
+	// Batch indices ordered by direction octant, then by origin cell along a Morton curve
+	void sort_by_ray(const RayQueue & batch, std::vector<unsigned> & order) const;
+
+	const Tracer & tracer;
+
+	RayQueue queue;
+	RayQueue shadows;
+	std::vector<Vec3> radiance; // sum of light of every sample
+
+	int SCREEN_WIDTH;
+	int SCREEN_HEIGHT;
+	int AA_FACTOR;
+	bool TEXTURE_LOD;
+	size_t BATCH_SIZE;
+
+};
+
+#endif // _WAVEFRONT_H_
\ No newline at end of file
@@ -1,6 +1,14 @@
 #include "Configurer.h"
 #include "AppSystem.h"
+#include "Cluster.h"
+#include "Sequence.h"
+#include "Budget.h"
+#include "Denoiser.h"
+#include "Tonemap.h"
+#include "ImageTexture.h"
 #include <iostream>
+#include <string>
+#include <stdlib.h>
 
 int main(int argc, char * argv[])
 {
@@ -17,6 +25,65 @@ int main(int argc, char * argv[])
 
 	config.load("default.rtconf");
 
+	// Converts a PPM or PFM image to a texture file for "image" lines of the scene file
+	if (argc >= 4 && std::string(argv[1]) == "--make-texture") {
+		Image image;
+		if (!image.load(argv[2])) return 1;
+		int tile_size = (argc >= 5) ? atoi(argv[4]) : 64;
+		return ImageTexture::convert(image, argv[3], tile_size) ? 0 : 1;
+	}
+
+	// Worker process of a --cluster render
+	if (argc >= 4 && std::string(argv[1]) == "--worker") {
+		ClusterWorker worker(config);
+		return worker.run(argv[2], argv[3]);
+	}
+
+	// Headless render of one frame with worker processes
+	if (argc >= 2 && std::string(argv[1]) == "--cluster") {
+		if (argc >= 3) config.cluster_workers = atoi(argv[2]);
+		Coordinator coordinator(config, argv[0]);
+		Image image;
+		if (coordinator.render(image) != Coordinator::Result::SUCCESS) return 1;
+		Tonemap(config).apply(image);
+		if (config.denoise_iterations > 0) {
+			Render render(config);
+			Denoiser denoiser(config);
+			denoiser.gather(render, render.default_camera());
+			denoiser.apply(image);
+		}
+		std::cout << "Saving " << config.output_path << std::endl;
+		return image.save_ppm(config.output_path) ? 0 : 1;
+	}
+
+	// Headless render of one frame that has to be done in time
+	if (argc >= 2 && std::string(argv[1]) == "--budget") {
+		if (argc >= 3) config.time_budget = atof(argv[2]);
+		BudgetRenderer budget(config, config.time_budget);
+		Image image;
+		budget.render(image);
+		Tonemap(config).apply(image);
+		if (config.denoise_iterations > 0) {
+			Render render(config);
+			Denoiser denoiser(config);
+			denoiser.gather(render, render.default_camera());
+			denoiser.apply(image);
+		}
+		std::cout << "Saving " << config.output_path << std::endl;
+		return image.save_ppm(config.output_path) ? 0 : 1;
+	}
+
+	// Headless render of the animation, all frames or the given range
+	if (argc >= 2 && std::string(argv[1]) == "--sequence") {
+		int first = 0, last = config.frame_count - 1;
+		if (argc >= 4) {
+			first = atoi(argv[2]);
+			last = atoi(argv[3]);
+		}
+		SequenceRenderer sequence(config);
+		return sequence.render(first, last) ? 0 : 1;
+	}
+
 	AppSystem app_system(config);
 	//TODO: Read config
 	AppSystem::InitPhase init_result = app_system.init();